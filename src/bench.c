@@ -0,0 +1,382 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Benchmark mode
+ *
+ * A generator thread writes a known pattern to a pty pair, or to a tty
+ * device with TX and RX shorted by a loopback cable, while the normal
+ * receive path processes it to stdout, log and socket. Every received
+ * block is verified against the pattern after processing, and the time
+ * from handing a chunk to the device until tio has processed its last
+ * byte is recorded as its latency.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include "options.h"
+#include "print.h"
+#include "error.h"
+#include "pace.h"
+#include "misc.h"
+#include "signals.h"
+#include "bench.h"
+
+/* Pattern repeats with this period, chunks never straddle it */
+#define BENCH_PERIOD 65536
+#define BENCH_CHUNK_SIZE 4096
+
+/* Give up waiting for missing bytes after this many ns without input */
+#define BENCH_IDLE_TIMEOUT 2000000000ULL
+
+#define BENCH_TEXT_LINE_LENGTH 64
+
+static struct
+{
+    int master_fd;
+    int tx_fd;
+    pthread_t thread;
+    bool started;
+    char pattern[BENCH_PERIOD];
+    size_t chunk_count;
+    uint64_t *sent;
+    size_t sent_count;
+    bool tx_done;
+    int tx_errno;
+    uint64_t tx_cpu;
+    uint64_t *latency;
+    size_t latency_count;
+    unsigned long rx_count;
+    unsigned long corrupted;
+    uint64_t start;
+    uint64_t last_rx;
+    struct rusage usage;
+} bench = { .master_fd = -1, .tx_fd = -1 };
+
+static uint64_t usage_to_ns(const struct rusage *usage)
+{
+    return ((uint64_t) usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000000ULL +
+           ((uint64_t) usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) * 1000ULL;
+}
+
+static void pattern_generate(void)
+{
+    uint32_t state = 0x2545f491;
+
+    switch (option.bench_pattern)
+    {
+        case BENCH_PATTERN_COUNTER:
+            for (size_t i = 0; i < BENCH_PERIOD; i++)
+            {
+                bench.pattern[i] = i & 0xff;
+            }
+            break;
+
+        case BENCH_PATTERN_RANDOM:
+            for (size_t i = 0; i < BENCH_PERIOD; i++)
+            {
+                /* xorshift32 */
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                bench.pattern[i] = state & 0xff;
+            }
+            break;
+
+        case BENCH_PATTERN_TEXT:
+            for (size_t i = 0; i < BENCH_PERIOD; i += BENCH_TEXT_LINE_LENGTH)
+            {
+                char *line = &bench.pattern[i];
+                int length = snprintf(line, BENCH_TEXT_LINE_LENGTH, "%04zu tio benchmark line ", i / BENCH_TEXT_LINE_LENGTH);
+
+                for (int j = length; j < BENCH_TEXT_LINE_LENGTH - 1; j++)
+                {
+                    line[j] = 'a' + (j % 26);
+                }
+                line[BENCH_TEXT_LINE_LENGTH - 1] = '\n';
+            }
+            break;
+    }
+}
+
+/* Open pty pair to benchmark against when no loopback device is given */
+const char *bench_pty_open(void)
+{
+    char *name;
+
+    bench.master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((bench.master_fd < 0) || (grantpt(bench.master_fd) < 0) || (unlockpt(bench.master_fd) < 0))
+    {
+        error_printf("Could not open pty for benchmark (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    name = strdup(ptsname(bench.master_fd));
+    if (name == NULL)
+    {
+        error_printf("Insufficient memory allocation for benchmark");
+        exit(EXIT_FAILURE);
+    }
+
+    return name;
+}
+
+static bool bench_write(const char *buffer, size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t bytes_written = write(bench.tx_fd, buffer, count);
+        if (bytes_written < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                struct pollfd pfd = { .fd = bench.tx_fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        buffer += bytes_written;
+        count -= bytes_written;
+    }
+
+    return true;
+}
+
+static void *bench_thread(void *arg)
+{
+    size_t offset = 0;
+    struct timespec ts;
+
+    UNUSED(arg);
+
+    for (size_t i = 0; i < bench.chunk_count; i++)
+    {
+        size_t length = MIN((size_t) BENCH_CHUNK_SIZE, option.bench_size - offset);
+
+        /* Stamp chunk before writing so time blocked on the device counts */
+        bench.sent[i] = pace_now();
+        __atomic_store_n(&bench.sent_count, i + 1, __ATOMIC_RELEASE);
+
+        if (!bench_write(&bench.pattern[offset % BENCH_PERIOD], length))
+        {
+            bench.tx_errno = errno;
+            break;
+        }
+        offset += length;
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    bench.tx_cpu = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    __atomic_store_n(&bench.tx_done, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* Start generating pattern, via pty master or the connected tty itself */
+void bench_start(int fd)
+{
+    if (bench.started)
+    {
+        return;
+    }
+
+    pattern_generate();
+
+    bench.tx_fd = (bench.master_fd >= 0) ? bench.master_fd : fd;
+    bench.chunk_count = (option.bench_size + BENCH_CHUNK_SIZE - 1) / BENCH_CHUNK_SIZE;
+    bench.sent = calloc(bench.chunk_count, sizeof(uint64_t));
+    bench.latency = calloc(bench.chunk_count, sizeof(uint64_t));
+    if ((bench.sent == NULL) || (bench.latency == NULL))
+    {
+        error_printf("Insufficient memory allocation for benchmark");
+        exit(EXIT_FAILURE);
+    }
+
+    getrusage(RUSAGE_SELF, &bench.usage);
+    bench.start = pace_now();
+    bench.last_rx = bench.start;
+
+    if (signal_thread_create(&bench.thread, bench_thread, NULL) != 0)
+    {
+        error_printf("Could not start benchmark thread");
+        exit(EXIT_FAILURE);
+    }
+
+    bench.started = true;
+}
+
+/* Verify block which has just been processed and account chunk latencies */
+void bench_rx(const char *buffer, size_t count)
+{
+    uint64_t now = pace_now();
+    size_t sent_count = __atomic_load_n(&bench.sent_count, __ATOMIC_ACQUIRE);
+
+    while (count > 0)
+    {
+        size_t offset = bench.rx_count % BENCH_PERIOD;
+        size_t length = MIN(count, (size_t) (BENCH_PERIOD - offset));
+
+        if (memcmp(buffer, &bench.pattern[offset], length) != 0)
+        {
+            for (size_t i = 0; i < length; i++)
+            {
+                if (buffer[i] != bench.pattern[offset + i])
+                {
+                    bench.corrupted++;
+                }
+            }
+        }
+
+        bench.rx_count += length;
+        buffer += length;
+        count -= length;
+    }
+
+    /* Chunks completed by this block */
+    while ((bench.latency_count < sent_count) &&
+           (MIN((bench.latency_count + 1) * BENCH_CHUNK_SIZE, option.bench_size) <= bench.rx_count))
+    {
+        bench.latency[bench.latency_count] = now - bench.sent[bench.latency_count];
+        bench.latency_count++;
+    }
+
+    bench.last_rx = now;
+}
+
+bool bench_done(void)
+{
+    if (!bench.started)
+    {
+        return false;
+    }
+
+    if (bench.rx_count >= option.bench_size)
+    {
+        return true;
+    }
+
+    /* Missing bytes are considered dropped once input stalls */
+    return __atomic_load_n(&bench.tx_done, __ATOMIC_ACQUIRE) &&
+           ((pace_now() - bench.last_rx) > BENCH_IDLE_TIMEOUT);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double latency_percentile(double percentile)
+{
+    size_t index;
+
+    if (bench.latency_count == 0)
+    {
+        return 0;
+    }
+
+    index = (size_t) (percentile / 100 * (bench.latency_count - 1) + 0.5);
+
+    return bench.latency[index] / 1000.0;
+}
+
+static const char *bench_pattern_to_string(enum bench_pattern_t pattern)
+{
+    switch (pattern)
+    {
+        case BENCH_PATTERN_RANDOM:
+            return "random";
+        case BENCH_PATTERN_TEXT:
+            return "text";
+        default:
+            return "counter";
+    }
+}
+
+/* Print results to stderr so they survive redirecting received data */
+int bench_report(void)
+{
+    struct rusage usage;
+    uint64_t cpu, elapsed;
+    unsigned long dropped;
+    double seconds;
+
+    if (!bench.started)
+    {
+        return TIO_ERROR;
+    }
+
+    pthread_join(bench.thread, NULL);
+    getrusage(RUSAGE_SELF, &usage);
+
+    /* Exclude the generator thread from CPU cost */
+    cpu = usage_to_ns(&usage) - usage_to_ns(&bench.usage);
+    cpu = (cpu > bench.tx_cpu) ? cpu - bench.tx_cpu : 0;
+
+    elapsed = bench.last_rx - bench.start;
+    seconds = elapsed / 1e9;
+    dropped = (bench.rx_count < option.bench_size) ? option.bench_size - bench.rx_count : 0;
+
+    qsort(bench.latency, bench.latency_count, sizeof(uint64_t), compare_latency);
+
+    fflush(stdout);
+    fprintf(stderr, "\r\nBenchmark results:\r\n");
+    fprintf(stderr, " Device: %s\r\n", (bench.master_fd >= 0) ? "pty pair" : option.tty_device);
+    fprintf(stderr, " Pattern: %s, %lu bytes\r\n", bench_pattern_to_string(option.bench_pattern), option.bench_size);
+    fprintf(stderr, " Received: %lu bytes in %.3f s\r\n", bench.rx_count, seconds);
+    fprintf(stderr, " Throughput: %.0f bytes/s\r\n", (seconds > 0) ? bench.rx_count / seconds : 0);
+    fprintf(stderr, " CPU cost: %.2f ns/byte\r\n", bench.rx_count ? (double) cpu / bench.rx_count : 0);
+    fprintf(stderr, " Latency (us): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\r\n",
+            latency_percentile(50), latency_percentile(90), latency_percentile(99), latency_percentile(100));
+    fprintf(stderr, " Dropped: %lu bytes\r\n", dropped);
+    fprintf(stderr, " Corrupted: %lu bytes\r\n", bench.corrupted);
+
+    if (bench.tx_errno != 0)
+    {
+        error_printf("Could not write benchmark pattern (%s)", strerror(bench.tx_errno));
+    }
+
+    free(bench.sent);
+    free(bench.latency);
+
+    return ((dropped == 0) && (bench.corrupted == 0) && (bench.tx_errno == 0)) ? TIO_SUCCESS : TIO_ERROR;
+}
@@ -0,0 +1,258 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Binary capture
+ *
+ * A capture file starts with a header followed by records, each of which
+ * holds a chunk of received (RX) or sent (TX) bytes, a modem line state
+ * change or serial driver error counts, stamped with the wall clock time
+ * in nanoseconds. Every record is written with a single writev() of its
+ * header and payload. All fields are in host byte order.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "options.h"
+#include "print.h"
+#include "error.h"
+#include "pace.h"
+#include "capture.h"
+
+#define CAPTURE_MAGIC "TIOCAP"
+#define CAPTURE_VERSION 1
+
+struct capture_header_t
+{
+    char magic[6];
+    uint16_t version;
+    uint64_t reserved;
+};
+
+struct capture_record_t
+{
+    uint64_t timestamp;
+    uint32_t length;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+struct capture_t
+{
+    int fd;
+    char *filename;
+};
+
+static uint64_t capture_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct capture_t *capture_open(const char *filename)
+{
+    struct capture_header_t header = { .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION };
+    struct capture_t *capture;
+
+    capture = calloc(1, sizeof(struct capture_t));
+    if (capture == NULL)
+    {
+        error_printf("Insufficient memory allocation for capture");
+        exit(EXIT_FAILURE);
+    }
+
+    capture->filename = strdup(filename);
+    capture->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture->fd < 0)
+    {
+        error_printf("Could not open capture file %s (%s)", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (write(capture->fd, &header, sizeof(header)) != sizeof(header))
+    {
+        error_printf("Could not write capture file %s (%s)", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return capture;
+}
+
+void capture_write(struct capture_t *capture, enum capture_type_t type, const void *buffer, size_t count)
+{
+    if ((capture == NULL) || (count == 0))
+    {
+        return;
+    }
+
+    struct capture_record_t record = { .timestamp = capture_time(), .length = count, .type = type };
+    struct iovec iov[2] =
+    {
+        { .iov_base = &record, .iov_len = sizeof(record) },
+        { .iov_base = (void *) buffer, .iov_len = count },
+    };
+
+    if (writev(capture->fd, iov, 2) < 0)
+    {
+        warning_printf("Could not write capture file %s (%s)", capture->filename, strerror(errno));
+    }
+}
+
+void capture_lines(struct capture_t *capture, int state)
+{
+    uint32_t lines = state;
+
+    capture_write(capture, CAPTURE_LINES, &lines, sizeof(lines));
+}
+
+/* Errors counted by serial driver since previous record */
+void capture_errors(struct capture_t *capture, unsigned int overrun, unsigned int buf_overrun,
+                    unsigned int frame, unsigned int parity, unsigned int brk)
+{
+    uint32_t counts[5] = { overrun, buf_overrun, frame, parity, brk };
+
+    capture_write(capture, CAPTURE_ERRORS, counts, sizeof(counts));
+}
+
+/* Write all of buffer, waiting for output to drain if needed */
+static int replay_write(int fd, const char *buffer, size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t status = write(fd, buffer, count);
+        if (status < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EINTR))
+            {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        buffer += status;
+        count -= status;
+    }
+
+    return 0;
+}
+
+int capture_replay(const char *filename, int fd)
+{
+    const struct capture_header_t *header;
+    const char *data, *end, *p;
+    uint64_t first_timestamp = 0;
+    uint64_t start = pace_now();
+    bool first = true;
+    struct stat st;
+    int file;
+
+    file = open(filename, O_RDONLY);
+    if (file < 0)
+    {
+        error_printf("Could not open capture file %s (%s)", filename, strerror(errno));
+        return TIO_ERROR;
+    }
+
+    if ((fstat(file, &st) < 0) || ((size_t) st.st_size < sizeof(struct capture_header_t)))
+    {
+        error_printf("Invalid capture file %s", filename);
+        close(file);
+        return TIO_ERROR;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED)
+    {
+        error_printf("Could not map capture file %s (%s)", filename, strerror(errno));
+        return TIO_ERROR;
+    }
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+
+    header = (const struct capture_header_t *) data;
+    if ((memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != CAPTURE_VERSION))
+    {
+        error_printf("Invalid capture file %s", filename);
+        munmap((void *) data, st.st_size);
+        return TIO_ERROR;
+    }
+
+    end = data + st.st_size;
+    p = data + sizeof(struct capture_header_t);
+
+    /* Play back received data, keeping original timing scaled by speed */
+    while ((size_t) (end - p) >= sizeof(struct capture_record_t))
+    {
+        struct capture_record_t record;
+
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+        if (record.length > (size_t) (end - p))
+        {
+            warning_printf("Capture file %s is truncated", filename);
+            break;
+        }
+
+        if (first)
+        {
+            first_timestamp = record.timestamp;
+            first = false;
+        }
+
+        if (record.type == CAPTURE_RX)
+        {
+            if (option.replay_speed > 0)
+            {
+                pace_sleep_until(start + (uint64_t) ((record.timestamp - first_timestamp) / option.replay_speed));
+            }
+
+            if (replay_write(fd, p, record.length) < 0)
+            {
+                error_printf("Could not write replayed data (%s)", strerror(errno));
+                munmap((void *) data, st.st_size);
+                return TIO_ERROR;
+            }
+        }
+
+        p += record.length;
+    }
+
+    munmap((void *) data, st.st_size);
+
+    return TIO_SUCCESS;
+}
@@ -0,0 +1,41 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+enum capture_type_t
+{
+    CAPTURE_RX,
+    CAPTURE_TX,
+    CAPTURE_LINES,
+    CAPTURE_ERRORS,
+};
+
+struct capture_t;
+
+struct capture_t *capture_open(const char *filename);
+void capture_write(struct capture_t *capture, enum capture_type_t type, const void *buffer, size_t count);
+void capture_lines(struct capture_t *capture, int state);
+void capture_errors(struct capture_t *capture, unsigned int overrun, unsigned int buf_overrun,
+                    unsigned int frame, unsigned int parity, unsigned int brk);
+int capture_replay(const char *filename, int fd);
@@ -42,35 +42,23 @@
 #include "options.h"
 #include "error.h"
 #include "print.h"
+#include "trigger.h"
 
 static struct config_t *c;
 
-static int get_match(const char *input, const char *pattern, char **match)
+static int get_match(const char *input, const regex_t *re, char **match)
 {
     int ret;
     int len = 0;
-    regex_t re;
     regmatch_t m[2];
-    char err[128];
-
-    /* compile a regex with the pattern */
-    ret = regcomp(&re, pattern, REG_EXTENDED);
-    if (ret)
-    {
-        regerror(ret, &re, err, sizeof(err));
-        fprintf(stderr, "regex error: %s", err);
-        return ret;
-    }
 
     /* try to match on input */
-    ret = regexec(&re, input, 2, m, 0);
+    ret = regexec(re, input, 2, m, 0);
     if (!ret)
     {
         len = m[1].rm_eo - m[1].rm_so;
     }
 
-    regfree(&re);
-
     if (len)
     {
         asprintf(match, "%s", &input[m[1].rm_so]);
@@ -80,208 +68,562 @@ static int get_match(const char *input, const char *pattern, char **match)
 }
 
 /**
- * data_handler() - walk config file to load parameters matching user input
+ * data_handler() - load parameter of section matching user input
  *
- * INIH handler used to get all parameters from a given section
+ * Called for each setting of the default and the resolved section, in order
  */
-static int data_handler(void *user, const char *section, const char *name,
-                        const char *value)
+static void data_handler(const char *name, const char *value)
 {
-    UNUSED(user);
-
-    // If section matches current section being parsed
-    if (!strcmp(section, c->section_name))
+    // Set configuration parameter if found
+    if (!strcmp(name, "tty"))
+    {
+        asprintf(&c->tty, value, c->match);
+        option.tty_device = c->tty;
+    }
+    else if (!strcmp(name, "baudrate"))
+    {
+        option.baudrate = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "databits"))
+    {
+        option.databits = atoi(value);
+    }
+    else if (!strcmp(name, "flow"))
+    {
+        asprintf(&c->flow, "%s", value);
+        option.flow = c->flow;
+    }
+    else if (!strcmp(name, "stopbits"))
+    {
+        option.stopbits = atoi(value);
+    }
+    else if (!strcmp(name, "parity"))
+    {
+        asprintf(&c->parity, "%s", value);
+        option.parity = c->parity;
+    }
+    else if (!strcmp(name, "output-delay"))
+    {
+        option.output_delay = delay_option_parse(value);
+    }
+    else if (!strcmp(name, "output-line-delay"))
+    {
+        option.output_line_delay = delay_option_parse(value);
+    }
+    else if (!strcmp(name, "output-rate"))
+    {
+        option.output_rate = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "rx-buffer-size"))
+    {
+        option.rx_buffer_size = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "low-latency"))
+    {
+        if (!strcmp(value, "enable"))
+        {
+            option.low_latency = true;
+        }
+        else if (!strcmp(value, "disable"))
+        {
+            option.low_latency = false;
+        }
+    }
+    else if (!strcmp(name, "rx-priority"))
+    {
+        option.rx_priority = rx_priority_option_parse(value);
+    }
+    else if (!strcmp(name, "rx-cpu"))
+    {
+        option.rx_cpu = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "stream-size"))
+    {
+        option.stream_size = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "stream-timeout"))
+    {
+        option.stream_timeout = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "script"))
+    {
+        asprintf(&c->script_filename, "%s", value);
+        option.script_filename = c->script_filename;
+    }
+    else if (!strcmp(name, "scrollback"))
+    {
+        option.scrollback_size = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "scrollback-compress"))
+    {
+        if (!strcmp(value, "enable"))
+        {
+            option.scrollback_compress = true;
+        }
+        else if (!strcmp(value, "disable"))
+        {
+            option.scrollback_compress = false;
+        }
+    }
+    else if (!strcmp(name, "no-autoconnect"))
+    {
+        if (!strcmp(value, "enable"))
+        {
+            option.no_autoconnect = true;
+        }
+        else if (!strcmp(value, "disable"))
+        {
+            option.no_autoconnect = false;
+        }
+    }
+    else if (!strcmp(name, "log"))
     {
-        // Set configuration parameter if found
-        if (!strcmp(name, "tty"))
+        if (!strcmp(value, "enable"))
         {
-            asprintf(&c->tty, value, c->match);
-            option.tty_device = c->tty;
+            option.log = true;
         }
-        else if (!strcmp(name, "baudrate"))
+        else if (!strcmp(value, "disable"))
         {
-            option.baudrate = string_to_long((char *)value);
+            option.log = false;
         }
-        else if (!strcmp(name, "databits"))
+    }
+    else if (!strcmp(name, "log-file"))
+    {
+        asprintf(&c->log_filename, "%s", value);
+        option.log_filename = c->log_filename;
+    }
+    else if (!strcmp(name, "capture"))
+    {
+        asprintf(&c->capture_filename, "%s", value);
+        option.capture_filename = c->capture_filename;
+    }
+    else if (!strcmp(name, "log-strip"))
+    {
+        if (!strcmp(value, "enable"))
         {
-            option.databits = atoi(value);
+            option.log_strip = true;
         }
-        else if (!strcmp(name, "flow"))
+        else if (!strcmp(value, "disable"))
         {
-            asprintf(&c->flow, "%s", value);
-            option.flow = c->flow;
+            option.log_strip = false;
         }
-        else if (!strcmp(name, "stopbits"))
+    }
+    else if (!strcmp(name, "log-async"))
+    {
+        if (!strcmp(value, "enable"))
         {
-            option.stopbits = atoi(value);
+            option.log_async = true;
         }
-        else if (!strcmp(name, "parity"))
+        else if (!strcmp(value, "disable"))
         {
-            asprintf(&c->parity, "%s", value);
-            option.parity = c->parity;
+            option.log_async = false;
         }
-        else if (!strcmp(name, "output-delay"))
+    }
+    else if (!strcmp(name, "log-buffer-size"))
+    {
+        option.log_buffer_size = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "log-fsync-interval"))
+    {
+        option.log_fsync_interval = atoi(value);
+    }
+    else if (!strcmp(name, "log-rotate-size"))
+    {
+        option.log_rotate_size = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "log-rotate-interval"))
+    {
+        option.log_rotate_interval = string_to_long((char *)value);
+    }
+    else if (!strcmp(name, "log-compress"))
+    {
+        if (!strcmp(value, "enable"))
         {
-            option.output_delay = atoi(value);
+            option.log_compress = true;
         }
-        else if (!strcmp(name, "no-autoconnect"))
+        else if (!strcmp(value, "disable"))
         {
-            if (!strcmp(value, "enable"))
-            {
-                option.no_autoconnect = true;
-            }
-            else if (!strcmp(value, "disable"))
-            {
-                option.no_autoconnect = false;
-            }
+            option.log_compress = false;
         }
-        else if (!strcmp(name, "log"))
+    }
+    else if (!strcmp(name, "stats-interval"))
+    {
+        option.stats_interval = atoi(value);
+    }
+    else if (!strcmp(name, "stats-file"))
+    {
+        asprintf(&c->stats_filename, "%s", value);
+        option.stats_filename = c->stats_filename;
+    }
+    else if (!strcmp(name, "local-echo"))
+    {
+        if (!strcmp(value, "enable"))
         {
-            if (!strcmp(value, "enable"))
-            {
-                option.log = true;
-            }
-            else if (!strcmp(value, "disable"))
-            {
-                option.log = false;
-            }
+            option.local_echo = true;
         }
-        else if (!strcmp(name, "log-file"))
+        else if (!strcmp(value, "disable"))
         {
-            asprintf(&c->log_filename, "%s", value);
-            option.log_filename = c->log_filename;
+            option.local_echo = false;
         }
-        else if (!strcmp(name, "log-strip"))
+    }
+    else if (!strcmp(name, "hexadecimal"))
+    {
+        if (!strcmp(value, "enable"))
+        {
+            option.hex_mode = true;
+        }
+        else if (!strcmp(value, "disable"))
+        {
+            option.hex_mode = false;
+        }
+    }
+    else if (!strcmp(name, "hexadecimal-dump"))
+    {
+        if (!strcmp(value, "enable"))
         {
-            if (!strcmp(value, "enable"))
-            {
-                option.log_strip = true;
-            }
-            else if (!strcmp(value, "disable"))
-            {
-                option.log_strip = false;
-            }
+            option.hex_dump = true;
         }
-        else if (!strcmp(name, "local-echo"))
+        else if (!strcmp(value, "disable"))
+        {
+            option.hex_dump = false;
+        }
+    }
+    else if (!strcmp(name, "timestamp"))
+    {
+        if (!strcmp(value, "enable"))
+        {
+            option.timestamp = TIMESTAMP_24HOUR;
+        }
+        else if (!strcmp(value, "disable"))
+        {
+            option.timestamp = TIMESTAMP_NONE;
+        }
+    }
+    else if (!strcmp(name, "timestamp-format"))
+    {
+        option.timestamp = timestamp_option_parse(value);
+    }
+    else if (!strcmp(name, "timestamp-resolution"))
+    {
+        option.timestamp_resolution = timestamp_resolution_option_parse(value);
+    }
+    else if (!strcmp(name, "map"))
+    {
+        asprintf(&c->map, "%s", value);
+        option.map = c->map;
+    }
+    else if (!strcmp(name, "color"))
+    {
+        if (!strcmp(value, "list"))
+        {
+            // Ignore
+            return;
+        }
+
+        if (!strcmp(value, "none"))
         {
-            if (!strcmp(value, "enable"))
-            {
-                option.local_echo = true;
-            }
-            else if (!strcmp(value, "disable"))
-            {
-                option.local_echo = false;
-            }
+            option.color = -1; // No color
+            return;
         }
-        else if (!strcmp(name, "hexadecimal"))
+
+        option.color = atoi(value);
+        if ((option.color < 0) || (option.color > 255))
         {
-            if (!strcmp(value, "enable"))
-            {
-                option.hex_mode = true;
-            }
-            else if (!strcmp(value, "disable"))
-            {
-                option.hex_mode = false;
-            }
+            option.color = -1; // No color
         }
-        else if (!strcmp(name, "timestamp"))
+    }
+    else if (!strcmp(name, "socket"))
+    {
+        asprintf(&c->socket, "%s", value);
+        option.socket = c->socket;
+    }
+    else if (!strcmp(name, "socket-policy"))
+    {
+        option.socket_policy = socket_policy_option_parse(value);
+    }
+    else if (!strcmp(name, "socket-protocol"))
+    {
+        option.socket_protocol = socket_protocol_option_parse(value);
+    }
+    else if (!strcmp(name, "trigger"))
+    {
+        trigger_add(value);
+    }
+}
+
+/* Sub-configuration, sections appearing more than once are merged */
+struct config_section_t
+{
+    char *name;
+    struct config_entry_t
+    {
+        char *name;
+        char *value;
+    } *entries;
+    int entries_count;
+};
+
+/* Section pattern, in order of appearance */
+struct config_pattern_t
+{
+    int section;
+    char *pattern;
+    size_t prefix_length;
+    regex_t re;
+    enum
+    {
+        PATTERN_NOT_COMPILED,
+        PATTERN_COMPILED,
+        PATTERN_INVALID,
+    } state;
+};
+
+/* Configuration file as parsed once, sections hashed by name */
+static struct
+{
+    struct config_section_t *sections;
+    int sections_count;
+    int *hash;
+    int hash_size;
+    struct config_pattern_t *patterns;
+    int patterns_count;
+} config_index;
+
+static void *config_realloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+
+    if (p == NULL)
+    {
+        fprintf(stderr, "Error: Insufficient memory allocation");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+/* FNV-1a */
+static unsigned int config_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name)
+    {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* Hash slot of section name, either holding it or empty */
+static int *config_hash_slot(const char *name)
+{
+    unsigned int mask = config_index.hash_size - 1;
+    unsigned int i = config_hash(name) & mask;
+
+    while (config_index.hash[i] != 0)
+    {
+        if (!strcmp(config_index.sections[config_index.hash[i] - 1].name, name))
         {
-            if (!strcmp(value, "enable"))
-            {
-                option.timestamp = TIMESTAMP_24HOUR;
-            }
-            else if (!strcmp(value, "disable"))
-            {
-                option.timestamp = TIMESTAMP_NONE;
-            }
+            break;
         }
-        else if (!strcmp(name, "timestamp-format"))
+        i = (i + 1) & mask;
+    }
+
+    return &config_index.hash[i];
+}
+
+static int config_section_find(const char *name)
+{
+    if (config_index.hash_size == 0)
+    {
+        return -1;
+    }
+
+    return *config_hash_slot(name) - 1;
+}
+
+static int config_section_add(const char *name)
+{
+    struct config_section_t *section;
+
+    /* Keep hash table at most half full */
+    if ((config_index.sections_count + 1) * 2 > config_index.hash_size)
+    {
+        int size = config_index.hash_size ? config_index.hash_size * 2 : 64;
+
+        free(config_index.hash);
+        config_index.hash = calloc(size, sizeof(int));
+        if (config_index.hash == NULL)
         {
-            option.timestamp = timestamp_option_parse(value);
+            fprintf(stderr, "Error: Insufficient memory allocation");
+            exit(EXIT_FAILURE);
         }
-        else if (!strcmp(name, "map"))
+        config_index.hash_size = size;
+        for (int i = 0; i < config_index.sections_count; i++)
         {
-            asprintf(&c->map, "%s", value);
-            option.map = c->map;
+            *config_hash_slot(config_index.sections[i].name) = i + 1;
         }
-        else if (!strcmp(name, "color"))
+    }
+
+    config_index.sections = config_realloc(config_index.sections,
+                                           (config_index.sections_count + 1) * sizeof(struct config_section_t));
+    section = &config_index.sections[config_index.sections_count++];
+    memset(section, 0, sizeof(struct config_section_t));
+    section->name = strdup(name);
+    *config_hash_slot(name) = config_index.sections_count;
+
+    return config_index.sections_count - 1;
+}
+
+static void config_pattern_add(int section, const char *pattern)
+{
+    struct config_pattern_t *p;
+
+    config_index.patterns = config_realloc(config_index.patterns,
+                                           (config_index.patterns_count + 1) * sizeof(struct config_pattern_t));
+    p = &config_index.patterns[config_index.patterns_count++];
+    p->section = section;
+    p->pattern = strdup(pattern);
+    p->state = PATTERN_NOT_COMPILED;
+
+    /* Literal text any match of an anchored pattern must start with */
+    p->prefix_length = 0;
+    if ((pattern[0] == '^') && (strchr(pattern, '|') == NULL))
+    {
+        p->prefix_length = strcspn(pattern + 1, ".[]()*+?{}|\\^$");
+        if (p->prefix_length && strchr("*?{", pattern[1 + p->prefix_length]) &&
+            (pattern[1 + p->prefix_length] != '\0'))
         {
-            if (!strcmp(value, "list"))
-            {
-                // Ignore
-                return 0;
-            }
+            /* Last literal is quantified, so optional */
+            p->prefix_length--;
+        }
+    }
+}
 
-            if (!strcmp(value, "none"))
-            {
-                option.color = -1; // No color
-                return 0;
-            }
+/* Compile regex of pattern on first use, most are never needed */
+static bool config_pattern_compile(struct config_pattern_t *p)
+{
+    char err[128];
+    int ret;
+
+    if (p->state == PATTERN_NOT_COMPILED)
+    {
+        /* compile a regex with the pattern */
+        ret = regcomp(&p->re, p->pattern, REG_EXTENDED);
+        if (ret)
+        {
+            regerror(ret, &p->re, err, sizeof(err));
+            fprintf(stderr, "regex error: %s", err);
+        }
+        p->state = ret ? PATTERN_INVALID : PATTERN_COMPILED;
+    }
 
-            option.color = atoi(value);
-            if ((option.color < 0) || (option.color > 255))
-            {
-                option.color = -1; // No color
-            }
-        }
-        else if (!strcmp(name, "socket"))
-        {
-            asprintf(&c->socket, "%s", value);
-            option.socket = c->socket;
-        }
-    }
-    return 0;
+    return p->state == PATTERN_COMPILED;
 }
 
 /**
- * section_pattern_search_handler() - walk config file to find section matching user input
+ * index_handler() - walk config file to index all sections
  *
- * INIH handler used to resolve the section matching the user's input.
- * This will look for the pattern element of each section and try to match it
- * with the user input.
+ * INIH handler used to store each setting with its section, and to collect
+ * section patterns, so that the file only needs to be parsed once.
  */
-static int section_pattern_search_handler(void *user, const char *section, const char *varname,
-                                          const char *varval)
+static int index_handler(void *user, const char *section, const char *name,
+                         const char *value)
 {
-    UNUSED(user);
+    struct config_section_t *s;
+    int i;
 
-    if (strcmp(varname, "pattern"))
-        return 0;
+    UNUSED(user);
 
-    if (!strcmp(varval, c->user))
+    i = config_section_find(section);
+    if (i < 0)
     {
-        /* pattern matches as plain text */
-        asprintf(&c->section_name, "%s", section);
+        i = config_section_add(section);
     }
-    else if (get_match(c->user, varval, &c->match) > 0)
+    s = &config_index.sections[i];
+
+    s->entries = config_realloc(s->entries, (s->entries_count + 1) * sizeof(struct config_entry_t));
+    s->entries[s->entries_count].name = strdup(name);
+    s->entries[s->entries_count].value = strdup(value);
+    s->entries_count++;
+
+    if (!strcmp(name, "pattern"))
     {
-        /* pattern matches as regex */
-        asprintf(&c->section_name, "%s", section);
+        config_pattern_add(i, value);
     }
 
-    return 0;
+    return 1;
 }
 
 /**
- * section_pattern_search_handler() - walk config file to find section matching user input
+ * config_section_resolve() - find section matching user input
  *
- * INIH handler used to resolve the section matching the user's input.
- * This will try to match the user input against a section with the name of the user input.
+ * Tries to match the user input against the pattern of each section, first
+ * as plain text and then as regex, and otherwise against the section names.
+ * When several patterns match, the last one in the file wins.
  */
-static int section_name_search_handler(void *user, const char *section, const char *varname,
-                                       const char *varval)
+static int config_section_resolve(const char *user)
 {
-    UNUSED(user);
-    UNUSED(varname);
-    UNUSED(varval);
+    for (int i = config_index.patterns_count - 1; i >= 0; i--)
+    {
+        struct config_pattern_t *p = &config_index.patterns[i];
 
-    if (!strcmp(section, c->user))
+        if (!strcmp(p->pattern, user))
+        {
+            /* pattern matches as plain text */
+            return p->section;
+        }
+        else if (strncmp(user, p->pattern + 1, p->prefix_length))
+        {
+            /* can not match as regex, no need to compile it */
+            continue;
+        }
+        else if (config_pattern_compile(p) && (get_match(user, &p->re, &c->match) > 0))
+        {
+            /* pattern matches as regex */
+            return p->section;
+        }
+    }
+
+    /* section name matches as plain text */
+    return config_section_find(user);
+}
+
+static void config_section_apply(int i)
+{
+    struct config_section_t *section = &config_index.sections[i];
+
+    for (int j = 0; j < section->entries_count; j++)
     {
-        /* section name matches as plain text */
-        asprintf(&c->section_name, "%s", section);
+        data_handler(section->entries[j].name, section->entries[j].value);
     }
+}
 
-    return 0;
+static void config_index_free(void)
+{
+    for (int i = 0; i < config_index.sections_count; i++)
+    {
+        for (int j = 0; j < config_index.sections[i].entries_count; j++)
+        {
+            free(config_index.sections[i].entries[j].name);
+            free(config_index.sections[i].entries[j].value);
+        }
+        free(config_index.sections[i].entries);
+        free(config_index.sections[i].name);
+    }
+    for (int i = 0; i < config_index.patterns_count; i++)
+    {
+        if (config_index.patterns[i].state == PATTERN_COMPILED)
+        {
+            regfree(&config_index.patterns[i].re);
+        }
+        free(config_index.patterns[i].pattern);
+    }
+    free(config_index.sections);
+    free(config_index.patterns);
+    free(config_index.hash);
+    memset(&config_index, 0, sizeof(config_index));
 }
 
 static int resolve_config_file(void)
@@ -317,6 +659,7 @@ static int resolve_config_file(void)
 
 void config_file_parse(void)
 {
+    int section;
     int ret;
 
     c = malloc(sizeof(struct config_t));
@@ -342,36 +685,34 @@ void config_file_parse(void)
         return;
     }
 
-    // Parse default (unnamed) settings
-    asprintf(&c->section_name, "%s", "");
-    ret = ini_parse(c->path, data_handler, NULL);
+    // Parse configuration file once into section index
+    ret = ini_parse(c->path, index_handler, NULL);
     if (ret < 0)
     {
         fprintf(stderr, "Error: Unable to parse configuration file (%d)", ret);
         exit(EXIT_FAILURE);
     }
-    free(c->section_name);
-    c->section_name = NULL;
 
-    // Find matching section
-    ret = ini_parse(c->path, section_pattern_search_handler, NULL);
-    if (!c->section_name)
+    // Apply default (unnamed) settings
+    section = config_section_find("");
+    if (section >= 0)
     {
-        ret = ini_parse(c->path, section_name_search_handler, NULL);
-        if (!c->section_name)
-        {
-            debug_printf("Unable to match user input to configuration section (%d)", ret);
-            return;
-        }
+        config_section_apply(section);
     }
 
-    // Parse settings of found section (sub config)
-    ret = ini_parse(c->path, data_handler, NULL);
-    if (ret < 0)
+    // Find matching section
+    section = config_section_resolve(c->user);
+    if (section < 0)
     {
-        fprintf(stderr, "Error: Unable to parse configuration file (%d)", ret);
-        exit(EXIT_FAILURE);
+        debug_printf("Unable to match user input to configuration section");
+        config_index_free();
+        return;
     }
+    asprintf(&c->section_name, "%s", config_index.sections[section].name);
+
+    // Apply settings of found section (sub config)
+    config_section_apply(section);
+    config_index_free();
 
     atexit(&config_exit);
 }
@@ -382,6 +723,9 @@ void config_exit(void)
     free(c->flow);
     free(c->parity);
     free(c->log_filename);
+    free(c->capture_filename);
+    free(c->stats_filename);
+    free(c->script_filename);
     free(c->map);
 
     free(c->match);
@@ -34,6 +34,9 @@ struct config_t
 	char *flow;
 	char *parity;
 	char *log_filename;
+	char *capture_filename;
+	char *stats_filename;
+	char *script_filename;
 	char *socket;
 	char *map;
 };
@@ -0,0 +1,539 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Serial device database
+ *
+ * Builds a table of the serial devices present, with their metadata, in one
+ * pass over sysfs on Linux: driver, USB vendor/product ID, serial number and
+ * description, the /dev/serial/by-id/ and by-path/ links pointing at each
+ * device and which process (if any) holds a lock on it. Locks are looked up
+ * in /proc/locks rather than by opening the device, as opening a serial port
+ * toggles its modem lines and may reset the attached board. Elsewhere only
+ * the device files found in PATH_SERIAL_DEVICES are listed.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+#include "options.h"
+#include "devices.h"
+
+#ifdef __APPLE__
+#define PATH_SERIAL_DEVICES "/dev/"
+#else
+#define PATH_SERIAL_DEVICES "/dev/serial/by-id/"
+#endif
+
+static struct device_t *devices = NULL;
+static int devices_count = 0;
+static bool devices_scanned = false;
+
+static struct device_t *devices_add(const char *path)
+{
+    struct device_t *device;
+
+    device = realloc(devices, (devices_count + 1) * sizeof(struct device_t));
+    if (device == NULL)
+    {
+        return NULL;
+    }
+    devices = device;
+    device = &devices[devices_count++];
+
+    memset(device, 0, sizeof(struct device_t));
+    device->path = strdup(path);
+
+    return device;
+}
+
+static int devices_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct device_t *) a)->path, ((const struct device_t *) b)->path);
+}
+
+#ifdef __linux__
+
+/* Read first line of sysfs attribute, NULL if missing or empty */
+static char *sysfs_read(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    char line[256];
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    if (fgets(line, sizeof(line), file) == NULL)
+    {
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    line[strcspn(line, "\n")] = '\0';
+
+    return (line[0] != '\0') ? strdup(line) : NULL;
+}
+
+/* Name of object a sysfs link points to (driver, subsystem) */
+static char *sysfs_link_name(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    ssize_t length;
+    char *slash;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    length = readlink(path, target, sizeof(target) - 1);
+    if (length < 0)
+    {
+        return NULL;
+    }
+    target[length] = '\0';
+
+    slash = strrchr(target, '/');
+
+    return strdup(slash ? slash + 1 : target);
+}
+
+static bool sysfs_is_subsystem(const char *dir, const char *subsystem)
+{
+    char *name = sysfs_link_name(dir, "subsystem");
+    bool match = (name != NULL) && !strcmp(name, subsystem);
+
+    free(name);
+
+    return match;
+}
+
+static void devices_scan_sysfs(void)
+{
+    DIR *d = opendir("/sys/class/tty");
+    struct dirent *dir;
+
+    if (d == NULL)
+    {
+        return;
+    }
+
+    while ((dir = readdir(d)) != NULL)
+    {
+        char class_dir[PATH_MAX];
+        char device_dir[PATH_MAX];
+        char path[PATH_MAX];
+        struct device_t *device;
+        struct stat st;
+        char *type;
+        char *slash;
+
+        if (dir->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        /* Virtual terminals and ptys have no device behind them */
+        snprintf(class_dir, sizeof(class_dir), "/sys/class/tty/%s", dir->d_name);
+        snprintf(path, sizeof(path), "/sys/class/tty/%s/device", dir->d_name);
+        if (realpath(path, device_dir) == NULL)
+        {
+            continue;
+        }
+
+        /* Legacy 8250 ports are registered whether or not a UART is present */
+        type = sysfs_read(class_dir, "type");
+        if ((type != NULL) && !strcmp(type, "0"))
+        {
+            free(type);
+            continue;
+        }
+        free(type);
+
+        snprintf(path, sizeof(path), "/dev/%s", dir->d_name);
+        device = devices_add(path);
+        if (device == NULL)
+        {
+            break;
+        }
+
+        /* Identity of device file, for matching lock holders */
+        if (stat(device->path, &st) == 0)
+        {
+            device->file_dev = st.st_dev;
+            device->file_ino = st.st_ino;
+        }
+
+        /* Look past serial core port devices for the actual driver */
+        while (sysfs_is_subsystem(device_dir, "serial-base") && ((slash = strrchr(device_dir, '/')) != NULL))
+        {
+            *slash = '\0';
+        }
+        device->driver = sysfs_link_name(device_dir, "driver");
+
+        /* USB attributes live on the USB device, some levels above the interface */
+        while (strlen(device_dir) > strlen("/sys/devices"))
+        {
+            snprintf(path, sizeof(path), "%.*s/idVendor", (int) (sizeof(path) - 16), device_dir);
+            if (access(path, R_OK) == 0)
+            {
+                device->vid = sysfs_read(device_dir, "idVendor");
+                device->pid = sysfs_read(device_dir, "idProduct");
+                device->serial = sysfs_read(device_dir, "serial");
+                device->manufacturer = sysfs_read(device_dir, "manufacturer");
+                device->product = sysfs_read(device_dir, "product");
+                break;
+            }
+            slash = strrchr(device_dir, '/');
+            if (slash == NULL)
+            {
+                break;
+            }
+            *slash = '\0';
+        }
+    }
+
+    closedir(d);
+}
+
+/* Attach persistent names from udev links (by-id, by-path) */
+static void devices_scan_links(const char *link_dir, bool by_id)
+{
+    DIR *d = opendir(link_dir);
+    struct dirent *dir;
+
+    if (d == NULL)
+    {
+        return;
+    }
+
+    while ((dir = readdir(d)) != NULL)
+    {
+        char path[PATH_MAX];
+        struct device_t *device;
+
+        if (dir->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", link_dir, dir->d_name);
+        device = (struct device_t *) devices_find(path);
+        if (device == NULL)
+        {
+            continue;
+        }
+
+        if (by_id && (device->by_id == NULL))
+        {
+            device->by_id = strdup(path);
+        }
+        else if (!by_id && (device->by_path == NULL))
+        {
+            device->by_path = strdup(path);
+        }
+    }
+
+    closedir(d);
+}
+
+/* Find lock holders of all devices in one pass over /proc/locks */
+static void devices_scan_locks(void)
+{
+    FILE *file = fopen("/proc/locks", "r");
+    char line[256];
+
+    if (file == NULL)
+    {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        unsigned int dev_major, dev_minor;
+        unsigned long inode;
+        char type[16];
+        int pid;
+
+        /* Skip waiters ("->") */
+        if ((strstr(line, "->") != NULL) ||
+            (sscanf(line, "%*d: %15s %*s %*s %d %x:%x:%lu", type, &pid, &dev_major, &dev_minor, &inode) != 5))
+        {
+            continue;
+        }
+
+        for (int i = 0; i < devices_count; i++)
+        {
+            if ((devices[i].lock_pid == 0) && (devices[i].file_ino != 0) && (devices[i].file_ino == inode) &&
+                (major(devices[i].file_dev) == dev_major) && (minor(devices[i].file_dev) == dev_minor))
+            {
+                char dir[32];
+
+                devices[i].lock_pid = pid;
+                snprintf(dir, sizeof(dir), "/proc/%d", pid);
+                devices[i].lock_name = sysfs_read(dir, "comm");
+            }
+        }
+    }
+
+    fclose(file);
+}
+
+#else
+
+static void devices_scan_dir(void)
+{
+    DIR *d = opendir(PATH_SERIAL_DEVICES);
+    struct dirent *dir;
+
+    if (d == NULL)
+    {
+        return;
+    }
+
+    while ((dir = readdir(d)) != NULL)
+    {
+        char path[PATH_MAX];
+
+        if ((strcmp(dir->d_name, ".")) && (strcmp(dir->d_name, "..")))
+        {
+#ifdef __APPLE__
+#define TTY_DEVICES_PREFIX "tty."
+            if (strncmp(dir->d_name, TTY_DEVICES_PREFIX, sizeof(TTY_DEVICES_PREFIX) - 1))
+            {
+                continue;
+            }
+#endif
+            snprintf(path, sizeof(path), "%s%s", PATH_SERIAL_DEVICES, dir->d_name);
+            devices_add(path);
+        }
+    }
+
+    closedir(d);
+}
+
+#endif
+
+const struct device_t *devices_scan(int *count)
+{
+    if (!devices_scanned)
+    {
+#ifdef __linux__
+        devices_scan_sysfs();
+        qsort(devices, devices_count, sizeof(struct device_t), devices_compare);
+        devices_scanned = true;
+        devices_scan_links("/dev/serial/by-id", true);
+        devices_scan_links("/dev/serial/by-path", false);
+        devices_scan_locks();
+#else
+        devices_scan_dir();
+        qsort(devices, devices_count, sizeof(struct device_t), devices_compare);
+        devices_scanned = true;
+#endif
+    }
+
+    *count = devices_count;
+
+    return devices;
+}
+
+/* Look up device by its device file or any link to it */
+const struct device_t *devices_find(const char *path)
+{
+    struct device_t key;
+    char real[PATH_MAX];
+    int count;
+
+    devices_scan(&count);
+
+    key.path = realpath(path, real) ? real : (char *) path;
+
+    return bsearch(&key, devices, count, sizeof(struct device_t), devices_compare);
+}
+
+static void json_print_string(const char *name, const char *value, bool last)
+{
+    printf("    \"%s\": ", name);
+
+    if (value == NULL)
+    {
+        printf("null");
+    }
+    else
+    {
+        putchar('"');
+        for (const char *c = value; *c; c++)
+        {
+            if ((*c == '"') || (*c == '\\'))
+            {
+                printf("\\%c", *c);
+            }
+            else if ((unsigned char) *c < 0x20)
+            {
+                printf("\\u%04x", *c);
+            }
+            else
+            {
+                putchar(*c);
+            }
+        }
+        putchar('"');
+    }
+
+    printf("%s\n", last ? "" : ",");
+}
+
+static void devices_print_json(const struct device_t *list, int count)
+{
+    printf("[\n");
+    for (int i = 0; i < count; i++)
+    {
+        const struct device_t *device = &list[i];
+
+        printf("  {\n");
+        json_print_string("path", device->path, false);
+        json_print_string("by_id", device->by_id, false);
+        json_print_string("by_path", device->by_path, false);
+        json_print_string("driver", device->driver, false);
+        json_print_string("vid", device->vid, false);
+        json_print_string("pid", device->pid, false);
+        json_print_string("serial", device->serial, false);
+        json_print_string("manufacturer", device->manufacturer, false);
+        json_print_string("product", device->product, false);
+        json_print_string("lock_name", device->lock_name, false);
+        if (device->lock_pid)
+        {
+            printf("    \"lock_pid\": %d\n", (int) device->lock_pid);
+        }
+        else
+        {
+            printf("    \"lock_pid\": null\n");
+        }
+        printf("  }%s\n", (i < count - 1) ? "," : "");
+    }
+    printf("]\n");
+}
+
+#define COLUMNS 7
+#define CELL_SIZE 256
+
+static void devices_print_table(const struct device_t *list, int count)
+{
+    const char *header[COLUMNS] = { "Device", "Driver", "VID:PID", "Serial", "Description", "Locked by", "By-id" };
+    char (*cells)[COLUMNS][CELL_SIZE];
+    int width[COLUMNS];
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    cells = calloc(count, sizeof(*cells));
+    if (cells == NULL)
+    {
+        return;
+    }
+
+    for (int c = 0; c < COLUMNS; c++)
+    {
+        width[c] = strlen(header[c]);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        const struct device_t *device = &list[i];
+
+        snprintf(cells[i][0], CELL_SIZE, "%s", device->path);
+        snprintf(cells[i][1], CELL_SIZE, "%s", device->driver ? device->driver : "-");
+        if (device->vid && device->pid)
+        {
+            snprintf(cells[i][2], CELL_SIZE, "%s:%s", device->vid, device->pid);
+        }
+        else
+        {
+            snprintf(cells[i][2], CELL_SIZE, "-");
+        }
+        snprintf(cells[i][3], CELL_SIZE, "%s", device->serial ? device->serial : "-");
+        snprintf(cells[i][4], CELL_SIZE, "%s", device->product ? device->product :
+                                               device->manufacturer ? device->manufacturer : "-");
+        if (device->lock_pid)
+        {
+            snprintf(cells[i][5], CELL_SIZE, "%s (%d)", device->lock_name ? device->lock_name : "?", (int) device->lock_pid);
+        }
+        else
+        {
+            snprintf(cells[i][5], CELL_SIZE, "-");
+        }
+        snprintf(cells[i][6], CELL_SIZE, "%s", device->by_id ? device->by_id : "-");
+
+        for (int c = 0; c < COLUMNS; c++)
+        {
+            width[c] = MAX(width[c], (int) strlen(cells[i][c]));
+        }
+    }
+
+    for (int c = 0; c < COLUMNS; c++)
+    {
+        printf("%-*s%s", (c < COLUMNS - 1) ? width[c] : 0, header[c], (c < COLUMNS - 1) ? "  " : "\n");
+    }
+    for (int i = 0; i < count; i++)
+    {
+        for (int c = 0; c < COLUMNS; c++)
+        {
+            printf("%-*s%s", (c < COLUMNS - 1) ? width[c] : 0, cells[i][c], (c < COLUMNS - 1) ? "  " : "\n");
+        }
+    }
+
+    free(cells);
+}
+
+void devices_print(enum list_format_t format)
+{
+    const struct device_t *list;
+    int count;
+
+    list = devices_scan(&count);
+
+    if (format == LIST_FORMAT_JSON)
+    {
+        devices_print_json(list, count);
+    }
+    else
+    {
+        devices_print_table(list, count);
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include "options.h"
+
+/* Metadata of one serial device, NULL (or 0) where unknown */
+struct device_t
+{
+    char *path;
+    char *by_id;
+    char *by_path;
+    char *driver;
+    char *vid;
+    char *pid;
+    char *serial;
+    char *manufacturer;
+    char *product;
+    pid_t lock_pid;
+    char *lock_name;
+    dev_t file_dev;
+    ino_t file_ino;
+};
+
+const struct device_t *devices_scan(int *count);
+const struct device_t *devices_find(const char *path);
+void devices_print(enum list_format_t format);
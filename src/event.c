@@ -0,0 +1,455 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Event loop backend
+ *
+ * File descriptors are registered once for read readiness and stay
+ * registered until removed. Write readiness can additionally be watched
+ * while a descriptor has output pending. The best backend available on the host is
+ * used: epoll on Linux, kqueue on macOS/BSD and select() everywhere else.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#if defined(HAVE_EPOLL)
+#include <sys/epoll.h>
+#elif defined(HAVE_KQUEUE)
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#include <sys/select.h>
+#endif
+#include "event.h"
+#include "print.h"
+#include "error.h"
+
+#define MAX_EVENTS 64
+
+#if defined(HAVE_EPOLL)
+
+static int epfd = -1;
+static struct epoll_event events[MAX_EVENTS];
+static int events_count = 0;
+
+/* Registered interest per file descriptor (EPOLLIN/EPOLLOUT) */
+static uint32_t *interest = NULL;
+static int interest_size = 0;
+
+static bool event_update(int fd, uint32_t mask)
+{
+    struct epoll_event event = {};
+    int op;
+
+    if (fd >= interest_size)
+    {
+        int size = MAX(fd + 1, interest_size * 2);
+        uint32_t *p = realloc(interest, size * sizeof(uint32_t));
+        if (p == NULL)
+        {
+            error_printf("Insufficient memory allocation");
+            exit(EXIT_FAILURE);
+        }
+        memset(p + interest_size, 0, (size - interest_size) * sizeof(uint32_t));
+        interest = p;
+        interest_size = size;
+    }
+
+    if (interest[fd] == mask)
+    {
+        return true;
+    }
+
+    event.events = mask;
+    event.data.fd = fd;
+
+    if (mask == 0)
+    {
+        op = EPOLL_CTL_DEL;
+    }
+    else if (interest[fd] == 0)
+    {
+        op = EPOLL_CTL_ADD;
+    }
+    else
+    {
+        op = EPOLL_CTL_MOD;
+    }
+
+    if ((epoll_ctl(epfd, op, fd, &event) < 0) && (op != EPOLL_CTL_DEL))
+    {
+        /* Regular files and eg. /dev/null never block and cannot be polled */
+        if ((errno == EPERM) && (op == EPOLL_CTL_ADD))
+        {
+            return false;
+        }
+        error_printf("Could not add file descriptor to event loop (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    interest[fd] = mask;
+
+    return true;
+}
+
+void event_init(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        error_printf("Could not create event loop (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool event_add(int fd)
+{
+    return event_update(fd, ((fd < interest_size) ? interest[fd] : 0) | EPOLLIN);
+}
+
+void event_add_write(int fd)
+{
+    event_update(fd, ((fd < interest_size) ? interest[fd] : 0) | EPOLLOUT);
+}
+
+void event_remove_write(int fd)
+{
+    if (fd < interest_size)
+    {
+        event_update(fd, interest[fd] & ~EPOLLOUT);
+    }
+}
+
+void event_remove(int fd)
+{
+    if ((fd < 0) || (fd >= interest_size))
+    {
+        return;
+    }
+
+    event_update(fd, 0);
+
+    /* Forget any pending readiness of removed descriptor */
+    for (int i = 0; i < events_count; i++)
+    {
+        if (events[i].data.fd == fd)
+        {
+            events[i].data.fd = -1;
+        }
+    }
+}
+
+int event_wait(int timeout_ms)
+{
+    events_count = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    if (events_count < 0)
+    {
+        int status = (errno == EINTR) ? 0 : -1;
+        events_count = 0;
+        return status;
+    }
+
+    return events_count;
+}
+
+bool event_ready(int fd)
+{
+    for (int i = 0; i < events_count; i++)
+    {
+        /* Hangup and errors are reported as readable so read() can detect them */
+        if ((events[i].data.fd == fd) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        {
+            return (fd < interest_size) && (interest[fd] & EPOLLIN);
+        }
+    }
+
+    return false;
+}
+
+bool event_writable(int fd)
+{
+    for (int i = 0; i < events_count; i++)
+    {
+        if ((events[i].data.fd == fd) && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+        {
+            return (fd < interest_size) && (interest[fd] & EPOLLOUT);
+        }
+    }
+
+    return false;
+}
+
+#elif defined(HAVE_KQUEUE)
+
+static int kqfd = -1;
+static struct kevent events[MAX_EVENTS];
+static int events_count = 0;
+
+void event_init(void)
+{
+    kqfd = kqueue();
+    if (kqfd < 0)
+    {
+        error_printf("Could not create event loop (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool event_add(int fd)
+{
+    struct kevent change;
+
+    EV_SET(&change, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+
+    if (kevent(kqfd, &change, 1, NULL, 0, NULL) < 0)
+    {
+        error_printf("Could not add file descriptor to event loop (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return true;
+}
+
+void event_add_write(int fd)
+{
+    struct kevent change;
+
+    EV_SET(&change, fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+
+    if (kevent(kqfd, &change, 1, NULL, 0, NULL) < 0)
+    {
+        error_printf("Could not add file descriptor to event loop (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void event_remove_write(int fd)
+{
+    struct kevent change;
+
+    EV_SET(&change, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(kqfd, &change, 1, NULL, 0, NULL);
+
+    for (int i = 0; i < events_count; i++)
+    {
+        if (((int) events[i].ident == fd) && (events[i].filter == EVFILT_WRITE))
+        {
+            events[i].ident = (uintptr_t) -1;
+        }
+    }
+}
+
+void event_remove(int fd)
+{
+    struct kevent change;
+
+    event_remove_write(fd);
+
+    EV_SET(&change, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(kqfd, &change, 1, NULL, 0, NULL);
+
+    /* Forget any pending readiness of removed descriptor */
+    for (int i = 0; i < events_count; i++)
+    {
+        if ((int) events[i].ident == fd)
+        {
+            events[i].ident = (uintptr_t) -1;
+        }
+    }
+}
+
+int event_wait(int timeout_ms)
+{
+    struct timespec ts, *timeout = NULL;
+
+    if (timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        timeout = &ts;
+    }
+
+    events_count = kevent(kqfd, NULL, 0, events, MAX_EVENTS, timeout);
+    if (events_count < 0)
+    {
+        int status = (errno == EINTR) ? 0 : -1;
+        events_count = 0;
+        return status;
+    }
+
+    return events_count;
+}
+
+bool event_ready(int fd)
+{
+    for (int i = 0; i < events_count; i++)
+    {
+        if (((int) events[i].ident == fd) && (events[i].filter == EVFILT_READ))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool event_writable(int fd)
+{
+    for (int i = 0; i < events_count; i++)
+    {
+        if (((int) events[i].ident == fd) && (events[i].filter == EVFILT_WRITE))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#else
+
+static fd_set fds, ready_fds;
+static fd_set write_fds, writable_fds;
+static int maxfd = -1;
+
+static void event_update_maxfd(void)
+{
+    while ((maxfd >= 0) && !FD_ISSET(maxfd, &fds) && !FD_ISSET(maxfd, &write_fds))
+    {
+        maxfd--;
+    }
+}
+
+void event_init(void)
+{
+    FD_ZERO(&fds);
+    FD_ZERO(&ready_fds);
+    FD_ZERO(&write_fds);
+    FD_ZERO(&writable_fds);
+}
+
+bool event_add(int fd)
+{
+    if (fd >= FD_SETSIZE)
+    {
+        error_printf("File descriptor %d exceeds select() limit", fd);
+        exit(EXIT_FAILURE);
+    }
+
+    FD_SET(fd, &fds);
+    maxfd = MAX(maxfd, fd);
+
+    return true;
+}
+
+void event_add_write(int fd)
+{
+    if (fd >= FD_SETSIZE)
+    {
+        error_printf("File descriptor %d exceeds select() limit", fd);
+        exit(EXIT_FAILURE);
+    }
+
+    FD_SET(fd, &write_fds);
+    maxfd = MAX(maxfd, fd);
+}
+
+void event_remove_write(int fd)
+{
+    if ((fd < 0) || (fd >= FD_SETSIZE))
+    {
+        return;
+    }
+
+    FD_CLR(fd, &write_fds);
+    FD_CLR(fd, &writable_fds);
+    event_update_maxfd();
+}
+
+void event_remove(int fd)
+{
+    if ((fd < 0) || (fd >= FD_SETSIZE))
+    {
+        return;
+    }
+
+    FD_CLR(fd, &fds);
+    FD_CLR(fd, &ready_fds);
+    FD_CLR(fd, &write_fds);
+    FD_CLR(fd, &writable_fds);
+    event_update_maxfd();
+}
+
+int event_wait(int timeout_ms)
+{
+    struct timeval tv, *timeout = NULL;
+    int status;
+
+    if (timeout_ms >= 0)
+    {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        timeout = &tv;
+    }
+
+    ready_fds = fds;
+    writable_fds = write_fds;
+
+    status = select(maxfd + 1, &ready_fds, &writable_fds, NULL, timeout);
+    if (status < 0)
+    {
+        FD_ZERO(&ready_fds);
+        FD_ZERO(&writable_fds);
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    return status;
+}
+
+bool event_ready(int fd)
+{
+    if ((fd < 0) || (fd >= FD_SETSIZE))
+    {
+        return false;
+    }
+
+    return FD_ISSET(fd, &ready_fds);
+}
+
+bool event_writable(int fd)
+{
+    if ((fd < 0) || (fd >= FD_SETSIZE))
+    {
+        return false;
+    }
+
+    return FD_ISSET(fd, &writable_fds);
+}
+
+#endif
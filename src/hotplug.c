@@ -0,0 +1,329 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Device hotplug notification
+ *
+ * Watches the directories leading up to an awaited tty device, so that the
+ * event loop wakes up as soon as the device file (or a directory on its path,
+ * like /dev/serial/by-id/ which udev creates with the first device) is
+ * created, or its permissions are changed. Uses inotify on Linux and kqueue
+ * vnode events on macOS/BSD. Without either, hotplug_start() returns NULL and
+ * the caller falls back to polling.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(HAVE_INOTIFY)
+#include <sys/inotify.h>
+#elif defined(HAVE_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+#include "misc.h"
+#include "hotplug.h"
+
+#define HOTPLUG_DEPTH_MAX 8
+
+#if defined(HAVE_INOTIFY) || defined(HAVE_KQUEUE)
+
+/* One directory on the path to the device and the entry expected in it */
+struct hotplug_watch_t
+{
+    char *dir;
+    const char *child;
+    int wd;
+};
+
+struct hotplug_t
+{
+    int fd;
+    char *path;
+    int count;
+    struct hotplug_watch_t watch[HOTPLUG_DEPTH_MAX];
+};
+
+#if defined(HAVE_INOTIFY)
+
+static void hotplug_arm(struct hotplug_t *hotplug)
+{
+    for (int i = 0; i < hotplug->count; i++)
+    {
+        /* Watching an already watched directory just returns its descriptor */
+        hotplug->watch[i].wd = inotify_add_watch(hotplug->fd, hotplug->watch[i].dir,
+                                                 IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+    }
+}
+
+static int hotplug_open(void)
+{
+    return inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+bool hotplug_acknowledge(struct hotplug_t *hotplug)
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    bool relevant = false;
+    ssize_t length;
+
+    if (hotplug == NULL)
+    {
+        return false;
+    }
+
+    while ((length = read(hotplug->fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + length; )
+        {
+            struct inotify_event *event = (struct inotify_event *) p;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                relevant = true;
+            }
+
+            /* Only care about entries on the path to the device */
+            for (int i = 0; (i < hotplug->count) && (event->len > 0); i++)
+            {
+                if ((event->wd == hotplug->watch[i].wd) && !strcmp(event->name, hotplug->watch[i].child))
+                {
+                    relevant = true;
+                }
+            }
+
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    /* Directories created since last time can be watched now */
+    if (relevant)
+    {
+        hotplug_arm(hotplug);
+    }
+
+    return relevant;
+}
+
+#else
+
+static void hotplug_arm(struct hotplug_t *hotplug)
+{
+    for (int i = 0; i < hotplug->count; i++)
+    {
+        struct kevent change;
+
+        if (hotplug->watch[i].wd >= 0)
+        {
+            continue;
+        }
+
+        hotplug->watch[i].wd = open(hotplug->watch[i].dir, O_RDONLY | O_CLOEXEC);
+        if (hotplug->watch[i].wd < 0)
+        {
+            continue;
+        }
+
+        EV_SET(&change, hotplug->watch[i].wd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+        kevent(hotplug->fd, &change, 1, NULL, 0, NULL);
+    }
+}
+
+static int hotplug_open(void)
+{
+    return kqueue();
+}
+
+bool hotplug_acknowledge(struct hotplug_t *hotplug)
+{
+    struct timespec timeout = { 0, 0 };
+    struct kevent events[HOTPLUG_DEPTH_MAX];
+    bool relevant = false;
+    int count;
+
+    if (hotplug == NULL)
+    {
+        return false;
+    }
+
+    /* Directory change events do not name the entry, so any change counts */
+    while ((count = kevent(hotplug->fd, NULL, 0, events, HOTPLUG_DEPTH_MAX, &timeout)) > 0)
+    {
+        for (int e = 0; e < count; e++)
+        {
+            relevant = true;
+            if (events[e].fflags & (NOTE_DELETE | NOTE_RENAME))
+            {
+                /* Directory went away, watch it again once it is back */
+                for (int i = 0; i < hotplug->count; i++)
+                {
+                    if (hotplug->watch[i].wd == (int) events[e].ident)
+                    {
+                        close(hotplug->watch[i].wd);
+                        hotplug->watch[i].wd = -1;
+                    }
+                }
+            }
+        }
+    }
+
+    if (relevant)
+    {
+        hotplug_arm(hotplug);
+    }
+
+    return relevant;
+}
+
+#endif
+
+struct hotplug_t *hotplug_start(const char *device)
+{
+    struct hotplug_t *hotplug;
+    char *slash;
+    bool watched = false;
+
+    hotplug = calloc(1, sizeof(struct hotplug_t));
+    if (hotplug == NULL)
+    {
+        return NULL;
+    }
+
+    hotplug->fd = hotplug_open();
+    hotplug->path = strdup(device);
+    if ((hotplug->fd < 0) || (hotplug->path == NULL))
+    {
+        hotplug_stop(hotplug);
+        return NULL;
+    }
+
+    /* Split path into its parent directories, innermost first */
+    while (hotplug->count < HOTPLUG_DEPTH_MAX)
+    {
+        struct hotplug_watch_t *watch = &hotplug->watch[hotplug->count];
+
+        slash = strrchr(hotplug->path, '/');
+        if (slash == NULL)
+        {
+            watch->dir = strdup(".");
+            watch->child = hotplug->path;
+        }
+        else if (slash == hotplug->path)
+        {
+            watch->dir = strdup("/");
+            watch->child = slash + 1;
+        }
+        else
+        {
+            watch->dir = strndup(hotplug->path, slash - hotplug->path);
+            watch->child = slash + 1;
+        }
+        watch->wd = -1;
+        hotplug->count++;
+
+        if ((slash == NULL) || (slash == hotplug->path) || (*watch->child == '\0'))
+        {
+            break;
+        }
+        *slash = '\0';
+    }
+
+    hotplug_arm(hotplug);
+
+    for (int i = 0; i < hotplug->count; i++)
+    {
+        watched |= (hotplug->watch[i].wd >= 0);
+    }
+    if (!watched)
+    {
+        hotplug_stop(hotplug);
+        return NULL;
+    }
+
+    return hotplug;
+}
+
+void hotplug_stop(struct hotplug_t *hotplug)
+{
+    if (hotplug == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < hotplug->count; i++)
+    {
+#if defined(HAVE_KQUEUE) && !defined(HAVE_INOTIFY)
+        if (hotplug->watch[i].wd >= 0)
+        {
+            close(hotplug->watch[i].wd);
+        }
+#endif
+        free(hotplug->watch[i].dir);
+    }
+    if (hotplug->fd >= 0)
+    {
+        close(hotplug->fd);
+    }
+    free(hotplug->path);
+    free(hotplug);
+}
+
+int hotplug_event_fd(struct hotplug_t *hotplug)
+{
+    return hotplug->fd;
+}
+
+#else
+
+struct hotplug_t *hotplug_start(const char *device)
+{
+    UNUSED(device);
+
+    return NULL;
+}
+
+void hotplug_stop(struct hotplug_t *hotplug)
+{
+    UNUSED(hotplug);
+}
+
+int hotplug_event_fd(struct hotplug_t *hotplug)
+{
+    UNUSED(hotplug);
+
+    return -1;
+}
+
+bool hotplug_acknowledge(struct hotplug_t *hotplug)
+{
+    UNUSED(hotplug);
+
+    return false;
+}
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Low latency profile
+ *
+ * Trades throughput efficiency for receive latency: the serial driver is
+ * asked to push received bytes to the tty layer immediately
+ * (ASYNC_LOW_LATENCY), the latency timer of FTDI adapters is lowered from
+ * its default of 16 ms, and the thread reading the device may be pinned to
+ * a CPU and run with SCHED_FIFO priority. Everything changed is recorded so
+ * that it can be restored when the device is disconnected.
+ *
+ * VMIN and VTIME are left at 1 and 0 which is already the lowest latency
+ * setting for poll driven reads.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_TIOCSSERIAL
+#include <linux/serial.h>
+#endif
+#include "options.h"
+#include "print.h"
+#include "error.h"
+#include "latency.h"
+
+#define LATENCY_TIMER_MS "1"
+
+struct latency_t
+{
+    int fd;
+    bool serial_changed;
+    int serial_flags_old;
+    char *timer_path;
+    char timer_old[16];
+    bool sched_changed;
+    pthread_t thread;
+    int policy_old;
+    struct sched_param param_old;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    bool affinity_changed;
+    cpu_set_t cpus_old;
+#endif
+};
+
+#ifdef HAVE_TIOCSSERIAL
+static void latency_serial_apply(struct latency_t *latency)
+{
+    struct serial_struct serial;
+
+    /* Not all drivers support this (eg. pty, cdc-acm) */
+    if (ioctl(latency->fd, TIOCGSERIAL, &serial) < 0)
+    {
+        return;
+    }
+
+    if (serial.flags & ASYNC_LOW_LATENCY)
+    {
+        return;
+    }
+
+    latency->serial_flags_old = serial.flags;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(latency->fd, TIOCSSERIAL, &serial) < 0)
+    {
+        warning_printf("Could not enable low latency mode of serial driver (%s)", strerror(errno));
+        return;
+    }
+
+    latency->serial_changed = true;
+}
+#endif
+
+static bool read_file(const char *path, char *buffer, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+    bool success;
+
+    if (fp == NULL)
+    {
+        return false;
+    }
+
+    success = (fgets(buffer, size, fp) != NULL);
+    fclose(fp);
+
+    return success;
+}
+
+static bool write_file(const char *path, const char *value)
+{
+    FILE *fp = fopen(path, "w");
+    bool success;
+
+    if (fp == NULL)
+    {
+        return false;
+    }
+
+    success = (fputs(value, fp) >= 0);
+    success = (fclose(fp) == 0) && success;
+
+    return success;
+}
+
+/* Lower latency timer of USB serial adapters which have one (FTDI) */
+static void latency_timer_apply(struct latency_t *latency, const char *device)
+{
+    char resolved[PATH_MAX];
+    char *path = NULL;
+
+    if (realpath(device, resolved) == NULL)
+    {
+        return;
+    }
+
+    if (asprintf(&path, "/sys/class/tty/%s/device/latency_timer", basename(resolved)) < 0)
+    {
+        return;
+    }
+
+    if (!read_file(path, latency->timer_old, sizeof(latency->timer_old)))
+    {
+        free(path);
+        return;
+    }
+
+    if (!write_file(path, LATENCY_TIMER_MS))
+    {
+        warning_printf("Could not set latency timer %s (%s)", path, strerror(errno));
+        free(path);
+        return;
+    }
+
+    latency->timer_path = path;
+}
+
+struct latency_t *latency_apply(int fd, const char *device)
+{
+    struct latency_t *latency = calloc(1, sizeof(struct latency_t));
+
+    if (latency == NULL)
+    {
+        error_printf("Insufficient memory allocation for low latency profile");
+        exit(EXIT_FAILURE);
+    }
+
+    latency->fd = fd;
+
+    if (option.low_latency)
+    {
+#ifdef HAVE_TIOCSSERIAL
+        latency_serial_apply(latency);
+#endif
+        latency_timer_apply(latency, device);
+    }
+
+    return latency;
+}
+
+/* Give thread reading the device real-time priority and/or pin it to a CPU */
+void latency_realtime(struct latency_t *latency, pthread_t thread)
+{
+    latency->thread = thread;
+
+    if (option.rx_priority > 0)
+    {
+        struct sched_param param = { .sched_priority = option.rx_priority };
+        int status;
+
+        pthread_getschedparam(thread, &latency->policy_old, &latency->param_old);
+        status = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (status != 0)
+        {
+            warning_printf("Could not set real-time priority (%s)", strerror(status));
+        }
+        else
+        {
+            latency->sched_changed = true;
+        }
+    }
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    if (option.rx_cpu >= 0)
+    {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(option.rx_cpu, &cpus);
+
+        pthread_getaffinity_np(thread, sizeof(cpu_set_t), &latency->cpus_old);
+        if (pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus) != 0)
+        {
+            warning_printf("Could not pin receive thread to CPU %d", option.rx_cpu);
+        }
+        else
+        {
+            latency->affinity_changed = true;
+        }
+    }
+#endif
+}
+
+void latency_restore(struct latency_t *latency)
+{
+    if (latency == NULL)
+    {
+        return;
+    }
+
+#ifdef HAVE_TIOCSSERIAL
+    if (latency->serial_changed)
+    {
+        struct serial_struct serial;
+
+        if (ioctl(latency->fd, TIOCGSERIAL, &serial) == 0)
+        {
+            serial.flags = latency->serial_flags_old;
+            ioctl(latency->fd, TIOCSSERIAL, &serial);
+        }
+    }
+#endif
+
+    if (latency->timer_path != NULL)
+    {
+        write_file(latency->timer_path, latency->timer_old);
+        free(latency->timer_path);
+    }
+
+    /* A reader thread has ended by now, only the main thread needs restoring */
+    if (pthread_equal(latency->thread, pthread_self()))
+    {
+        if (latency->sched_changed)
+        {
+            pthread_setschedparam(latency->thread, latency->policy_old, &latency->param_old);
+        }
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+        if (latency->affinity_changed)
+        {
+            pthread_setaffinity_np(latency->thread, sizeof(cpu_set_t), &latency->cpus_old);
+        }
+#endif
+    }
+
+    free(latency);
+}
@@ -24,122 +24,719 @@
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "options.h"
 #include "print.h"
 #include "error.h"
+#include "splice.h"
+#include "signals.h"
 
 #define IS_ESC_CSI_INTERMEDIATE_CHAR(c) ((c >= 0x20) && (c <= 0x3F))
-#define IS_ESC_END_CHAR(c)              ((c >= 0x30) && (c <= 0x7E))
-#define IS_CTRL_CHAR(c)                 ((c >= 0x00) && (c <= 0x1F))
+#define IS_CSI_END_CHAR(c)              ((c >= 0x40) && (c <= 0x7E))
+#define IS_ESC_INTERMEDIATE_CHAR(c)     ((c >= 0x20) && (c <= 0x2F))
+#define IS_ESC_FINAL_CHAR(c)            ((c >= 0x30) && (c <= 0x7E))
+#define IS_CTRL_CHAR(c)                 (c <= 0x1F)
 
-static FILE *fp;
+#define BEL 0x07
+#define ESC 0x1b
+
+/* Escape sequence parser state, kept across log writes */
+enum strip_state_t
+{
+    STRIP_NORMAL,
+    STRIP_ESC,
+    STRIP_ESC_INTERMEDIATE,
+    STRIP_CSI,
+    STRIP_STRING,
+    STRIP_STRING_ESC,
+};
+
+#define LOG_WRITER_WAKEUP_MS 100
+#define LOG_DEFLATE_BUFFER_SIZE 65536
+
+/* Log file of one tty device */
+struct log_t
+{
+    FILE *fp;
+    char *filename;
+    char file_buffer[BUFSIZ];
+    enum strip_state_t strip_state;
+    bool splice_configured;
+
+    /* Asynchronous log writer state. The receive path is the only producer
+     * and the writer thread the only consumer of the ring, so positions are
+     * shared lock-free. Positions count bytes in total and wrap modulo
+     * ring_size. */
+    char *ring;
+    size_t ring_size;
+    size_t ring_head; // Consumer (writer thread) position
+    size_t ring_tail; // Producer position
+    unsigned long dropped_bytes;
+
+    /* Write latency, updated by whichever thread writes the file */
+    unsigned long write_count;
+    uint64_t write_ns_total;
+    uint64_t write_ns_max;
+
+    /* Rotation, handled by whichever thread writes the file */
+    uint64_t file_size;
+    uint64_t file_opened;
+    bool reopen_requested;
+
+#ifdef HAVE_ZLIB
+    /* Compression (gzip), always done by the writer thread */
+    bool compress;
+    bool deflate_pending;
+    z_stream deflate_stream;
+    char deflate_buffer[LOG_DEFLATE_BUFFER_SIZE];
+#endif
+
+    bool writer_running;
+    bool writer_stop;
+    pthread_t writer_thread;
+    pthread_mutex_t writer_mutex;
+    pthread_cond_t writer_cond;
+
+    struct log_t *next;
+};
+
+static struct log_t *logs = NULL;
 static bool log_error = false;
-static char file_buffer[BUFSIZ];
+static char *log_error_filename = NULL;
 
 static char *date_time(void)
 {
     static char date_time_string[50];
-    struct tm *tm;
+    struct tm tm;
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
 
-    tm = localtime(&tv.tv_sec);
-    strftime(date_time_string, sizeof(date_time_string), "%Y-%m-%dT%H:%M:%S", tm);
+    /* Also used by log writer thread when rotating */
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(date_time_string, sizeof(date_time_string), "%Y-%m-%dT%H:%M:%S", &tm);
 
     return date_time_string;
 }
 
-void log_open(const char *filename)
+static long elapsed_ms(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static uint64_t log_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void log_latency_add(struct log_t *log, uint64_t start)
+{
+    uint64_t latency = log_now() - start;
+
+    __atomic_store_n(&log->write_ns_total, log->write_ns_total + latency, __ATOMIC_RELAXED);
+    if (latency > log->write_ns_max)
+    {
+        __atomic_store_n(&log->write_ns_max, latency, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&log->write_count, log->write_count + 1, __ATOMIC_RELAXED);
+}
+
+#ifdef HAVE_ZLIB
+/* Write all of buffer to file, giving up on data which can not be written */
+static void log_file_write(int fd, const char *buffer, size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t status = write(fd, buffer, count);
+        if (status < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        buffer += status;
+        count -= status;
+    }
+}
+
+/* Compress data to log file, Z_SYNC_FLUSH makes all of it decompressible
+ * already and Z_FINISH ends the gzip stream */
+static void log_deflate(struct log_t *log, const char *buffer, size_t count, int flush)
+{
+    z_stream *stream = &log->deflate_stream;
+
+    stream->next_in = (Bytef *) buffer;
+    stream->avail_in = count;
+
+    do
+    {
+        stream->next_out = (Bytef *) log->deflate_buffer;
+        stream->avail_out = LOG_DEFLATE_BUFFER_SIZE;
+        deflate(stream, flush);
+        log_file_write(fileno(log->fp), log->deflate_buffer, LOG_DEFLATE_BUFFER_SIZE - stream->avail_out);
+    }
+    while (stream->avail_out == 0);
+
+    log->deflate_pending = (flush == Z_NO_FLUSH);
+}
+#endif
+
+/* Set up writing to newly opened log file, continuing at its end */
+static void log_file_start(struct log_t *log)
+{
+    setvbuf(log->fp, log->file_buffer, _IOFBF, BUFSIZ);
+    fseek(log->fp, 0, SEEK_END);
+    log->file_size = ftell(log->fp);
+    log->file_opened = log_now();
+    log->splice_configured = false;
+
+#ifdef HAVE_ZLIB
+    if (log->compress)
+    {
+        memset(&log->deflate_stream, 0, sizeof(z_stream));
+        if (deflateInit2(&log->deflate_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            error_printf("Could not initialize log compression");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+}
+
+/* Write out everything pending so log file is complete */
+static void log_file_finish(struct log_t *log)
+{
+#ifdef HAVE_ZLIB
+    if (log->compress)
+    {
+        log_deflate(log, NULL, 0, Z_FINISH);
+        deflateEnd(&log->deflate_stream);
+    }
+#endif
+    fflush(log->fp);
+}
+
+static bool log_rotate_due(struct log_t *log)
+{
+    return ((option.log_rotate_size > 0) && (log->file_size >= option.log_rotate_size)) ||
+           ((option.log_rotate_interval > 0) &&
+            ((log_now() - log->file_opened) >= (uint64_t) option.log_rotate_interval * 1000000000ULL));
+}
+
+/* Name of rotated log file, "<name>.YYYY-MM-DDTHH:MM:SS[.N][.gz]" */
+static char *log_rotated_filename(struct log_t *log)
 {
-    static char automatic_filename[400];
+    const char *suffix = "";
+    size_t length = strlen(log->filename);
+    char *rotated;
+
+#ifdef HAVE_ZLIB
+    if (log->compress)
+    {
+        suffix = ".gz";
+        length -= strlen(suffix);
+    }
+#endif
+
+    asprintf(&rotated, "%.*s.%s%s", (int) length, log->filename, date_time(), suffix);
+    for (int i = 1; access(rotated, F_OK) == 0; i++)
+    {
+        free(rotated);
+        asprintf(&rotated, "%.*s.%s.%d%s", (int) length, log->filename, date_time(), i, suffix);
+    }
+
+    return rotated;
+}
+
+/* Switch to new log file by the same name, moving the current one aside
+ * first when rotating. Renaming is atomic so readers of the log file see
+ * either file complete, and if no new file can be opened logging
+ * continues to the current one. */
+static void log_file_cycle(struct log_t *log, bool rotate)
+{
+    char *rotated = NULL;
+    FILE *fp;
+
+    log_file_finish(log);
+
+    if (rotate)
+    {
+        rotated = log_rotated_filename(log);
+        if (rename(log->filename, rotated) < 0)
+        {
+            free(rotated);
+            rotated = NULL;
+        }
+    }
+
+    fp = fopen(log->filename, "a+");
+    if (fp == NULL)
+    {
+        if (rotated != NULL)
+        {
+            rename(rotated, log->filename);
+        }
+    }
+    else
+    {
+        fclose(log->fp);
+        log->fp = fp;
+    }
+
+    log_file_start(log);
+    free(rotated);
+}
+
+static void *log_writer(void *arg)
+{
+    struct log_t *log = arg;
+    bool unsynced = false;
+    struct timespec now, last_sync;
+
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+
+    while (true)
+    {
+        size_t tail = __atomic_load_n(&log->ring_tail, __ATOMIC_ACQUIRE);
+        size_t head = log->ring_head;
+
+        if (__atomic_exchange_n(&log->reopen_requested, false, __ATOMIC_ACQ_REL))
+        {
+            log_file_cycle(log, false);
+        }
+        else if (log_rotate_due(log))
+        {
+            log_file_cycle(log, true);
+        }
+
+        if (tail == head)
+        {
+            struct timespec timeout;
+
+            if (__atomic_load_n(&log->writer_stop, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+
+#ifdef HAVE_ZLIB
+            // Make data compressed so far readable before going idle
+            if (log->deflate_pending)
+            {
+                log_deflate(log, NULL, 0, Z_SYNC_FLUSH);
+            }
+#endif
+
+            // Sleep until producer signals new data (or timeout in case signal was missed)
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_nsec += LOG_WRITER_WAKEUP_MS * 1000000L;
+            timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+            timeout.tv_nsec %= 1000000000L;
+
+            pthread_mutex_lock(&log->writer_mutex);
+            if ((__atomic_load_n(&log->ring_tail, __ATOMIC_ACQUIRE) == head) &&
+                !__atomic_load_n(&log->writer_stop, __ATOMIC_ACQUIRE) &&
+                !__atomic_load_n(&log->reopen_requested, __ATOMIC_ACQUIRE))
+            {
+                pthread_cond_timedwait(&log->writer_cond, &log->writer_mutex, &timeout);
+            }
+            pthread_mutex_unlock(&log->writer_mutex);
+        }
+        else
+        {
+            // Write all pending data, split in two parts if it wraps around ring end
+            size_t start = head % log->ring_size;
+            size_t count = tail - head;
+            struct iovec iov[2];
+            int iovcnt = 1;
+            ssize_t status;
+            uint64_t write_start = log_now();
+
+            iov[0].iov_base = log->ring + start;
+            iov[0].iov_len = MIN(count, log->ring_size - start);
+            if (iov[0].iov_len < count)
+            {
+                iov[1].iov_base = log->ring;
+                iov[1].iov_len = count - iov[0].iov_len;
+                iovcnt = 2;
+            }
+
+#ifdef HAVE_ZLIB
+            if (log->compress)
+            {
+                for (int i = 0; i < iovcnt; i++)
+                {
+                    log_deflate(log, iov[i].iov_base, iov[i].iov_len, Z_NO_FLUSH);
+                }
+                status = count;
+            }
+            else
+#endif
+            {
+                status = writev(fileno(log->fp), iov, iovcnt);
+            }
+            log_latency_add(log, write_start);
+            if (status < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // Give up on data which can not be written
+                status = count;
+            }
+
+            __atomic_store_n(&log->ring_head, head + status, __ATOMIC_RELEASE);
+            log->file_size += status;
+            unsynced = true;
+        }
+
+        if ((option.log_fsync_interval > 0) && unsynced)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (elapsed_ms(&last_sync, &now) >= option.log_fsync_interval)
+            {
+                fsync(fileno(log->fp));
+                last_sync = now;
+                unsynced = false;
+            }
+        }
+    }
+
+    if (option.log_fsync_interval > 0)
+    {
+        fsync(fileno(log->fp));
+    }
+
+    return NULL;
+}
+
+static void log_async_start(struct log_t *log)
+{
+    log->ring_size = MAX(option.log_buffer_size, BUFSIZ);
+    log->ring = malloc(log->ring_size);
+    if (log->ring == NULL)
+    {
+        error_printf("Insufficient memory allocation for log buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    if (signal_thread_create(&log->writer_thread, log_writer, log) != 0)
+    {
+        error_printf("Could not create log writer thread");
+        exit(EXIT_FAILURE);
+    }
+
+    log->writer_running = true;
+}
+
+static void log_async_stop(struct log_t *log)
+{
+    if (!log->writer_running)
+    {
+        return;
+    }
+
+    // Let writer thread drain ring before exiting
+    pthread_mutex_lock(&log->writer_mutex);
+    __atomic_store_n(&log->writer_stop, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log->writer_cond);
+    pthread_mutex_unlock(&log->writer_mutex);
+
+    pthread_join(log->writer_thread, NULL);
+    log->writer_running = false;
+
+    free(log->ring);
+    log->ring = NULL;
+}
+
+static void log_async_write(struct log_t *log, const char *buffer, size_t count)
+{
+    size_t head = __atomic_load_n(&log->ring_head, __ATOMIC_ACQUIRE);
+    size_t tail = log->ring_tail;
+    size_t space = log->ring_size - (tail - head);
+
+    // Drop what does not fit instead of stalling the receive path
+    if (count > space)
+    {
+        log->dropped_bytes += count - space;
+        count = space;
+    }
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    size_t start = tail % log->ring_size;
+    size_t length = MIN(count, log->ring_size - start);
+
+    memcpy(log->ring + start, buffer, length);
+    memcpy(log->ring, buffer + length, count - length);
+
+    __atomic_store_n(&log->ring_tail, tail + count, __ATOMIC_RELEASE);
+
+    pthread_cond_signal(&log->writer_cond);
+}
+
+static void log_emit(struct log_t *log, const char *buffer, size_t count)
+{
+    if (log->writer_running)
+    {
+        log_async_write(log, buffer, count);
+    }
+    else
+    {
+        fwrite(buffer, 1, count, log->fp);
+        log->file_size += count;
+    }
+}
+
+struct log_t *log_open(const char *filename, const char *tty_device)
+{
+    struct log_t *log;
+
+    log = calloc(1, sizeof(struct log_t));
+    if (log == NULL)
+    {
+        error_printf("Insufficient memory allocation for log");
+        exit(EXIT_FAILURE);
+    }
 
     if (filename == NULL)
     {
         // Generate filename if none provided ("tio_DEVICE_YYYY-MM-DDTHH:MM:SS.log")
-        sprintf(automatic_filename, "tio_%s_%s.log", basename((char *)option.tty_device), date_time());
-        filename = automatic_filename;
-        option.log_filename = automatic_filename;
+        char *device = strdup(tty_device);
+        asprintf(&log->filename, "tio_%s_%s.log", basename(device), date_time());
+        free(device);
+    }
+    else
+    {
+        log->filename = strdup(filename);
+    }
+
+    if (option.log_compress)
+    {
+#ifdef HAVE_ZLIB
+        size_t length = strlen(log->filename);
+
+        // Compressed log files get the usual suffix
+        if ((length < 3) || strcmp(log->filename + length - 3, ".gz"))
+        {
+            char *name = log->filename;
+            asprintf(&log->filename, "%s.gz", name);
+            free(name);
+        }
+        log->compress = true;
+#else
+        error_printf("Log compression not supported");
+        exit(EXIT_FAILURE);
+#endif
     }
 
     // Open log file in append write mode
-    fp = fopen(filename, "a+");
-    if (fp == NULL)
+    log->fp = fopen(log->filename, "a+");
+    if (log->fp == NULL)
     {
         log_error = true;
+        log_error_filename = log->filename;
         exit(EXIT_FAILURE);
     }
 
     // Enable full buffering
-    setvbuf(fp, file_buffer, _IOFBF, BUFSIZ);
+    log_file_start(log);
+
+    pthread_mutex_init(&log->writer_mutex, NULL);
+    pthread_cond_init(&log->writer_cond, NULL);
+
+    // Hand writing over to writer thread if asynchronous logging is enabled,
+    // compression is always done by the writer thread
+    if (option.log_async || option.log_compress)
+    {
+        log_async_start(log);
+    }
+
+    // Keep track of open logs so they can be closed on exit
+    log->next = logs;
+    logs = log;
+
+    return log;
 }
 
-bool log_strip(char c)
+const char *log_filename(struct log_t *log)
 {
-    static char previous_char = 0;
-    static bool esc_sequence = false;
-    bool strip = false;
+    return log->filename;
+}
 
-    /* Detect if character should be stripped or not */
-    switch (c)
+/* Find first byte which may need stripping (control character other than newline) */
+static size_t log_strip_find(const char *buffer, size_t count)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    const __m128i limit = _mm_set1_epi8((char) (0x80 + 0x20));
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    /* Compare 16 bytes at a time (unsigned compare via sign bias) */
+    for (; i + 16 <= count; i += 16)
     {
-        case 0xa:
-            /* Line feed / new line */
-            /* Reset ESC sequence just in case something went wrong with the
-             * escape sequence parsing. */
-            esc_sequence = false;
-            break;
+        __m128i v = _mm_loadu_si128((const __m128i *) (buffer + i));
+        __m128i ctrl = _mm_cmplt_epi8(_mm_xor_si128(v, bias), limit);
+        int mask;
+
+        ctrl = _mm_andnot_si128(_mm_cmpeq_epi8(v, newline), ctrl);
+        mask = _mm_movemask_epi8(ctrl);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
 
-        case 0x1b:
-            /* Escape */
-            strip = true;
+    for (; i < count; i++)
+    {
+        unsigned char c = buffer[i];
+        if (IS_CTRL_CHAR(c) && (c != '\n'))
+        {
             break;
+        }
+    }
+
+    return i;
+}
+
+/* Run escape sequence state machine on one character, returns true if stripped */
+static bool log_strip(struct log_t *log, char c)
+{
+    unsigned char uc = c;
 
-        case 0x5b:
-            /* Left bracket */
-            if (previous_char == 0x1b)
+    if (uc == '\n')
+    {
+        /* Line feed / new line */
+        /* Reset ESC sequence just in case something went wrong with the
+         * escape sequence parsing. */
+        log->strip_state = STRIP_NORMAL;
+        return false;
+    }
+
+    switch (log->strip_state)
+    {
+        case STRIP_NORMAL:
+            if (uc == ESC)
             {
-                // Start of ESC sequence
-                esc_sequence = true;
-                strip = true;
+                log->strip_state = STRIP_ESC;
+                return true;
             }
-            break;
+            /* Strip ASCII control characters */
+            return IS_CTRL_CHAR(uc);
 
-        default:
-            if (IS_CTRL_CHAR(c))
+        case STRIP_ESC:
+            if (uc == '[')
             {
-                /* Strip ASCII control characters */
-                strip = true;
-                break;
+                log->strip_state = STRIP_CSI;
             }
-            else
-            if ((esc_sequence) && (IS_ESC_CSI_INTERMEDIATE_CHAR(c)))
+            else if ((uc == ']') || (uc == 'P') || (uc == 'X') || (uc == '^') || (uc == '_'))
             {
-                strip = true;
-                break;
+                /* OSC, DCS, SOS, PM and APC control strings */
+                log->strip_state = STRIP_STRING;
             }
-            else
-            if ((esc_sequence) && (IS_ESC_END_CHAR(c)))
+            else if (IS_ESC_INTERMEDIATE_CHAR(uc))
             {
-                esc_sequence = false;
-                strip = true;
-                break;
+                log->strip_state = STRIP_ESC_INTERMEDIATE;
             }
-            break;
-    }
+            else if (IS_ESC_FINAL_CHAR(uc))
+            {
+                log->strip_state = STRIP_NORMAL;
+            }
+            else if (uc != ESC && !IS_CTRL_CHAR(uc))
+            {
+                /* Not an escape sequence after all */
+                log->strip_state = STRIP_NORMAL;
+                return false;
+            }
+            return true;
+
+        case STRIP_ESC_INTERMEDIATE:
+            if (IS_ESC_FINAL_CHAR(uc))
+            {
+                log->strip_state = STRIP_NORMAL;
+            }
+            else if (uc == ESC)
+            {
+                log->strip_state = STRIP_ESC;
+            }
+            else if (!IS_ESC_INTERMEDIATE_CHAR(uc) && !IS_CTRL_CHAR(uc))
+            {
+                log->strip_state = STRIP_NORMAL;
+                return false;
+            }
+            return true;
+
+        case STRIP_CSI:
+            if (IS_CSI_END_CHAR(uc))
+            {
+                log->strip_state = STRIP_NORMAL;
+            }
+            else if (uc == ESC)
+            {
+                log->strip_state = STRIP_ESC;
+            }
+            else if (!IS_ESC_CSI_INTERMEDIATE_CHAR(uc) && !IS_CTRL_CHAR(uc))
+            {
+                log->strip_state = STRIP_NORMAL;
+                return false;
+            }
+            return true;
+
+        case STRIP_STRING:
+            /* Control string ends with BEL or ST (ESC \) */
+            if (uc == BEL)
+            {
+                log->strip_state = STRIP_NORMAL;
+            }
+            else if (uc == ESC)
+            {
+                log->strip_state = STRIP_STRING_ESC;
+            }
+            return true;
 
-    previous_char = c;
+        case STRIP_STRING_ESC:
+            if (uc == '\\')
+            {
+                log->strip_state = STRIP_NORMAL;
+                return true;
+            }
+            /* Any other character starts a new escape sequence */
+            log->strip_state = STRIP_ESC;
+            return log_strip(log, c);
+    }
 
-    return strip;
+    return false;
 }
 
-void log_printf(const char *format, ...)
+void log_printf(struct log_t *log, const char *format, ...)
 {
     char *line;
 
@@ -148,50 +745,194 @@ void log_printf(const char *format, ...)
     vasprintf(&line, format, args);
     va_end(args);
 
-    fwrite(line, strlen(line), 1, fp);
+    log_emit(log, line, strlen(line));
 
     free(line);
 }
 
-void log_putc(char c)
+static void log_write_buffer(struct log_t *log, const char *buffer, size_t count)
 {
-    if (fp != NULL)
+    if (!option.log_strip)
+    {
+        log_emit(log, buffer, count);
+        return;
+    }
+
+    while (count > 0)
     {
-        if (option.log_strip)
+        /* Pass through spans free of control characters in bulk */
+        if (log->strip_state == STRIP_NORMAL)
         {
-            if (!log_strip(c))
+            size_t length = log_strip_find(buffer, count);
+            if (length > 0)
             {
-                fputc(c, fp);
+                log_emit(log, buffer, length);
+                buffer += length;
+                count -= length;
+                if (count == 0)
+                {
+                    break;
+                }
             }
         }
-        else
+
+        if (!log_strip(log, *buffer))
         {
-            fputc(c, fp);
+            log_emit(log, buffer, 1);
         }
+        buffer++;
+        count--;
     }
 }
 
-void log_close(void)
+void log_write(struct log_t *log, const char *buffer, size_t count)
 {
-    if (fp != NULL)
+    uint64_t start;
+
+    if (log == NULL)
     {
-        fclose(fp);
+        return;
+    }
+
+    /* Asynchronous writes are timed by the writer thread */
+    if (log->writer_running)
+    {
+        log_write_buffer(log, buffer, count);
+        return;
+    }
+
+    start = log_now();
+    log_write_buffer(log, buffer, count);
+    log_latency_add(log, start);
+
+    if (log_rotate_due(log))
+    {
+        log_file_cycle(log, true);
     }
 }
 
-void log_exit(void)
+void log_putc(struct log_t *log, char c)
+{
+    log_write(log, &c, 1);
+}
+
+#ifdef HAVE_SPLICE
+void log_splice(struct log_t *log, size_t count)
 {
-    if (option.log)
+    const char *leftover;
+    size_t rest;
+
+    if (log == NULL)
+    {
+        return;
+    }
+
+    if (log->writer_running)
     {
-        log_close();
+        /* Writer thread owns the file so only take a copy of the data */
+        rest = splice_copy(-1, count, &leftover);
+        log_async_write(log, leftover, rest);
+        return;
     }
 
+    /* Keep file order by flushing anything buffered before splicing */
+    fflush(log->fp);
+
+    if (!log->splice_configured)
+    {
+        /* splice() refuses files opened in append mode so continue writing
+         * from end of file with append flag cleared instead */
+        int fd = fileno(log->fp);
+        fseek(log->fp, 0, SEEK_END);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_APPEND);
+        log->splice_configured = true;
+    }
+
+    rest = splice_copy(fileno(log->fp), count, &leftover);
+    if (rest > 0)
+    {
+        fwrite(leftover, 1, rest, log->fp);
+    }
+    log->file_size += count;
+
+    if (log_rotate_due(log))
+    {
+        log_file_cycle(log, true);
+    }
+}
+#endif
+
+unsigned long log_dropped(struct log_t *log)
+{
+    return (log != NULL) ? log->dropped_bytes : 0;
+}
+
+void log_write_latency(struct log_t *log, unsigned long *count, uint64_t *total_ns, uint64_t *max_ns)
+{
+    if (log == NULL)
+    {
+        *count = 0;
+        *total_ns = 0;
+        *max_ns = 0;
+        return;
+    }
+
+    *count = __atomic_load_n(&log->write_count, __ATOMIC_RELAXED);
+    *total_ns = __atomic_load_n(&log->write_ns_total, __ATOMIC_RELAXED);
+    *max_ns = __atomic_load_n(&log->write_ns_max, __ATOMIC_RELAXED);
+}
+
+/* Reopen log files, eg. after they have been moved by logrotate(8) */
+void log_reopen(void)
+{
+    for (struct log_t *log = logs; log != NULL; log = log->next)
+    {
+        if (log->fp == NULL)
+        {
+            continue;
+        }
+
+        if (log->writer_running)
+        {
+            pthread_mutex_lock(&log->writer_mutex);
+            __atomic_store_n(&log->reopen_requested, true, __ATOMIC_RELEASE);
+            pthread_cond_signal(&log->writer_cond);
+            pthread_mutex_unlock(&log->writer_mutex);
+        }
+        else
+        {
+            log_file_cycle(log, false);
+        }
+    }
+}
+
+void log_close(struct log_t *log)
+{
+    if (log->fp != NULL)
+    {
+        log_async_stop(log);
+        log_file_finish(log);
+        fclose(log->fp);
+        log->fp = NULL;
+    }
+}
+
+void log_exit(void)
+{
     if (log_error)
     {
-        error_printf("Could not open log file %s (%s)", option.log_filename, strerror(errno));
+        error_printf("Could not open log file %s (%s)", log_error_filename, strerror(errno));
+        return;
     }
-    else if (option.log)
+
+    for (struct log_t *log = logs; log != NULL; log = log->next)
     {
-        tio_printf("Saved log to file %s", option.log_filename);
+        log_close(log);
+
+        tio_printf("Saved log to file %s", log->filename);
+        if (log->dropped_bytes > 0)
+        {
+            warning_printf("Dropped %lu bytes of log output (log buffer overflow)", log->dropped_bytes);
+        }
     }
 }
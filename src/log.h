@@ -21,8 +21,21 @@
 
 #pragma once
 
-void log_open(const char *filename);
-void log_printf(const char *format, ...);
-void log_putc(char c);
-void log_close(void);
+#include <stddef.h>
+#include <stdint.h>
+
+struct log_t;
+
+struct log_t *log_open(const char *filename, const char *tty_device);
+const char *log_filename(struct log_t *log);
+void log_printf(struct log_t *log, const char *format, ...);
+void log_putc(struct log_t *log, char c);
+void log_write(struct log_t *log, const char *buffer, size_t count);
+#ifdef HAVE_SPLICE
+void log_splice(struct log_t *log, size_t count);
+#endif
+unsigned long log_dropped(struct log_t *log);
+void log_write_latency(struct log_t *log, unsigned long *count, uint64_t *total_ns, uint64_t *max_ns);
+void log_reopen(void);
+void log_close(struct log_t *log);
 void log_exit(void);
@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
 #include "options.h"
 #include "configfile.h"
 #include "tty.h"
@@ -31,10 +33,18 @@
 #include "print.h"
 #include "signals.h"
 #include "socket.h"
+#include "event.h"
+#include "capture.h"
+#include "bench.h"
+#include "profile.h"
 
 int main(int argc, char *argv[])
 {
     int status = 0;
+    struct stat st;
+
+    /* Time startup phases */
+    profile_mark(NULL);
 
     /* Handle received signals */
     signal_handlers_install();
@@ -44,18 +54,40 @@ int main(int argc, char *argv[])
 
     /* Parse command-line options (1st pass) */
     options_parse(argc, argv);
+    profile_mark("Options");
 
     /* Parse configuration file */
     config_file_parse();
+    profile_mark("Configuration file");
 
     /* Parse command-line options (2nd pass) */
     options_parse_final(argc, argv);
+    profile_mark("Options (2nd pass)");
+
+    /* Play back capture file to stdout or tty device */
+    if (option.replay_filename)
+    {
+        if (strlen(option.tty_device) == 0)
+        {
+            return capture_replay(option.replay_filename, STDOUT_FILENO);
+        }
+        tty_configure();
+        event_init();
+        return tty_replay();
+    }
+
+    /* Benchmark against pty pair unless loopback device is given */
+    if (option.bench && (strlen(option.tty_device) == 0))
+    {
+        option.tty_device = bench_pty_open();
+    }
 
     /* Configure tty device */
     tty_configure();
+    profile_mark("Tty configuration");
 
     /* Configure input terminal */
-    if (isatty(fileno(stdin)))
+    if (isatty(fileno(stdin)) && !option.bench)
     {
        stdin_configure();
     }
@@ -76,15 +108,26 @@ int main(int argc, char *argv[])
         option.color = -1;
     }
 
+    /* Write output in batches */
+    print_stdout_configure(isatty(fileno(stdout)));
+    profile_mark("Terminal setup");
+
     /* Add log exit handler */
     atexit(&log_exit);
 
     /* Create log file */
     if (option.log)
     {
-        log_open(option.log_filename);
+        tty_log_open();
     }
 
+    /* Create capture file */
+    if (option.capture_filename)
+    {
+        tty_capture_open();
+    }
+    profile_mark("Log and capture");
+
     /* Initialize ANSI text formatting (colors etc.) */
     print_init_ansi_formatting();
 
@@ -95,14 +138,31 @@ int main(int argc, char *argv[])
         tio_printf("Press ctrl-t q to quit");
     }
 
+    /* Initialize event loop and listen for input on stdin, unless it is a
+     * file, which cannot be polled and is read when streaming, or scripted
+     * sessions run without terminal, which take no input. Other descriptors
+     * which cannot be polled (eg. /dev/null) are simply not listened to */
+    event_init();
+    if (!option.bench && !((fstat(STDIN_FILENO, &st) == 0) && S_ISREG(st.st_mode)) &&
+        !(option.script_filename && !isatty(STDIN_FILENO)))
+    {
+        event_add(STDIN_FILENO);
+    }
+
     /* Open socket */
     if (option.socket)
     {
-        socket_configure();
+        tty_socket_configure();
     }
+    profile_mark("Event loop and socket");
 
     /* Connect to tty device */
-    if ((option.no_autoconnect) || (!interactive_mode))
+    if (option.bench)
+    {
+        tty_connect();
+        status = bench_report();
+    }
+    else if ((option.no_autoconnect) || (!interactive_mode))
     {
         status = tty_connect();
     }
@@ -23,76 +23,127 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
-#include <sys/time.h>
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "error.h"
 #include "print.h"
 #include "options.h"
 
-#define TIME_STRING_SIZE_MAX 24
+#define TIME_STRING_SIZE_MAX 32
+
+/* Render ".fff" or ".ffffff" fraction of second */
+static void time_fraction_render(char *string, long nsec)
+{
+    int digits = (option.timestamp_resolution == TIMESTAMP_RESOLUTION_US) ? 6 : 3;
+    long value = (digits == 6) ? nsec / 1000 : nsec / 1000000;
+
+    string[0] = '.';
+    for (int i = digits; i > 0; i--)
+    {
+        string[i] = '0' + (value % 10);
+        value /= 10;
+    }
+    string[digits + 1] = 0;
+}
+
+static void timespec_sub(const struct timespec *a, const struct timespec *b, struct timespec *result)
+{
+    result->tv_sec = a->tv_sec - b->tv_sec;
+    result->tv_nsec = a->tv_nsec - b->tv_nsec;
+    if (result->tv_nsec < 0)
+    {
+        result->tv_sec--;
+        result->tv_nsec += 1000000000L;
+    }
+}
 
 char *current_time(void)
 {
     static char time_string[TIME_STRING_SIZE_MAX];
-    static struct timeval tv, tv_now, tv_start, tv_previous;
+    static struct timespec ts_start, ts_previous;
     static bool first = true;
-    struct tm *tm;
-    size_t len;
+    /* The "hh:mm:ss" part is only re-rendered when second or format changes */
+    static enum timestamp_t cached_format = TIMESTAMP_END;
+    static time_t cached_second;
+    static size_t len = 0;
+    struct timespec ts, ts_now;
+    enum timestamp_t format = option.timestamp;
+    struct tm tm;
 
     // Get current time value
-    gettimeofday(&tv_now, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts_now);
 
     if (first)
     {
-        tv_start = tv_now;
+        ts_start = ts_now;
+        ts_previous = ts_now;
         first = false;
     }
 
-    // Add formatted timestap
-    switch (option.timestamp)
+    switch (format)
     {
         case TIMESTAMP_NONE:
         case TIMESTAMP_24HOUR:
-            // "hh:mm:ss.sss" (24 hour format)
-            tv = tv_now;
-            tm = localtime(&tv.tv_sec);
-            len = strftime(time_string, sizeof(time_string), "%H:%M:%S", tm);
+        case TIMESTAMP_ISO8601:
+            clock_gettime(CLOCK_REALTIME, &ts);
             break;
         case TIMESTAMP_24HOUR_START:
-            // "hh:mm:ss.sss" (24 hour format relative to start time)
-            timersub(&tv_now, &tv_start, &tv);
-            tv.tv_sec -= 3600; // Why is this needed??
-            tm = localtime(&tv.tv_sec);
-            len = strftime(time_string, sizeof(time_string), "%H:%M:%S", tm);
+            timespec_sub(&ts_now, &ts_start, &ts);
             break;
         case TIMESTAMP_24HOUR_DELTA:
-            // "hh:mm:ss.sss" (24 hour format relative to previous time stamp)
-            timersub(&tv_now, &tv_previous, &tv);
-            tv.tv_sec -= 3600; // Why is this needed??
-            tm = localtime(&tv.tv_sec);
-            len = strftime(time_string, sizeof(time_string), "%H:%M:%S", tm);
-            break;
-        case TIMESTAMP_ISO8601:
-            // "YYYY-MM-DDThh:mm:ss.sss" (ISO-8601)
-            tv = tv_now;
-            tm = localtime(&tv.tv_sec);
-            len = strftime(time_string, sizeof(time_string), "%Y-%m-%dT%H:%M:%S", tm);
+            timespec_sub(&ts_now, &ts_previous, &ts);
             break;
         default:
             return NULL;
     }
 
-    // Append milliseconds to all timestamps
-    if (len)
+    // Save previous time value for next run
+    ts_previous = ts_now;
+
+    if ((format != cached_format) || (ts.tv_sec != cached_second))
     {
-        len = snprintf(time_string + len, TIME_STRING_SIZE_MAX - len, ".%03ld", (long)tv.tv_usec / 1000);
+        // Add formatted timestamp
+        switch (format)
+        {
+            case TIMESTAMP_NONE:
+            case TIMESTAMP_24HOUR:
+                // "hh:mm:ss.sss" (24 hour format)
+                localtime_r(&ts.tv_sec, &tm);
+                len = strftime(time_string, sizeof(time_string), "%H:%M:%S", &tm);
+                break;
+            case TIMESTAMP_24HOUR_START:
+            case TIMESTAMP_24HOUR_DELTA:
+                // "hh:mm:ss.sss" (elapsed time relative to start or previous time stamp)
+                len = snprintf(time_string, sizeof(time_string), "%02ld:%02ld:%02ld",
+                               (long)ts.tv_sec / 3600, ((long)ts.tv_sec / 60) % 60, (long)ts.tv_sec % 60);
+                break;
+            case TIMESTAMP_ISO8601:
+                // "YYYY-MM-DDThh:mm:ss.sss" (ISO-8601)
+                localtime_r(&ts.tv_sec, &tm);
+                len = strftime(time_string, sizeof(time_string), "%Y-%m-%dT%H:%M:%S", &tm);
+                break;
+            default:
+                return NULL;
+        }
+
+        if ((len == 0) || (len >= TIME_STRING_SIZE_MAX - 8))
+        {
+            cached_format = TIMESTAMP_END;
+            return NULL;
+        }
+
+        cached_format = format;
+        cached_second = ts.tv_sec;
     }
 
-    // Save previous time value for next run
-    tv_previous = tv_now;
+    // Append milli- or microseconds to all timestamps
+    time_fraction_render(time_string + len, ts.tv_nsec);
 
-    return (len < TIME_STRING_SIZE_MAX) ? time_string : NULL;
+    return time_string;
 }
 
 void delay(long ms)
@@ -120,3 +171,151 @@ long string_to_long(char *string)
 
     return result;
 }
+
+/* Decode \r, \n, \t, \e, \\ and \xHH escapes */
+char *string_unescape(const char *text, size_t *length)
+{
+    char *output = malloc(strlen(text) + 1);
+    char *p = output;
+
+    if (output == NULL)
+    {
+        printf("Error: Insufficient memory allocation\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (*text != 0)
+    {
+        if ((text[0] != '\\') || (text[1] == 0))
+        {
+            *p++ = *text++;
+            continue;
+        }
+
+        text++;
+        switch (*text)
+        {
+            case 'r':
+                *p++ = '\r';
+                break;
+            case 'n':
+                *p++ = '\n';
+                break;
+            case 't':
+                *p++ = '\t';
+                break;
+            case 'e':
+                *p++ = '\e';
+                break;
+            case 'x':
+                if (isxdigit((unsigned char) text[1]) && isxdigit((unsigned char) text[2]))
+                {
+                    char hex[3] = { text[1], text[2], 0 };
+                    *p++ = strtol(hex, NULL, 16);
+                    text += 2;
+                    break;
+                }
+                /* fall through */
+            default:
+                *p++ = *text;
+                break;
+        }
+        text++;
+    }
+
+    *length = p - output;
+    return output;
+}
+
+/* Value of hex digit, -1 for other characters */
+static int hex_nibble(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+    {
+        return c - '0';
+    }
+    else if ((c >= 'a') && (c <= 'f'))
+    {
+        return c - 'a' + 10;
+    }
+    else if ((c >= 'A') && (c <= 'F'))
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/* Decode pairs of hex digits to bytes, other characters are skipped. A digit
+ * still missing its pair is kept in *nibble (-1 when none) for the next call.
+ * Output must hold (length + 1) / 2 bytes, returns number of bytes decoded. */
+size_t hex_decode(const char *text, size_t length, char *output, int *nibble)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i < length)
+    {
+        size_t end = length;
+
+#ifdef __SSE2__
+        const __m128i letter_case = _mm_set1_epi8(0x20);
+        const __m128i low_byte = _mm_set1_epi16(0x00ff);
+
+        /* Decode 16 digits to 8 bytes at a time while no digit is pending */
+        for (; (*nibble < 0) && (i + 16 <= length); i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *) (text + i));
+            __m128i lower = _mm_or_si128(v, letter_case);
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+            __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                           _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+            __m128i value, pairs;
+            int mask = _mm_movemask_epi8(_mm_or_si128(digit, letter));
+
+            if (mask != 0xffff)
+            {
+                /* Leave block up to first other character to scalar path */
+                end = i + __builtin_ctz(~mask) + 1;
+                break;
+            }
+
+            value = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+                                 _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+            /* Even bytes hold high nibbles, odd bytes low nibbles */
+            pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(value, low_byte), 4), _mm_srli_epi16(value, 8));
+            _mm_storel_epi64((__m128i *) (output + count), _mm_packus_epi16(pairs, pairs));
+            count += 8;
+        }
+
+        /* Pending digit is paired by scalar path before resuming */
+        if ((*nibble >= 0) && (i < length))
+        {
+            end = i + 1;
+        }
+#endif
+
+        for (; i < end; i++)
+        {
+            int value = hex_nibble(text[i]);
+
+            if (value < 0)
+            {
+                continue;
+            }
+            if (*nibble < 0)
+            {
+                *nibble = value;
+            }
+            else
+            {
+                output[count++] = (*nibble << 4) | value;
+                *nibble = -1;
+            }
+        }
+    }
+
+    return count;
+}
@@ -21,8 +21,12 @@
 
 #pragma once
 
+#include <stddef.h>
+
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
 char * current_time(void);
 void delay(long ms);
 long string_to_long(char *string);
+char *string_unescape(const char *text, size_t *length);
+size_t hex_decode(const char *text, size_t length, char *output, int *nibble);
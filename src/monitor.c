@@ -0,0 +1,311 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Line monitor
+ *
+ * Tracks the error counters kept by the serial driver (TIOCGICOUNT) so that
+ * bytes lost to overruns, and framing or parity errors and breaks, can be
+ * reported as they happen. A helper thread blocks in TIOCMIWAIT until a
+ * modem line changes and then wakes the event loop through a pipe, so line
+ * changes are picked up without polling. Error counters do not wake
+ * TIOCMIWAIT, but errors come with received data, so they are checked
+ * after reads at most every MONITOR_CHECK_INTERVAL_MS while data flows.
+ * The helper is stopped by setting a flag and interrupting TIOCMIWAIT with
+ * MONITOR_WAKE_SIGNAL, which has a no-op handler installed without
+ * SA_RESTART so the ioctl returns EINTR.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_TIOCGICOUNT
+#include <linux/serial.h>
+#endif
+#include "print.h"
+#include "error.h"
+#include "pace.h"
+#include "signals.h"
+#include "monitor.h"
+
+#define MONITOR_CHECK_INTERVAL_MS 100
+#define MONITOR_WAKE_SIGNAL SIGUSR1
+#define MONITOR_WAKE_RETRY_MS 10
+
+#ifdef HAVE_TIOCGICOUNT
+
+struct monitor_t
+{
+    int fd;
+    struct serial_icounter_struct icount;
+    uint64_t next_check;
+    bool thread_running;
+    bool stop;
+    bool notify_pending;
+    int notify_pipe[2];
+    pthread_t thread;
+};
+
+static void monitor_wake_handler(int signum)
+{
+    UNUSED(signum);
+}
+
+static void *monitor_thread(void *arg)
+{
+    struct monitor_t *monitor = arg;
+    sigset_t set;
+    char c = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, MONITOR_WAKE_SIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    while (!__atomic_load_n(&monitor->stop, __ATOMIC_ACQUIRE))
+    {
+        if (ioctl(monitor->fd, TIOCMIWAIT, TIOCM_CTS | TIOCM_DSR | TIOCM_RNG | TIOCM_CD) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        // Only one wakeup needs to be pending at a time
+        if (!__atomic_exchange_n(&monitor->notify_pending, true, __ATOMIC_ACQ_REL))
+        {
+            write(monitor->notify_pipe[1], &c, 1);
+        }
+    }
+
+    /* Not supported by driver or device gone, errors are still checked after reads */
+    return NULL;
+}
+
+static void monitor_wake_install(void)
+{
+    static bool installed = false;
+    struct sigaction action = {};
+
+    if (installed)
+    {
+        return;
+    }
+
+    /* No SA_RESTART, TIOCMIWAIT must fail with EINTR to see the stop flag */
+    action.sa_handler = monitor_wake_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(MONITOR_WAKE_SIGNAL, &action, NULL);
+
+    installed = true;
+}
+
+struct monitor_t *monitor_start(int fd)
+{
+    struct monitor_t *monitor;
+    struct serial_icounter_struct icount;
+
+    /* Nothing to monitor if driver does not count (eg. pty) */
+    if (ioctl(fd, TIOCGICOUNT, &icount) < 0)
+    {
+        return NULL;
+    }
+
+    monitor = calloc(1, sizeof(struct monitor_t));
+    if (monitor == NULL)
+    {
+        error_printf("Insufficient memory allocation for line monitor");
+        exit(EXIT_FAILURE);
+    }
+
+    monitor->fd = fd;
+    monitor->icount = icount;
+
+    if (pipe(monitor->notify_pipe) < 0)
+    {
+        error_printf("Could not create line monitor pipe (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fcntl(monitor->notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(monitor->notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+    monitor_wake_install();
+
+    if (signal_thread_create(&monitor->thread, monitor_thread, monitor) == 0)
+    {
+        monitor->thread_running = true;
+    }
+
+    return monitor;
+}
+
+void monitor_stop(struct monitor_t *monitor)
+{
+    if (monitor == NULL)
+    {
+        return;
+    }
+
+    if (monitor->thread_running)
+    {
+        struct timespec deadline;
+
+        __atomic_store_n(&monitor->stop, true, __ATOMIC_RELEASE);
+
+        /* Keep interrupting until joined, in case the signal arrived just
+         * before the thread entered TIOCMIWAIT */
+        do
+        {
+            pthread_kill(monitor->thread, MONITOR_WAKE_SIGNAL);
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += MONITOR_WAKE_RETRY_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+        while (pthread_timedjoin_np(monitor->thread, NULL, &deadline) == ETIMEDOUT);
+    }
+
+    close(monitor->notify_pipe[0]);
+    close(monitor->notify_pipe[1]);
+    free(monitor);
+}
+
+int monitor_event_fd(struct monitor_t *monitor)
+{
+    return monitor->notify_pipe[0];
+}
+
+void monitor_acknowledge(struct monitor_t *monitor)
+{
+    char buffer[64];
+
+    while (read(monitor->notify_pipe[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+    __atomic_store_n(&monitor->notify_pending, false, __ATOMIC_RELEASE);
+}
+
+/* Limit error counter checks while data is received */
+bool monitor_due(struct monitor_t *monitor)
+{
+    uint64_t now;
+
+    if (monitor == NULL)
+    {
+        return false;
+    }
+
+    now = pace_now();
+    if (now < monitor->next_check)
+    {
+        return false;
+    }
+
+    monitor->next_check = now + MONITOR_CHECK_INTERVAL_MS * 1000000ULL;
+
+    return true;
+}
+
+/* Get counter changes since last check, returns true if anything changed */
+bool monitor_check(struct monitor_t *monitor, struct monitor_event_t *event)
+{
+    struct serial_icounter_struct icount;
+
+    if (ioctl(monitor->fd, TIOCGICOUNT, &icount) < 0)
+    {
+        return false;
+    }
+
+    event->overrun = icount.overrun - monitor->icount.overrun;
+    event->buf_overrun = icount.buf_overrun - monitor->icount.buf_overrun;
+    event->frame = icount.frame - monitor->icount.frame;
+    event->parity = icount.parity - monitor->icount.parity;
+    event->brk = icount.brk - monitor->icount.brk;
+    event->cts = icount.cts - monitor->icount.cts;
+    event->dsr = icount.dsr - monitor->icount.dsr;
+    event->rng = icount.rng - monitor->icount.rng;
+    event->dcd = icount.dcd - monitor->icount.dcd;
+
+    monitor->icount = icount;
+
+    return (event->overrun | event->buf_overrun | event->frame | event->parity | event->brk |
+            event->cts | event->dsr | event->rng | event->dcd) != 0;
+}
+
+#else
+
+struct monitor_t *monitor_start(int fd)
+{
+    UNUSED(fd);
+
+    return NULL;
+}
+
+void monitor_stop(struct monitor_t *monitor)
+{
+    UNUSED(monitor);
+}
+
+int monitor_event_fd(struct monitor_t *monitor)
+{
+    UNUSED(monitor);
+
+    return -1;
+}
+
+void monitor_acknowledge(struct monitor_t *monitor)
+{
+    UNUSED(monitor);
+}
+
+bool monitor_due(struct monitor_t *monitor)
+{
+    UNUSED(monitor);
+
+    return false;
+}
+
+bool monitor_check(struct monitor_t *monitor, struct monitor_event_t *event)
+{
+    UNUSED(monitor);
+    UNUSED(event);
+
+    return false;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/* Changes since previous check */
+struct monitor_event_t
+{
+    unsigned int overrun, buf_overrun, frame, parity, brk;
+    unsigned int cts, dsr, rng, dcd;
+};
+
+struct monitor_t;
+
+struct monitor_t *monitor_start(int fd);
+void monitor_stop(struct monitor_t *monitor);
+int monitor_event_fd(struct monitor_t *monitor);
+void monitor_acknowledge(struct monitor_t *monitor);
+bool monitor_due(struct monitor_t *monitor);
+bool monitor_check(struct monitor_t *monitor, struct monitor_event_t *event);
@@ -35,42 +35,107 @@
 #include "misc.h"
 #include "print.h"
 #include "tty.h"
+#include "devices.h"
 
 enum opt_t
 {
     OPT_NONE,
     OPT_TIMESTAMP_FORMAT,
+    OPT_TIMESTAMP_RESOLUTION,
     OPT_LOG_FILE,
     OPT_LOG_STRIP,
+    OPT_LOG_ASYNC,
+    OPT_LOG_BUFFER_SIZE,
+    OPT_LOG_FSYNC_INTERVAL,
+    OPT_LOG_ROTATE_SIZE,
+    OPT_LOG_ROTATE_INTERVAL,
+    OPT_LOG_COMPRESS,
+    OPT_HEXADECIMAL_DUMP,
+    OPT_SOCKET_POLICY,
+    OPT_SOCKET_PROTOCOL,
+    OPT_OUTPUT_RATE,
+    OPT_RX_BUFFER_SIZE,
+    OPT_LIST_FORMAT,
+    OPT_LOW_LATENCY,
+    OPT_RX_PRIORITY,
+    OPT_RX_CPU,
+    OPT_STREAM_SIZE,
+    OPT_STREAM_TIMEOUT,
+    OPT_SCRIPT,
+    OPT_SCROLLBACK,
+    OPT_SCROLLBACK_COMPRESS,
+    OPT_CAPTURE,
+    OPT_REPLAY,
+    OPT_REPLAY_SPEED,
+    OPT_STATS_INTERVAL,
+    OPT_STATS_FILE,
+    OPT_BENCH,
+    OPT_BENCH_SIZE,
+    OPT_BENCH_PATTERN,
+    OPT_PROFILE_STARTUP,
 };
 
 /* Default options */
 struct option_t option =
 {
     .tty_device = "",
+    .extra_tty_devices = NULL,
+    .extra_tty_devices_count = 0,
     .baudrate = 115200,
     .databits = 8,
     .flow = "none",
     .stopbits = 1,
     .parity = "none",
     .output_delay = 0,
+    .output_line_delay = 0,
+    .output_rate = 0,
+    .rx_buffer_size = 0,
+    .low_latency = false,
+    .rx_priority = 0,
+    .rx_cpu = -1,
     .no_autoconnect = false,
+    .stream_size = 0,
+    .stream_timeout = 0,
+    .script_filename = NULL,
+    .scrollback_size = 0,
+    .scrollback_compress = false,
     .log = false,
     .log_filename = NULL,
+    .capture_filename = NULL,
+    .replay_filename = NULL,
+    .replay_speed = 1,
     .log_strip = false,
+    .log_async = false,
+    .log_buffer_size = 1024*1024,
+    .log_fsync_interval = 0,
+    .log_rotate_size = 0,
+    .log_rotate_interval = 0,
+    .log_compress = false,
     .local_echo = false,
     .timestamp = TIMESTAMP_NONE,
+    .timestamp_resolution = TIMESTAMP_RESOLUTION_MS,
     .socket = NULL,
+    .socket_policy = SOCKET_POLICY_DROP,
+    .socket_protocol = SOCKET_PROTOCOL_RAW,
     .map = "",
     .color = 15,
     .hex_mode = false,
+    .hex_dump = false,
+    .stats_interval = 0,
+    .stats_filename = NULL,
+    .bench = false,
+    .bench_size = 16777216,
+    .bench_pattern = BENCH_PATTERN_COUNTER,
+    .profile_startup = false,
+    .list_format = LIST_FORMAT_TABLE,
 };
 
 void print_help(char *argv[])
 {
-    printf("Usage: %s [<options>] <tty-device|sub-config>\n", argv[0]);
+    printf("Usage: %s [<options>] <tty-device|sub-config> [<tty-device>..]\n", argv[0]);
     printf("\n");
     printf("Connect to tty device directly or via sub-configuration.\n");
+    printf("Several tty devices (or glob patterns) may be given to serve them all at once.\n");
     printf("\n");
     printf("Options:\n");
     printf("  -b, --baudrate <bps>             Baud rate (default: 115200)\n");
@@ -78,19 +143,50 @@ void print_help(char *argv[])
     printf("  -f, --flow hard|soft|none        Flow control (default: none)\n");
     printf("  -s, --stopbits 1|2               Stop bits (default: 1)\n");
     printf("  -p, --parity odd|even|none       Parity (default: none)\n");
-    printf("  -o, --output-delay <ms>          Output delay (default: 0)\n");
+    printf("  -o, --output-delay <ms>          Character output delay (default: 0)\n");
+    printf("  -O, --output-line-delay <ms>     Line output delay (default: 0)\n");
+    printf("      --output-rate <bytes/s>      Limit output rate (default: 0)\n");
+    printf("      --rx-buffer-size <bytes>     Receive via reader thread and buffer (default: 0)\n");
+    printf("      --low-latency                Enable low latency profile\n");
+    printf("      --rx-priority <1..99>        Receive with real-time (SCHED_FIFO) priority\n");
+    printf("      --rx-cpu <cpu>               Pin receiving thread to CPU\n");
     printf("  -n, --no-autoconnect             Disable automatic connect\n");
+    printf("      --stream-size <bytes>        Exit piped session after receiving bytes (default: 0)\n");
+    printf("      --stream-timeout <ms>        Exit piped session when idle (default: 0)\n");
+    printf("      --script <filename>          Run script of send/expect commands in session\n");
+    printf("      --scrollback <bytes>         Keep received data in memory for search (default: 0)\n");
+    printf("      --scrollback-compress        Compress older scrollback data\n");
     printf("  -e, --local-echo                 Enable local echo\n");
     printf("  -t, --timestamp                  Enable line timestamp\n");
     printf("      --timestamp-format <format>  Set timestamp format (default: 24hour)\n");
+    printf("      --timestamp-resolution ms|us Set timestamp resolution (default: ms)\n");
     printf("  -L, --list-devices               List available serial devices\n");
+    printf("      --list-format table|json     Set device list format (default: table)\n");
     printf("  -l, --log                        Enable log to file\n");
     printf("      --log-file <filename>        Set log filename\n");
     printf("      --log-strip                  Strip control characters and escape sequences\n");
+    printf("      --log-async                  Write log from separate thread\n");
+    printf("      --log-buffer-size <bytes>    Set asynchronous log buffer size (default: 1048576)\n");
+    printf("      --log-fsync-interval <ms>    Set asynchronous log fsync interval (default: 0)\n");
+    printf("      --log-rotate-size <bytes>    Rotate log file at size (default: 0)\n");
+    printf("      --log-rotate-interval <s>    Rotate log file periodically (default: 0)\n");
+    printf("      --log-compress               Compress log file (gzip)\n");
+    printf("      --capture <filename>         Capture timestamped RX/TX data to binary file\n");
+    printf("      --replay <filename>          Replay received data of capture file\n");
+    printf("      --replay-speed <factor>      Set replay speed, 0 for no delays (default: 1)\n");
     printf("  -m, --map <flags>                Map special characters\n");
     printf("  -c, --color 0..255|none|list     Colorize tio text (default: 15)\n");
     printf("  -S, --socket <socket>            Redirect I/O to file or network socket\n");
+    printf("      --socket-policy <policy>     Set slow socket client policy (default: drop)\n");
+    printf("      --socket-protocol <protocol> Set socket protocol raw|rfc2217|framed (default: raw)\n");
     printf("  -x, --hexadecimal                Enable hexadecimal mode\n");
+    printf("      --hexadecimal-dump           Enable hexadecimal dump layout\n");
+    printf("      --stats-interval <s>         Print statistics status line periodically (default: 0)\n");
+    printf("      --stats-file <filename>      Publish statistics to file in Prometheus format\n");
+    printf("      --bench                      Benchmark receive path via pty or loopback device\n");
+    printf("      --bench-size <bytes>         Set benchmark size (default: 16777216)\n");
+    printf("      --bench-pattern <pattern>    Set benchmark pattern (default: counter)\n");
+    printf("      --profile-startup            Report time spent per startup and connect phase\n");
     printf("  -v, --version                    Display version\n");
     printf("  -h, --help                       Display help\n");
     printf("\n");
@@ -158,6 +254,178 @@ enum timestamp_t timestamp_option_parse(const char *arg)
     return timestamp;
 }
 
+const char* socket_policy_to_string(enum socket_policy_t policy)
+{
+    switch (policy)
+    {
+        case SOCKET_POLICY_DROP:
+            return "drop";
+            break;
+
+        case SOCKET_POLICY_DISCONNECT:
+            return "disconnect";
+            break;
+
+        case SOCKET_POLICY_BLOCK:
+            return "block";
+            break;
+
+        default:
+            return "unknown";
+            break;
+    }
+}
+
+enum socket_policy_t socket_policy_option_parse(const char *arg)
+{
+    if (strcmp(arg, "drop") == 0)
+    {
+        return SOCKET_POLICY_DROP;
+    }
+    else if (strcmp(arg, "disconnect") == 0)
+    {
+        return SOCKET_POLICY_DISCONNECT;
+    }
+    else if (strcmp(arg, "block") == 0)
+    {
+        return SOCKET_POLICY_BLOCK;
+    }
+
+    printf("Error: Invalid socket policy %s\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+const char* socket_protocol_to_string(enum socket_protocol_t protocol)
+{
+    switch (protocol)
+    {
+        case SOCKET_PROTOCOL_RAW:
+            return "raw";
+            break;
+
+        case SOCKET_PROTOCOL_RFC2217:
+            return "rfc2217";
+            break;
+
+        case SOCKET_PROTOCOL_FRAMED:
+            return "framed";
+            break;
+
+        default:
+            return "unknown";
+            break;
+    }
+}
+
+enum socket_protocol_t socket_protocol_option_parse(const char *arg)
+{
+    if (strcmp(arg, "raw") == 0)
+    {
+        return SOCKET_PROTOCOL_RAW;
+    }
+    else if (strcmp(arg, "rfc2217") == 0)
+    {
+        return SOCKET_PROTOCOL_RFC2217;
+    }
+    else if (strcmp(arg, "framed") == 0)
+    {
+        return SOCKET_PROTOCOL_FRAMED;
+    }
+
+    printf("Error: Invalid socket protocol %s\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+enum bench_pattern_t bench_pattern_option_parse(const char *arg)
+{
+    if (strcmp(arg, "counter") == 0)
+    {
+        return BENCH_PATTERN_COUNTER;
+    }
+    else if (strcmp(arg, "random") == 0)
+    {
+        return BENCH_PATTERN_RANDOM;
+    }
+    else if (strcmp(arg, "text") == 0)
+    {
+        return BENCH_PATTERN_TEXT;
+    }
+
+    printf("Error: Invalid benchmark pattern %s\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+enum list_format_t list_format_option_parse(const char *arg)
+{
+    if (strcmp(arg, "table") == 0)
+    {
+        return LIST_FORMAT_TABLE;
+    }
+    else if (strcmp(arg, "json") == 0)
+    {
+        return LIST_FORMAT_JSON;
+    }
+
+    printf("Error: Invalid list format %s\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+long delay_option_parse(const char *arg)
+{
+    double delay;
+    char *end_token;
+
+    /* Delays are given in milliseconds but kept in microseconds */
+    errno = 0;
+    delay = strtod(arg, &end_token);
+    if ((errno != 0) || (*end_token != 0) || (delay < 0) || (delay > LONG_MAX / 1000))
+    {
+        printf("Error: Invalid delay %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return (long) (delay * 1000 + 0.5);
+}
+
+double replay_speed_option_parse(const char *arg)
+{
+    double speed;
+    char *end_token;
+
+    errno = 0;
+    speed = strtod(arg, &end_token);
+    if ((errno != 0) || (*end_token != 0) || (speed < 0))
+    {
+        printf("Error: Invalid replay speed %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return speed;
+}
+
+int rx_priority_option_parse(const char *arg)
+{
+    long priority = string_to_long((char *) arg);
+
+    if ((priority < 1) || (priority > 99))
+    {
+        printf("Error: Invalid real-time priority %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return priority;
+}
+
+enum timestamp_resolution_t timestamp_resolution_option_parse(const char *arg)
+{
+    if (strcmp(arg, "us") == 0)
+    {
+        return TIMESTAMP_RESOLUTION_US;
+    }
+
+    return TIMESTAMP_RESOLUTION_MS; // Default
+}
+
 void options_print()
 {
     tio_printf(" TTY device: %s", option.tty_device);
@@ -168,18 +436,62 @@ void options_print()
     tio_printf(" Parity: %s", option.parity);
     tio_printf(" Local echo: %s", option.local_echo ? "enabled" : "disabled");
     tio_printf(" Timestamp: %s", timestamp_state_to_string(option.timestamp));
-    tio_printf(" Output delay: %d", option.output_delay);
+    tio_printf(" Timestamp resolution: %s", (option.timestamp_resolution == TIMESTAMP_RESOLUTION_US) ? "us" : "ms");
+    tio_printf(" Output delay: %g", option.output_delay / 1000.0);
+    tio_printf(" Output line delay: %g", option.output_line_delay / 1000.0);
+    if (option.output_rate)
+        tio_printf(" Output rate: %lu", option.output_rate);
+    if (option.rx_buffer_size)
+        tio_printf(" RX buffer size: %lu", option.rx_buffer_size);
+    if (option.low_latency)
+        tio_printf(" Low latency: enabled");
+    if (option.rx_priority)
+        tio_printf(" RX priority: %d", option.rx_priority);
+    if (option.rx_cpu >= 0)
+        tio_printf(" RX CPU: %d", option.rx_cpu);
     tio_printf(" Auto connect: %s", option.no_autoconnect ? "disabled" : "enabled");
+    if (option.stream_size)
+        tio_printf(" Stream size: %lu", option.stream_size);
+    if (option.stream_timeout)
+        tio_printf(" Stream timeout: %d", option.stream_timeout);
+    if (option.script_filename)
+        tio_printf(" Script file: %s", option.script_filename);
+    if (option.scrollback_size)
+        tio_printf(" Scrollback size: %lu%s", option.scrollback_size, option.scrollback_compress ? " (compressed)" : "");
     if (option.map[0] != 0)
         tio_printf(" Map flags: %s", option.map);
     if (option.log)
+    {
         tio_printf(" Log file: %s", option.log_filename);
+        if (option.log_async)
+        {
+            tio_printf(" Log buffer size: %lu", option.log_buffer_size);
+            tio_printf(" Log fsync interval: %d", option.log_fsync_interval);
+        }
+        if (option.log_rotate_size)
+            tio_printf(" Log rotate size: %lu", option.log_rotate_size);
+        if (option.log_rotate_interval)
+            tio_printf(" Log rotate interval: %d", option.log_rotate_interval);
+        if (option.log_compress)
+            tio_printf(" Log compression: gzip");
+    }
+    if (option.capture_filename)
+        tio_printf(" Capture file: %s", option.capture_filename);
+    if (option.stats_interval)
+        tio_printf(" Statistics interval: %d", option.stats_interval);
+    if (option.stats_filename)
+        tio_printf(" Statistics file: %s", option.stats_filename);
     if (option.socket)
+    {
         tio_printf(" Socket: %s", option.socket);
+        tio_printf(" Socket policy: %s", socket_policy_to_string(option.socket_policy));
+        tio_printf(" Socket protocol: %s", socket_protocol_to_string(option.socket_protocol));
+    }
 }
 
 void options_parse(int argc, char *argv[])
 {
+    bool list_devices = false;
     int c;
 
     if (argc == 1)
@@ -198,18 +510,49 @@ void options_parse(int argc, char *argv[])
             {"stopbits",         required_argument, 0, 's'                  },
             {"parity",           required_argument, 0, 'p'                  },
             {"output-delay",     required_argument, 0, 'o'                  },
+            {"output-line-delay", required_argument, 0, 'O'                 },
+            {"output-rate",      required_argument, 0, OPT_OUTPUT_RATE      },
+            {"low-latency",      no_argument,       0, OPT_LOW_LATENCY      },
+            {"rx-priority",      required_argument, 0, OPT_RX_PRIORITY      },
+            {"rx-cpu",           required_argument, 0, OPT_RX_CPU           },
+            {"rx-buffer-size",   required_argument, 0, OPT_RX_BUFFER_SIZE   },
             {"no-autoconnect",   no_argument,       0, 'n'                  },
+            {"stream-size",      required_argument, 0, OPT_STREAM_SIZE      },
+            {"stream-timeout",   required_argument, 0, OPT_STREAM_TIMEOUT   },
+            {"script",           required_argument, 0, OPT_SCRIPT           },
+            {"scrollback",       required_argument, 0, OPT_SCROLLBACK       },
+            {"scrollback-compress", no_argument,    0, OPT_SCROLLBACK_COMPRESS },
             {"local-echo",       no_argument,       0, 'e'                  },
             {"timestamp",        no_argument,       0, 't'                  },
             {"timestamp-format", required_argument, 0, OPT_TIMESTAMP_FORMAT },
+            {"timestamp-resolution", required_argument, 0, OPT_TIMESTAMP_RESOLUTION },
             {"list-devices",     no_argument,       0, 'L'                  },
+            {"list-format",      required_argument, 0, OPT_LIST_FORMAT      },
             {"log",              no_argument,       0, 'l'                  },
             {"log-file",         required_argument, 0, OPT_LOG_FILE         },
             {"log-strip",        no_argument,       0, OPT_LOG_STRIP        },
+            {"log-async",        no_argument,       0, OPT_LOG_ASYNC        },
+            {"log-buffer-size",  required_argument, 0, OPT_LOG_BUFFER_SIZE  },
+            {"log-fsync-interval", required_argument, 0, OPT_LOG_FSYNC_INTERVAL },
+            {"log-rotate-size",  required_argument, 0, OPT_LOG_ROTATE_SIZE  },
+            {"log-rotate-interval", required_argument, 0, OPT_LOG_ROTATE_INTERVAL },
+            {"log-compress",     no_argument,       0, OPT_LOG_COMPRESS     },
+            {"capture",          required_argument, 0, OPT_CAPTURE          },
+            {"replay",           required_argument, 0, OPT_REPLAY           },
+            {"replay-speed",     required_argument, 0, OPT_REPLAY_SPEED     },
             {"socket",           required_argument, 0, 'S'                  },
+            {"socket-policy",    required_argument, 0, OPT_SOCKET_POLICY    },
+            {"socket-protocol",  required_argument, 0, OPT_SOCKET_PROTOCOL  },
             {"map",              required_argument, 0, 'm'                  },
             {"color",            required_argument, 0, 'c'                  },
             {"hexadecimal",      no_argument,       0, 'x'                  },
+            {"hexadecimal-dump", no_argument,       0, OPT_HEXADECIMAL_DUMP },
+            {"stats-interval",   required_argument, 0, OPT_STATS_INTERVAL   },
+            {"stats-file",       required_argument, 0, OPT_STATS_FILE       },
+            {"bench",            no_argument,       0, OPT_BENCH            },
+            {"bench-size",       required_argument, 0, OPT_BENCH_SIZE       },
+            {"bench-pattern",    required_argument, 0, OPT_BENCH_PATTERN    },
+            {"profile-startup",  no_argument,       0, OPT_PROFILE_STARTUP  },
             {"version",          no_argument,       0, 'v'                  },
             {"help",             no_argument,       0, 'h'                  },
             {0,                  0,                 0,  0                   }
@@ -219,7 +562,7 @@ void options_parse(int argc, char *argv[])
         int option_index = 0;
 
         /* Parse argument using getopt_long */
-        c = getopt_long(argc, argv, "b:d:f:s:p:o:netLlS:m:c:xvh", long_options, &option_index);
+        c = getopt_long(argc, argv, "b:d:f:s:p:o:O:netLlS:m:c:xvh", long_options, &option_index);
 
         /* Detect the end of the options */
         if (c == -1)
@@ -258,7 +601,19 @@ void options_parse(int argc, char *argv[])
                 break;
 
             case 'o':
-                option.output_delay = string_to_long(optarg);
+                option.output_delay = delay_option_parse(optarg);
+                break;
+
+            case 'O':
+                option.output_line_delay = delay_option_parse(optarg);
+                break;
+
+            case OPT_OUTPUT_RATE:
+                option.output_rate = string_to_long(optarg);
+                break;
+
+            case OPT_RX_BUFFER_SIZE:
+                option.rx_buffer_size = string_to_long(optarg);
                 break;
 
             case 'n':
@@ -277,9 +632,16 @@ void options_parse(int argc, char *argv[])
                 option.timestamp = timestamp_option_parse(optarg);
                 break;
 
+            case OPT_TIMESTAMP_RESOLUTION:
+                option.timestamp_resolution = timestamp_resolution_option_parse(optarg);
+                break;
+
             case 'L':
-                list_serial_devices();
-                exit(EXIT_SUCCESS);
+                list_devices = true;
+                break;
+
+            case OPT_LIST_FORMAT:
+                option.list_format = list_format_option_parse(optarg);
                 break;
 
             case 'l':
@@ -294,10 +656,86 @@ void options_parse(int argc, char *argv[])
                 option.log_strip = true;
                 break;
 
+            case OPT_LOG_ASYNC:
+                option.log_async = true;
+                break;
+
+            case OPT_LOG_BUFFER_SIZE:
+                option.log_buffer_size = string_to_long(optarg);
+                break;
+
+            case OPT_LOG_FSYNC_INTERVAL:
+                option.log_fsync_interval = string_to_long(optarg);
+                break;
+
+            case OPT_LOG_ROTATE_SIZE:
+                option.log_rotate_size = string_to_long(optarg);
+                break;
+
+            case OPT_LOG_ROTATE_INTERVAL:
+                option.log_rotate_interval = string_to_long(optarg);
+                break;
+
+            case OPT_LOG_COMPRESS:
+                option.log_compress = true;
+                break;
+
+            case OPT_LOW_LATENCY:
+                option.low_latency = true;
+                break;
+
+            case OPT_RX_PRIORITY:
+                option.rx_priority = rx_priority_option_parse(optarg);
+                break;
+
+            case OPT_RX_CPU:
+                option.rx_cpu = string_to_long(optarg);
+                break;
+
+            case OPT_STREAM_SIZE:
+                option.stream_size = string_to_long(optarg);
+                break;
+
+            case OPT_STREAM_TIMEOUT:
+                option.stream_timeout = string_to_long(optarg);
+                break;
+
+            case OPT_SCRIPT:
+                option.script_filename = optarg;
+                break;
+
+            case OPT_SCROLLBACK:
+                option.scrollback_size = string_to_long(optarg);
+                break;
+
+            case OPT_SCROLLBACK_COMPRESS:
+                option.scrollback_compress = true;
+                break;
+
+            case OPT_CAPTURE:
+                option.capture_filename = optarg;
+                break;
+
+            case OPT_REPLAY:
+                option.replay_filename = optarg;
+                break;
+
+            case OPT_REPLAY_SPEED:
+                option.replay_speed = replay_speed_option_parse(optarg);
+                break;
+
             case 'S':
                 option.socket = optarg;
                 break;
 
+            case OPT_SOCKET_POLICY:
+                option.socket_policy = socket_policy_option_parse(optarg);
+                break;
+
+            case OPT_SOCKET_PROTOCOL:
+                option.socket_protocol = socket_protocol_option_parse(optarg);
+                break;
+
             case 'm':
                 option.map = optarg;
                 break;
@@ -332,6 +770,39 @@ void options_parse(int argc, char *argv[])
                 option.hex_mode = true;
                 break;
 
+            case OPT_HEXADECIMAL_DUMP:
+                option.hex_dump = true;
+                break;
+
+            case OPT_STATS_INTERVAL:
+                option.stats_interval = string_to_long(optarg);
+                break;
+
+            case OPT_STATS_FILE:
+                option.stats_filename = optarg;
+                break;
+
+            case OPT_BENCH:
+                option.bench = true;
+                break;
+
+            case OPT_BENCH_SIZE:
+                option.bench_size = string_to_long(optarg);
+                if (option.bench_size == 0)
+                {
+                    printf("Error: Invalid benchmark size %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPT_BENCH_PATTERN:
+                option.bench_pattern = bench_pattern_option_parse(optarg);
+                break;
+
+            case OPT_PROFILE_STARTUP:
+                option.profile_startup = true;
+                break;
+
             case 'v':
                 printf("tio v%s\n", VERSION);
                 printf("Copyright (c) 2014-2022 Martin Lund\n");
@@ -357,27 +828,27 @@ void options_parse(int argc, char *argv[])
         }
     }
 
+    if (list_devices)
+    {
+        devices_print(option.list_format);
+        exit(EXIT_SUCCESS);
+    }
+
     /* Assume first non-option is the tty device name */
     if (strcmp(option.tty_device, ""))
 	    optind++;
     else if (optind < argc)
         option.tty_device = argv[optind++];
 
-    if (strlen(option.tty_device) == 0)
+    if ((strlen(option.tty_device) == 0) && (option.replay_filename == NULL) && !option.bench)
     {
         printf("Error: Missing tty device or sub-configuration name\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Print any remaining command line arguments (unknown options) */
-    if (optind < argc)
-    {
-        printf("Error: Unknown argument ");
-        while (optind < argc)
-            printf("%s ", argv[optind++]);
-        printf("\n");
-        exit(EXIT_FAILURE);
-    }
+    /* Any remaining non-options are additional tty devices */
+    option.extra_tty_devices = &argv[optind];
+    option.extra_tty_devices_count = argc - optind;
 }
 
 void options_parse_final(int argc, char *argv[])
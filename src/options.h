@@ -38,26 +38,108 @@ enum timestamp_t
 
 enum timestamp_t timestamp_option_parse(const char *arg);
 
+enum timestamp_resolution_t
+{
+    TIMESTAMP_RESOLUTION_MS,
+    TIMESTAMP_RESOLUTION_US,
+};
+
+enum timestamp_resolution_t timestamp_resolution_option_parse(const char *arg);
+
+enum socket_policy_t
+{
+    SOCKET_POLICY_DROP,
+    SOCKET_POLICY_DISCONNECT,
+    SOCKET_POLICY_BLOCK,
+};
+
+enum socket_policy_t socket_policy_option_parse(const char *arg);
+
+enum socket_protocol_t
+{
+    SOCKET_PROTOCOL_RAW,
+    SOCKET_PROTOCOL_RFC2217,
+    SOCKET_PROTOCOL_FRAMED,
+};
+
+enum socket_protocol_t socket_protocol_option_parse(const char *arg);
+
+enum bench_pattern_t
+{
+    BENCH_PATTERN_COUNTER,
+    BENCH_PATTERN_RANDOM,
+    BENCH_PATTERN_TEXT,
+};
+
+enum bench_pattern_t bench_pattern_option_parse(const char *arg);
+
+enum list_format_t
+{
+    LIST_FORMAT_TABLE,
+    LIST_FORMAT_JSON,
+};
+
+enum list_format_t list_format_option_parse(const char *arg);
+
+long delay_option_parse(const char *arg);
+
+double replay_speed_option_parse(const char *arg);
+
+int rx_priority_option_parse(const char *arg);
+
 /* Options */
 struct option_t
 {
     const char *tty_device;
+    char **extra_tty_devices;
+    int extra_tty_devices_count;
     unsigned int baudrate;
     int databits;
     char *flow;
     int stopbits;
     char *parity;
-    int output_delay;
+    long output_delay;
+    long output_line_delay;
+    unsigned long output_rate;
+    unsigned long rx_buffer_size;
+    bool low_latency;
+    int rx_priority;
+    int rx_cpu;
     bool no_autoconnect;
+    unsigned long stream_size;
+    int stream_timeout;
+    const char *script_filename;
+    unsigned long scrollback_size;
+    bool scrollback_compress;
     bool log;
     bool log_strip;
+    bool log_async;
+    unsigned long log_buffer_size;
+    int log_fsync_interval;
+    unsigned long log_rotate_size;
+    int log_rotate_interval;
+    bool log_compress;
     bool local_echo;
     enum timestamp_t timestamp;
+    enum timestamp_resolution_t timestamp_resolution;
     const char *log_filename;
+    const char *capture_filename;
+    const char *replay_filename;
+    double replay_speed;
     const char *map;
     const char *socket;
+    enum socket_policy_t socket_policy;
+    enum socket_protocol_t socket_protocol;
     int color;
     bool hex_mode;
+    bool hex_dump;
+    int stats_interval;
+    const char *stats_filename;
+    bool bench;
+    unsigned long bench_size;
+    enum bench_pattern_t bench_pattern;
+    bool profile_startup;
+    enum list_format_t list_format;
 };
 
 extern struct option_t option;
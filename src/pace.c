@@ -0,0 +1,198 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Output pacing
+ *
+ * Output is written according to an absolute schedule on the monotonic
+ * clock so that sleep overshoot does not accumulate. Each byte advances
+ * the schedule by the character delay or the byte interval of the target
+ * rate, whichever is longer, and each newline is drained to the wire and
+ * followed by the line delay. The schedule is never allowed to fall behind
+ * the current time, so idle periods are not made up for by bursts.
+ *
+ * Writers which must not sleep, like file transfers run from the event
+ * loop, write one segment whenever its deadline has passed instead.
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/param.h>
+#include "options.h"
+#include "print.h"
+#include "pace.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Number of rate limited bytes written per wakeup, in 1/x seconds */
+#define PACE_RATE_QUANTUM 100
+
+static uint64_t next_deadline = 0;
+
+uint64_t pace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void pace_sleep_until(uint64_t deadline)
+{
+    struct timespec ts;
+
+#ifdef HAVE_CLOCK_NANOSLEEP
+    ts.tv_sec = deadline / NSEC_PER_SEC;
+    ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+#else
+    uint64_t now = pace_now();
+
+    while (now < deadline)
+    {
+        ts.tv_sec = (deadline - now) / NSEC_PER_SEC;
+        ts.tv_nsec = (deadline - now) % NSEC_PER_SEC;
+        nanosleep(&ts, NULL);
+        now = pace_now();
+    }
+#endif
+}
+
+static ssize_t pace_write_all(int fd, const char *buffer, size_t count)
+{
+    size_t bytes_written = 0;
+
+    while (bytes_written < count)
+    {
+        ssize_t retval = write(fd, buffer + bytes_written, count - bytes_written);
+        if (retval < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EINTR))
+            {
+                // Wait until device accepts more output
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            // Error
+            debug_printf("Write error (%s)", strerror(errno));
+            return -1;
+        }
+        bytes_written += retval;
+    }
+
+    return bytes_written;
+}
+
+bool pace_enabled(void)
+{
+    return option.output_delay || option.output_line_delay || option.output_rate;
+}
+
+/* Time at which the next segment is due */
+uint64_t pace_deadline(void)
+{
+    return next_deadline;
+}
+
+/* Length of the segment at start of buffer which is written at one deadline */
+size_t pace_segment(const char *buffer, size_t count)
+{
+    if (option.output_delay)
+    {
+        return 1;
+    }
+
+    if (option.output_line_delay)
+    {
+        const char *newline = memchr(buffer, '\n', count);
+        if (newline != NULL)
+        {
+            count = newline - buffer + 1;
+        }
+    }
+
+    if (option.output_rate)
+    {
+        count = MIN(count, MAX(option.output_rate / PACE_RATE_QUANTUM, 1UL));
+    }
+
+    return count;
+}
+
+ssize_t pace_write(int fd, const char *buffer, size_t count)
+{
+    uint64_t byte_interval = (uint64_t) option.output_delay * 1000;
+    uint64_t line_delay = (uint64_t) option.output_line_delay * 1000;
+    size_t bytes_written = 0;
+    uint64_t now;
+
+    if (option.output_rate)
+    {
+        byte_interval = MAX(byte_interval, NSEC_PER_SEC / option.output_rate);
+    }
+
+    now = pace_now();
+    if (next_deadline < now)
+    {
+        next_deadline = now;
+    }
+
+    while (bytes_written < count)
+    {
+        const char *segment = buffer + bytes_written;
+        size_t length = pace_segment(segment, count - bytes_written);
+
+        pace_sleep_until(next_deadline);
+
+        if (pace_write_all(fd, segment, length) < 0)
+        {
+            break;
+        }
+        bytes_written += length;
+        next_deadline += length * byte_interval;
+
+        if (line_delay && (segment[length - 1] == '\n'))
+        {
+            // Delay from when the line has actually left the device
+            tcdrain(fd);
+            now = pace_now();
+            if (next_deadline < now)
+            {
+                next_deadline = now;
+            }
+            next_deadline += line_delay;
+        }
+    }
+
+    return bytes_written;
+}
@@ -19,17 +19,56 @@
  * 02110-1301, USA.
  */
 
+#include "config.h"
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE___FPENDING
+#include <stdio_ext.h>
+#endif
 #include "options.h"
+#include "pace.h"
 #include "print.h"
 
+#define HEX_DUMP_COLUMNS 16
+
+/*
+ * All output to stdout (received data, tio messages) is collected in one
+ * buffer, so that it stays in order, and written out at most once per event
+ * loop iteration. Output following a quiet period is written right away, so
+ * sporadic output (echo of typed keys etc.) is not delayed. Output that
+ * keeps coming is batched until it has been idle for a short while, or at
+ * the latest some time after it was first buffered. Terminals get shorter
+ * delays than pipes and files.
+ */
+#define STDOUT_BUFFER_SIZE (64*1024)
+#define FLUSH_IDLE_TERMINAL_NS 500000ULL
+#define FLUSH_MAX_TERMINAL_NS 5000000ULL
+#define FLUSH_IDLE_PIPE_NS 2000000ULL
+#define FLUSH_MAX_PIPE_NS 50000000ULL
+
 bool print_tainted = false;
 char ansi_format[30];
 
+static const char hex_digits[] = "0123456789abcdef";
+
+static char stdout_buffer[STDOUT_BUFFER_SIZE];
+static uint64_t flush_idle_ns = FLUSH_IDLE_TERMINAL_NS;
+static uint64_t flush_max_ns = FLUSH_MAX_TERMINAL_NS;
+static uint64_t flush_pending_since = 0;
+#ifdef HAVE___FPENDING
+static uint64_t flush_idle_deadline = 0;
+static uint64_t flush_last = 0;
+#endif
+
+static unsigned long hex_dump_offset = 0;
+static unsigned int hex_dump_column = 0;
+static char hex_dump_ascii[HEX_DUMP_COLUMNS];
+
 void print_hex(char c)
 {
-  printf("%02x ", (unsigned char) c);
+  print_hex_buffer(&c, 1);
 }
 
 void print_normal(char c)
@@ -37,6 +76,175 @@ void print_normal(char c)
   putchar(c);
 }
 
+void print_hex_buffer(const char *buffer, size_t count)
+{
+  char hex_buffer[BUFSIZ*3];
+
+  while (count > 0)
+  {
+    size_t length = MIN(count, (size_t) BUFSIZ);
+    char *p = hex_buffer;
+
+    // Expand each byte into "xx " using nibble lookup
+    for (size_t i=0; i<length; i++)
+    {
+      unsigned char c = buffer[i];
+      *p++ = hex_digits[c >> 4];
+      *p++ = hex_digits[c & 0x0F];
+      *p++ = ' ';
+    }
+
+    fwrite(hex_buffer, 1, p - hex_buffer, stdout);
+
+    buffer += length;
+    count -= length;
+  }
+}
+
+void print_hex_dump_buffer(const char *buffer, size_t count)
+{
+  // Room for hex and ASCII columns plus row offsets and line endings
+  char dump_buffer[BUFSIZ*8];
+
+  while (count > 0)
+  {
+    size_t length = MIN(count, (size_t) BUFSIZ);
+    char *p = dump_buffer;
+
+    for (size_t i=0; i<length; i++)
+    {
+      unsigned char c = buffer[i];
+
+      // Start of row: print offset ("xxxxxxxx: ")
+      if (hex_dump_column == 0)
+      {
+        for (int shift=28; shift>=0; shift-=4)
+        {
+          *p++ = hex_digits[(hex_dump_offset >> shift) & 0x0F];
+        }
+        *p++ = ':';
+        *p++ = ' ';
+      }
+
+      *p++ = hex_digits[c >> 4];
+      *p++ = hex_digits[c & 0x0F];
+      *p++ = ' ';
+
+      hex_dump_ascii[hex_dump_column++] = ((c >= 0x20) && (c <= 0x7E)) ? c : '.';
+      hex_dump_offset++;
+
+      // End of row: print ASCII column
+      if (hex_dump_column == HEX_DUMP_COLUMNS)
+      {
+        *p++ = ' ';
+        memcpy(p, hex_dump_ascii, HEX_DUMP_COLUMNS);
+        p += HEX_DUMP_COLUMNS;
+        *p++ = '\r';
+        *p++ = '\n';
+        hex_dump_column = 0;
+      }
+    }
+
+    fwrite(dump_buffer, 1, p - dump_buffer, stdout);
+
+    buffer += length;
+    count -= length;
+  }
+}
+
+void print_normal_buffer(const char *buffer, size_t count)
+{
+  fwrite(buffer, 1, count, stdout);
+}
+
+void print_stdout_configure(bool terminal)
+{
+  setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+
+  flush_idle_ns = terminal ? FLUSH_IDLE_TERMINAL_NS : FLUSH_IDLE_PIPE_NS;
+  flush_max_ns = terminal ? FLUSH_MAX_TERMINAL_NS : FLUSH_MAX_PIPE_NS;
+}
+
+void print_flush(void)
+{
+  fflush(stdout);
+  flush_pending_since = 0;
+#ifdef HAVE___FPENDING
+  flush_last = pace_now();
+#endif
+}
+
+#ifdef HAVE___FPENDING
+
+// Called once per event loop iteration, flush when output is due
+void print_flush_check(bool active)
+{
+  uint64_t now;
+
+  if ((flush_pending_since == 0) && (__fpending(stdout) == 0))
+  {
+    return;
+  }
+
+  now = pace_now();
+
+  if (flush_pending_since == 0)
+  {
+    // First output after idle time goes out right away, a burst is batched
+    if (now - flush_last >= flush_idle_ns)
+    {
+      print_flush();
+      return;
+    }
+    flush_pending_since = now;
+  }
+
+  if (active)
+  {
+    // Output is still coming, restart idle timer
+    flush_idle_deadline = now + flush_idle_ns;
+  }
+
+  if ((now >= flush_idle_deadline) || (now - flush_pending_since >= flush_max_ns))
+  {
+    print_flush();
+  }
+}
+
+// Time until buffered output is due (ms, -1 for none)
+int print_flush_timeout(void)
+{
+  uint64_t now, deadline;
+
+  if (flush_pending_since == 0)
+  {
+    // Output from outside event loop is due right away
+    return (__fpending(stdout) > 0) ? 0 : -1;
+  }
+
+  now = pace_now();
+  deadline = MIN(flush_idle_deadline, flush_pending_since + flush_max_ns);
+
+  return (deadline <= now) ? 0 : (int) ((deadline - now + 999999) / 1000000);
+}
+
+#else
+
+// Without a way to tell if output is pending, write it once per iteration
+void print_flush_check(bool active)
+{
+  (void) active;
+
+  print_flush();
+}
+
+int print_flush_timeout(void)
+{
+  return -1;
+}
+
+#endif
+
 void print_init_ansi_formatting()
 {
   // Set bold text with user defined ANSI color
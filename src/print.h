@@ -22,6 +22,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/param.h>
 #include "misc.h"
 #include "error.h"
 #include "options.h"
@@ -41,6 +43,7 @@ extern char ansi_format[];
 
 #define ansi_error_printf(format, args...) \
 { \
+  fflush(stdout); \
   if (option.color < 0) \
     fprintf (stdout, "\r" format "\r\n", ## args); \
   else \
@@ -100,4 +103,11 @@ extern char ansi_format[];
 
 void print_hex(char c);
 void print_normal(char c);
+void print_hex_buffer(const char *buffer, size_t count);
+void print_normal_buffer(const char *buffer, size_t count);
+void print_hex_dump_buffer(const char *buffer, size_t count);
 void print_init_ansi_formatting(void);
+void print_stdout_configure(bool terminal);
+void print_flush(void);
+void print_flush_check(bool active);
+int print_flush_timeout(void);
@@ -0,0 +1,86 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+/*
+ * Startup profiling
+ *
+ * Startup and connect are divided into phases by marks, each mark ends a
+ * phase begun by the previous one. Phases are always timed, it is cheap,
+ * as whether to report is only known once options are parsed. A mark
+ * without phase name starts timing anew, eg. after waiting for a device.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "options.h"
+#include "print.h"
+#include "pace.h"
+#include "profile.h"
+
+#define PROFILE_PHASES_MAX 32
+
+struct profile_phase_t
+{
+    const char *name;
+    uint64_t duration;
+};
+
+static struct profile_phase_t phases[PROFILE_PHASES_MAX];
+static int phases_count = 0;
+static uint64_t last_mark = 0;
+static bool reported = false;
+
+void profile_mark(const char *phase)
+{
+    uint64_t now = pace_now();
+
+    if ((phase != NULL) && (last_mark != 0) && (phases_count < PROFILE_PHASES_MAX))
+    {
+        phases[phases_count].name = phase;
+        phases[phases_count].duration = now - last_mark;
+        phases_count++;
+    }
+
+    last_mark = now;
+}
+
+/* Print phases timed since previous report */
+void profile_report(void)
+{
+    uint64_t total = 0;
+
+    if (option.profile_startup)
+    {
+        tio_printf("%s profile:", reported ? "Reconnect" : "Startup");
+        for (int i = 0; i < phases_count; i++)
+        {
+            tio_printf(" %-22s %8.3f ms", phases[i].name, phases[i].duration / 1e6);
+            total += phases[i].duration;
+        }
+        tio_printf(" %-22s %8.3f ms", "Total", total / 1e6);
+    }
+
+    phases_count = 0;
+    reported = true;
+}
@@ -0,0 +1,287 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Receive reader thread
+ *
+ * A dedicated thread drains the tty device into a ring buffer so that slow
+ * output stages (terminal, log, sockets) do not stall device reads. The
+ * reader thread is the only producer and the event loop the only consumer
+ * of the ring, so positions are shared lock-free as with the asynchronous
+ * log writer. The event loop is woken through a pipe whenever new data is
+ * available. When the ring is full the reader stops reading and the device
+ * has to buffer on its own; such stalls and the highest fill level seen are
+ * counted so that possible data loss can be traced back to the consumers.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include "print.h"
+#include "error.h"
+#include "signals.h"
+#include "reader.h"
+
+#define READER_WAKEUP_MS 100
+
+struct reader_t
+{
+    int fd;
+    char *ring;
+    size_t ring_size;
+    size_t ring_head; // Consumer (event loop) position
+    size_t ring_tail; // Producer (reader thread) position
+    size_t high_water;
+    unsigned long full_count;
+    bool failed;
+    bool notify_pending;
+    bool stop;
+    int notify_pipe[2];
+    int stop_pipe[2];
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void reader_notify(struct reader_t *reader)
+{
+    char c = 0;
+
+    // Only one wakeup needs to be pending at a time
+    if (!__atomic_exchange_n(&reader->notify_pending, true, __ATOMIC_ACQ_REL))
+    {
+        write(reader->notify_pipe[1], &c, 1);
+    }
+}
+
+static void reader_wait_for_space(struct reader_t *reader, size_t tail)
+{
+    struct timespec timeout;
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += READER_WAKEUP_MS * 1000000L;
+    timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+    timeout.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&reader->mutex);
+    if ((tail - __atomic_load_n(&reader->ring_head, __ATOMIC_ACQUIRE) == reader->ring_size) &&
+        !__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE))
+    {
+        pthread_cond_timedwait(&reader->cond, &reader->mutex, &timeout);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+static void *reader_thread(void *arg)
+{
+    struct reader_t *reader = arg;
+    struct pollfd pfds[2] =
+    {
+        { .fd = reader->fd, .events = POLLIN },
+        { .fd = reader->stop_pipe[0], .events = POLLIN },
+    };
+
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE))
+    {
+        size_t head = __atomic_load_n(&reader->ring_head, __ATOMIC_ACQUIRE);
+        size_t tail = reader->ring_tail;
+        size_t space = reader->ring_size - (tail - head);
+        size_t start = tail % reader->ring_size;
+        ssize_t status;
+
+        if (space == 0)
+        {
+            // Consumers are behind, leave further data to the device
+            __atomic_store_n(&reader->full_count, reader->full_count + 1, __ATOMIC_RELAXED);
+            while ((tail - __atomic_load_n(&reader->ring_head, __ATOMIC_ACQUIRE) == reader->ring_size) &&
+                   !__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE))
+            {
+                reader_wait_for_space(reader, tail);
+            }
+            continue;
+        }
+
+        if (poll(pfds, 2, -1) < 0)
+        {
+            continue;
+        }
+        if (pfds[1].revents)
+        {
+            break;
+        }
+
+        status = read(reader->fd, reader->ring + start, MIN(space, reader->ring_size - start));
+        if (status <= 0)
+        {
+            if ((status < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            {
+                continue;
+            }
+            // Error reading - device is likely unplugged
+            __atomic_store_n(&reader->failed, true, __ATOMIC_RELEASE);
+            reader_notify(reader);
+            break;
+        }
+
+        __atomic_store_n(&reader->ring_tail, tail + status, __ATOMIC_RELEASE);
+
+        if (tail + status - head > reader->high_water)
+        {
+            __atomic_store_n(&reader->high_water, tail + status - head, __ATOMIC_RELAXED);
+        }
+
+        reader_notify(reader);
+    }
+
+    return NULL;
+}
+
+struct reader_t *reader_start(int fd, size_t size)
+{
+    struct reader_t *reader;
+
+    reader = calloc(1, sizeof(struct reader_t));
+    if (reader == NULL)
+    {
+        error_printf("Insufficient memory allocation for receive buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    reader->fd = fd;
+    reader->ring_size = MAX(size, BUFSIZ);
+    reader->ring = malloc(reader->ring_size);
+    if (reader->ring == NULL)
+    {
+        error_printf("Insufficient memory allocation for receive buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((pipe(reader->notify_pipe) < 0) || (pipe(reader->stop_pipe) < 0))
+    {
+        error_printf("Could not create receive reader pipe (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fcntl(reader->notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(reader->notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&reader->mutex, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+
+    if (signal_thread_create(&reader->thread, reader_thread, reader) != 0)
+    {
+        error_printf("Could not create receive reader thread");
+        exit(EXIT_FAILURE);
+    }
+
+    return reader;
+}
+
+void reader_stop(struct reader_t *reader)
+{
+    char c = 0;
+
+    // Wake reader thread whether it waits for data or space
+    pthread_mutex_lock(&reader->mutex);
+    __atomic_store_n(&reader->stop, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&reader->cond);
+    pthread_mutex_unlock(&reader->mutex);
+    write(reader->stop_pipe[1], &c, 1);
+
+    pthread_join(reader->thread, NULL);
+
+    close(reader->notify_pipe[0]);
+    close(reader->notify_pipe[1]);
+    close(reader->stop_pipe[0]);
+    close(reader->stop_pipe[1]);
+    free(reader->ring);
+    free(reader);
+}
+
+int reader_event_fd(struct reader_t *reader)
+{
+    return reader->notify_pipe[0];
+}
+
+pthread_t reader_thread_id(struct reader_t *reader)
+{
+    return reader->thread;
+}
+
+/* Acknowledge wakeup, must be done before consuming what is available */
+void reader_acknowledge(struct reader_t *reader)
+{
+    char buffer[64];
+
+    while (read(reader->notify_pipe[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+    __atomic_store_n(&reader->notify_pending, false, __ATOMIC_RELEASE);
+}
+
+/* Get next contiguous span of received data */
+size_t reader_peek(struct reader_t *reader, const char **buffer)
+{
+    size_t tail = __atomic_load_n(&reader->ring_tail, __ATOMIC_ACQUIRE);
+    size_t head = reader->ring_head;
+    size_t start = head % reader->ring_size;
+
+    *buffer = reader->ring + start;
+
+    return MIN(tail - head, reader->ring_size - start);
+}
+
+void reader_consume(struct reader_t *reader, size_t count)
+{
+    __atomic_store_n(&reader->ring_head, reader->ring_head + count, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&reader->mutex);
+    pthread_cond_signal(&reader->cond);
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+bool reader_failed(struct reader_t *reader)
+{
+    return __atomic_load_n(&reader->failed, __ATOMIC_ACQUIRE);
+}
+
+size_t reader_size(struct reader_t *reader)
+{
+    return reader->ring_size;
+}
+
+size_t reader_high_water(struct reader_t *reader)
+{
+    return __atomic_load_n(&reader->high_water, __ATOMIC_RELAXED);
+}
+
+unsigned long reader_full_count(struct reader_t *reader)
+{
+    return __atomic_load_n(&reader->full_count, __ATOMIC_RELAXED);
+}
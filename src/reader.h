@@ -0,0 +1,40 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct reader_t;
+
+struct reader_t *reader_start(int fd, size_t size);
+void reader_stop(struct reader_t *reader);
+int reader_event_fd(struct reader_t *reader);
+pthread_t reader_thread_id(struct reader_t *reader);
+void reader_acknowledge(struct reader_t *reader);
+size_t reader_peek(struct reader_t *reader, const char **buffer);
+void reader_consume(struct reader_t *reader, size_t count);
+bool reader_failed(struct reader_t *reader);
+size_t reader_size(struct reader_t *reader);
+size_t reader_high_water(struct reader_t *reader);
+unsigned long reader_full_count(struct reader_t *reader);
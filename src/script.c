@@ -0,0 +1,436 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+/*
+ * Scripted sessions
+ *
+ * A script is a list of commands, one per line:
+ *
+ *   send <string>          Send string, with escapes as for triggers
+ *   expect <string>        Wait until string is received
+ *   timeout <ms>           Fail following expects after ms (0 waits forever)
+ *   sleep <ms>             Wait ms
+ *   set DTR|RTS high|low   Set modem line
+ *   break                  Send break
+ *   exit [<status>]        Exit tio
+ *
+ * The interpreter runs inside the event loop: script_step() hands the next
+ * command to perform on the device to the caller until the script has to
+ * wait, received data is fed to script_receive() which matches the string
+ * expected incrementally (Knuth-Morris-Pratt), so no data is rescanned and
+ * matches spanning reads are found. Data received while not expecting is
+ * kept, within limits, for the next expect to match.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include "misc.h"
+#include "print.h"
+#include "error.h"
+#include "script.h"
+
+#define SCRIPT_HISTORY_SIZE 4096
+
+enum script_state_t
+{
+    SCRIPT_RUNNING,
+    SCRIPT_EXPECTING,
+    SCRIPT_SLEEPING,
+    SCRIPT_DONE,
+};
+
+struct script_t
+{
+    const char *filename;
+    struct script_command_t *commands;
+    int commands_count;
+    int next;
+    enum script_state_t state;
+    uint64_t deadline;
+    long timeout;
+    size_t matched;
+    char history[SCRIPT_HISTORY_SIZE];
+    size_t history_count;
+};
+
+static void script_parse_error(struct script_t *script, int line_number, const char *message, const char *text)
+{
+    printf("Error: %s line %d: %s %s\n", script->filename, line_number, message, text);
+    exit(EXIT_FAILURE);
+}
+
+static long script_parse_number(struct script_t *script, int line_number, const char *text)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(text, &end, 10);
+    if ((errno != 0) || (end == text) || (*end != 0) || (value < 0))
+    {
+        script_parse_error(script, line_number, "Invalid number", text);
+    }
+
+    return value;
+}
+
+/* Failure function of expected string, length of longest proper prefix
+ * which is also a suffix of the first i + 1 characters */
+static size_t *script_prefix_table(const char *text, size_t length)
+{
+    size_t *prefix = malloc(length * sizeof(size_t));
+    size_t k = 0;
+
+    if (prefix == NULL)
+    {
+        printf("Error: Insufficient memory allocation\n");
+        exit(EXIT_FAILURE);
+    }
+
+    prefix[0] = 0;
+    for (size_t i = 1; i < length; i++)
+    {
+        while ((k > 0) && (text[i] != text[k]))
+        {
+            k = prefix[k - 1];
+        }
+        if (text[i] == text[k])
+        {
+            k++;
+        }
+        prefix[i] = k;
+    }
+
+    return prefix;
+}
+
+static void script_parse_line(struct script_t *script, int line_number, char *line)
+{
+    struct script_command_t command = {};
+    struct script_command_t *p;
+    char *argument, *end;
+
+    while (isspace((unsigned char) *line))
+    {
+        line++;
+    }
+    end = line + strlen(line);
+    while ((end > line) && isspace((unsigned char) end[-1]))
+    {
+        *--end = 0;
+    }
+    if ((*line == 0) || (*line == '#'))
+    {
+        return;
+    }
+
+    argument = line + strcspn(line, " \t");
+    if (*argument != 0)
+    {
+        *argument++ = 0;
+        while (isspace((unsigned char) *argument))
+        {
+            argument++;
+        }
+    }
+
+    command.line_number = line_number;
+
+    if (strcmp(line, "send") == 0)
+    {
+        command.type = SCRIPT_SEND;
+        command.text = string_unescape(argument, &command.length);
+    }
+    else if (strcmp(line, "expect") == 0)
+    {
+        command.type = SCRIPT_EXPECT;
+        command.text = string_unescape(argument, &command.length);
+        if (command.length == 0)
+        {
+            script_parse_error(script, line_number, "Missing string to", "expect");
+        }
+        command.prefix = script_prefix_table(command.text, command.length);
+    }
+    else if (strcmp(line, "timeout") == 0)
+    {
+        command.type = SCRIPT_TIMEOUT;
+        command.value = script_parse_number(script, line_number, argument);
+    }
+    else if (strcmp(line, "sleep") == 0)
+    {
+        command.type = SCRIPT_SLEEP;
+        command.value = script_parse_number(script, line_number, argument);
+    }
+    else if (strcmp(line, "set") == 0)
+    {
+        char *level = argument + strcspn(argument, " \t");
+
+        if (*level != 0)
+        {
+            *level++ = 0;
+            while (isspace((unsigned char) *level))
+            {
+                level++;
+            }
+        }
+
+        command.type = SCRIPT_SET;
+        if (strcasecmp(argument, "DTR") == 0)
+        {
+            command.line = "DTR";
+            command.line_mask = TIOCM_DTR;
+        }
+        else if (strcasecmp(argument, "RTS") == 0)
+        {
+            command.line = "RTS";
+            command.line_mask = TIOCM_RTS;
+        }
+        else
+        {
+            script_parse_error(script, line_number, "Invalid line", argument);
+        }
+
+        if (strcasecmp(level, "high") == 0)
+        {
+            command.value = 1;
+        }
+        else if (strcasecmp(level, "low") == 0)
+        {
+            command.value = 0;
+        }
+        else
+        {
+            script_parse_error(script, line_number, "Invalid line state", level);
+        }
+    }
+    else if (strcmp(line, "break") == 0)
+    {
+        command.type = SCRIPT_BREAK;
+    }
+    else if (strcmp(line, "exit") == 0)
+    {
+        command.type = SCRIPT_EXIT;
+        command.value = (*argument != 0) ? script_parse_number(script, line_number, argument) : 0;
+    }
+    else
+    {
+        script_parse_error(script, line_number, "Unknown command", line);
+    }
+
+    p = realloc(script->commands, (script->commands_count + 1) * sizeof(struct script_command_t));
+    if (p == NULL)
+    {
+        printf("Error: Insufficient memory allocation\n");
+        exit(EXIT_FAILURE);
+    }
+    script->commands = p;
+    script->commands[script->commands_count++] = command;
+}
+
+struct script_t *script_load(const char *filename)
+{
+    struct script_t *script;
+    char *line = NULL;
+    size_t size = 0;
+    int line_number = 0;
+    FILE *file;
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("Error: Could not open script file %s (%s)\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    script = calloc(1, sizeof(struct script_t));
+    if (script == NULL)
+    {
+        printf("Error: Insufficient memory allocation\n");
+        exit(EXIT_FAILURE);
+    }
+    script->filename = filename;
+    script->state = SCRIPT_RUNNING;
+
+    while (getline(&line, &size, file) >= 0)
+    {
+        script_parse_line(script, ++line_number, line);
+    }
+
+    free(line);
+    fclose(file);
+
+    return script;
+}
+
+/* Match data against string expected, returns number of bytes consumed
+ * which is up to and including the match if found */
+static size_t script_match(struct script_t *script, const char *buffer, size_t count)
+{
+    const struct script_command_t *command = &script->commands[script->next - 1];
+    size_t matched = script->matched;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        while ((matched > 0) && (buffer[i] != command->text[matched]))
+        {
+            matched = command->prefix[matched - 1];
+        }
+        if (buffer[i] == command->text[matched])
+        {
+            matched++;
+        }
+        if (matched == command->length)
+        {
+            script->state = SCRIPT_RUNNING;
+            return i + 1;
+        }
+    }
+
+    script->matched = matched;
+    return count;
+}
+
+/* Keep most recent data received while not expecting */
+static void script_history_add(struct script_t *script, const char *buffer, size_t count)
+{
+    if (count >= SCRIPT_HISTORY_SIZE)
+    {
+        memcpy(script->history, buffer + count - SCRIPT_HISTORY_SIZE, SCRIPT_HISTORY_SIZE);
+        script->history_count = SCRIPT_HISTORY_SIZE;
+        return;
+    }
+
+    if (script->history_count + count > SCRIPT_HISTORY_SIZE)
+    {
+        size_t drop = script->history_count + count - SCRIPT_HISTORY_SIZE;
+
+        memmove(script->history, script->history + drop, script->history_count - drop);
+        script->history_count -= drop;
+    }
+
+    memcpy(script->history + script->history_count, buffer, count);
+    script->history_count += count;
+}
+
+/* Next command for the caller to perform, NULL while waiting or done */
+const struct script_command_t *script_step(struct script_t *script, uint64_t now)
+{
+    if (script == NULL)
+    {
+        return NULL;
+    }
+
+    if (script->state == SCRIPT_EXPECTING)
+    {
+        if ((script->deadline == 0) || (now < script->deadline))
+        {
+            return NULL;
+        }
+        error_printf("Script timeout at %s line %d waiting for %s", script->filename,
+                     script->commands[script->next - 1].line_number, script->commands[script->next - 1].text);
+        exit(EXIT_FAILURE);
+    }
+
+    if (script->state == SCRIPT_SLEEPING)
+    {
+        if (now < script->deadline)
+        {
+            return NULL;
+        }
+        script->state = SCRIPT_RUNNING;
+    }
+
+    while ((script->state == SCRIPT_RUNNING) && (script->next < script->commands_count))
+    {
+        const struct script_command_t *command = &script->commands[script->next++];
+        size_t used;
+
+        switch (command->type)
+        {
+            case SCRIPT_EXPECT:
+                script->state = SCRIPT_EXPECTING;
+                script->matched = 0;
+                script->deadline = (script->timeout > 0) ? now + (uint64_t) script->timeout * 1000000 : 0;
+
+                /* String may have been received already */
+                used = script_match(script, script->history, script->history_count);
+                memmove(script->history, script->history + used, script->history_count - used);
+                script->history_count -= used;
+                break;
+
+            case SCRIPT_TIMEOUT:
+                script->timeout = command->value;
+                break;
+
+            case SCRIPT_SLEEP:
+                script->state = SCRIPT_SLEEPING;
+                script->deadline = now + (uint64_t) command->value * 1000000;
+                return NULL;
+
+            default:
+                return command;
+        }
+    }
+
+    if (script->state == SCRIPT_RUNNING)
+    {
+        script->state = SCRIPT_DONE;
+    }
+
+    return NULL;
+}
+
+/* Feed received data, returns number of bytes consumed which is up to and
+ * including the match when the string expected is found */
+size_t script_receive(struct script_t *script, const char *buffer, size_t count)
+{
+    if ((script == NULL) || (script->state == SCRIPT_DONE))
+    {
+        return count;
+    }
+
+    if (script->state == SCRIPT_EXPECTING)
+    {
+        return script_match(script, buffer, count);
+    }
+
+    script_history_add(script, buffer, count);
+    return count;
+}
+
+/* Time until script needs to run again (ms, -1 for none) */
+int script_timeout(struct script_t *script, uint64_t now)
+{
+    if ((script == NULL) ||
+        ((script->state != SCRIPT_SLEEPING) && ((script->state != SCRIPT_EXPECTING) || (script->deadline == 0))))
+    {
+        return -1;
+    }
+
+    return (script->deadline <= now) ? 0 : (int) ((script->deadline - now + 999999) / 1000000);
+}
@@ -0,0 +1,57 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum script_command_type_t
+{
+    SCRIPT_SEND,
+    SCRIPT_EXPECT,
+    SCRIPT_TIMEOUT,
+    SCRIPT_SLEEP,
+    SCRIPT_SET,
+    SCRIPT_BREAK,
+    SCRIPT_EXIT,
+};
+
+struct script_command_t
+{
+    enum script_command_type_t type;
+    int line_number;
+    char *text;
+    size_t length;
+    size_t *prefix;
+    long value;
+    const char *line;
+    int line_mask;
+};
+
+struct script_t;
+
+struct script_t *script_load(const char *filename);
+const struct script_command_t *script_step(struct script_t *script, uint64_t now);
+size_t script_receive(struct script_t *script, const char *buffer, size_t count);
+int script_timeout(struct script_t *script, uint64_t now);
@@ -0,0 +1,332 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+/*
+ * Scrollback
+ *
+ * Received data is appended to a list of fixed size chunks. Full chunks
+ * are sealed, compressed if enabled, and the oldest chunks are dropped
+ * whenever the memory used by all chunks exceeds the configured size, so
+ * memory use stays bounded however long a session runs. Data is addressed
+ * by its offset in the stream of all data received.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "misc.h"
+#include "print.h"
+#include "error.h"
+#include "scrollback.h"
+
+#define SCROLLBACK_CHUNK_SIZE_MIN 4096
+#define SCROLLBACK_CHUNK_SIZE_MAX 65536
+
+struct scrollback_chunk_t
+{
+    struct scrollback_chunk_t *prev;
+    struct scrollback_chunk_t *next;
+    uint64_t offset;
+    size_t length;   // Bytes of data held
+    size_t stored;   // Bytes allocated for data, compressed size if compressed
+    bool compressed;
+    char data[];
+};
+
+static struct
+{
+    bool enabled;
+    bool compress;
+    size_t size;
+    size_t used;
+    size_t chunk_size;
+    struct scrollback_chunk_t *oldest;
+    struct scrollback_chunk_t *newest;
+    uint64_t end;
+    char *window;    // Chunk searched followed by start of next chunk
+    char *scratch;   // Decompressed chunk
+    const struct scrollback_chunk_t *scratch_chunk;
+} scrollback;
+
+static struct scrollback_chunk_t *scrollback_chunk_new(size_t stored)
+{
+    struct scrollback_chunk_t *chunk = malloc(sizeof(struct scrollback_chunk_t) + stored);
+
+    if (chunk == NULL)
+    {
+        error_printf("Insufficient memory allocation for scrollback");
+        exit(EXIT_FAILURE);
+    }
+    chunk->prev = NULL;
+    chunk->next = NULL;
+    chunk->offset = scrollback.end;
+    chunk->length = 0;
+    chunk->stored = stored;
+    chunk->compressed = false;
+    scrollback.used += sizeof(struct scrollback_chunk_t) + stored;
+
+    return chunk;
+}
+
+static void scrollback_chunk_free(struct scrollback_chunk_t *chunk)
+{
+    if (scrollback.scratch_chunk == chunk)
+    {
+        scrollback.scratch_chunk = NULL;
+    }
+    scrollback.used -= sizeof(struct scrollback_chunk_t) + chunk->stored;
+    free(chunk);
+}
+
+void scrollback_init(size_t size, bool compress)
+{
+    scrollback.enabled = true;
+    scrollback.size = size;
+    scrollback.chunk_size = MIN(MAX(size / 8, SCROLLBACK_CHUNK_SIZE_MIN), SCROLLBACK_CHUNK_SIZE_MAX);
+    scrollback.window = malloc(scrollback.chunk_size * 2);
+    scrollback.scratch = malloc(scrollback.chunk_size);
+    if ((scrollback.window == NULL) || (scrollback.scratch == NULL))
+    {
+        error_printf("Insufficient memory allocation for scrollback");
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef HAVE_ZLIB
+    scrollback.compress = compress;
+#else
+    if (compress)
+    {
+        printf("Error: Scrollback compression not supported\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+bool scrollback_enabled(void)
+{
+    return scrollback.enabled;
+}
+
+/* Replace full chunk with compressed copy, if it actually is smaller */
+static void scrollback_seal(struct scrollback_chunk_t *chunk)
+{
+#ifdef HAVE_ZLIB
+    uLongf length = compressBound(chunk->length);
+    struct scrollback_chunk_t *sealed;
+    char *buffer;
+
+    if (!scrollback.compress)
+    {
+        return;
+    }
+
+    buffer = malloc(length);
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    if ((compress2((Bytef *) buffer, &length, (Bytef *) chunk->data, chunk->length, Z_BEST_SPEED) == Z_OK) &&
+        (length < chunk->length))
+    {
+        sealed = scrollback_chunk_new(length);
+        sealed->offset = chunk->offset;
+        sealed->length = chunk->length;
+        sealed->compressed = true;
+        memcpy(sealed->data, buffer, length);
+
+        sealed->prev = chunk->prev;
+        if (sealed->prev != NULL)
+        {
+            sealed->prev->next = sealed;
+        }
+        else
+        {
+            scrollback.oldest = sealed;
+        }
+        scrollback.newest = sealed;
+        scrollback_chunk_free(chunk);
+    }
+
+    free(buffer);
+#else
+    UNUSED(chunk);
+#endif
+}
+
+void scrollback_append(const char *buffer, size_t count)
+{
+    while (count > 0)
+    {
+        struct scrollback_chunk_t *chunk = scrollback.newest;
+        size_t length;
+
+        if ((chunk == NULL) || (chunk->length == chunk->stored) || chunk->compressed)
+        {
+            if (chunk != NULL)
+            {
+                scrollback_seal(chunk);
+            }
+
+            chunk = scrollback_chunk_new(scrollback.chunk_size);
+            chunk->prev = scrollback.newest;
+            if (chunk->prev != NULL)
+            {
+                chunk->prev->next = chunk;
+            }
+            else
+            {
+                scrollback.oldest = chunk;
+            }
+            scrollback.newest = chunk;
+
+            /* Keep within memory limit, dropping oldest data */
+            while ((scrollback.used > scrollback.size) && (scrollback.oldest != chunk))
+            {
+                struct scrollback_chunk_t *oldest = scrollback.oldest;
+
+                scrollback.oldest = oldest->next;
+                scrollback.oldest->prev = NULL;
+                scrollback_chunk_free(oldest);
+            }
+        }
+
+        length = MIN(count, chunk->stored - chunk->length);
+        memcpy(chunk->data + chunk->length, buffer, length);
+        chunk->length += length;
+        scrollback.end += length;
+        buffer += length;
+        count -= length;
+    }
+}
+
+uint64_t scrollback_start(void)
+{
+    return (scrollback.oldest != NULL) ? scrollback.oldest->offset : scrollback.end;
+}
+
+uint64_t scrollback_end(void)
+{
+    return scrollback.end;
+}
+
+/* Data of chunk, decompressed to scratch buffer if needed */
+static const char *scrollback_chunk_data(const struct scrollback_chunk_t *chunk)
+{
+#ifdef HAVE_ZLIB
+    if (chunk->compressed)
+    {
+        uLongf length = scrollback.chunk_size;
+
+        if (scrollback.scratch_chunk != chunk)
+        {
+            uncompress((Bytef *) scrollback.scratch, &length, (const Bytef *) chunk->data, chunk->stored);
+            scrollback.scratch_chunk = chunk;
+        }
+        return scrollback.scratch;
+    }
+#endif
+
+    return chunk->data;
+}
+
+/* Copy data from offset on, returns number of bytes copied */
+size_t scrollback_read(uint64_t offset, char *buffer, size_t count)
+{
+    const struct scrollback_chunk_t *chunk = scrollback.newest;
+    size_t copied = 0;
+
+    /* Find chunk holding offset, recent data is looked up most */
+    while ((chunk != NULL) && (chunk->offset > offset))
+    {
+        chunk = chunk->prev;
+    }
+
+    while ((chunk != NULL) && (copied < count))
+    {
+        size_t start = offset - chunk->offset;
+
+        if (start < chunk->length)
+        {
+            size_t length = MIN(count - copied, chunk->length - start);
+
+            memcpy(buffer + copied, scrollback_chunk_data(chunk) + start, length);
+            copied += length;
+            offset += length;
+        }
+        chunk = chunk->next;
+    }
+
+    return copied;
+}
+
+/* Find last occurrence of pattern starting before offset, newest first */
+bool scrollback_search(const char *pattern, size_t length, uint64_t before, uint64_t *match)
+{
+    if ((length == 0) || (length > scrollback.chunk_size))
+    {
+        return false;
+    }
+
+    for (const struct scrollback_chunk_t *chunk = scrollback.newest; chunk != NULL; chunk = chunk->prev)
+    {
+        const char *data, *found, *last = NULL;
+        size_t window = chunk->length;
+
+        if (chunk->offset >= before)
+        {
+            continue;
+        }
+
+        /* Extend chunk by start of next one to find matches crossing chunks */
+        data = scrollback_chunk_data(chunk);
+        if (chunk->next != NULL)
+        {
+            memcpy(scrollback.window, data, chunk->length);
+            window += scrollback_read(chunk->next->offset, scrollback.window + chunk->length, length - 1);
+            data = scrollback.window;
+        }
+
+        for (const char *p = data; (found = memmem(p, window - (p - data), pattern, length)) != NULL; p = found + 1)
+        {
+            if (chunk->offset + (found - data) >= before)
+            {
+                break;
+            }
+            last = found;
+        }
+
+        if (last != NULL)
+        {
+            *match = chunk->offset + (last - data);
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -24,6 +24,7 @@
 #undef termios
 #include <asm-generic/ioctls.h>
 #include <asm-generic/termbits.h>
+#include <stdlib.h>
 
 int setspeed2(int fd, int baudrate)
 {
@@ -42,3 +43,23 @@ int setspeed2(int fd, int baudrate)
 
     return status;
 }
+
+/* Read back settings of device, including baudrate set above */
+void *getattr2(int fd)
+{
+    struct termios2 *tio = malloc(sizeof(struct termios2));
+
+    if ((tio != NULL) && (ioctl(fd, TCGETS2, tio) != 0))
+    {
+        free(tio);
+        tio = NULL;
+    }
+
+    return tio;
+}
+
+/* Apply settings read back by getattr2() in one call */
+int setattr2(int fd, const void *tio)
+{
+    return ioctl(fd, TCSETS2, tio);
+}
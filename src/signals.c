@@ -22,19 +22,63 @@
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
 #include "error.h"
 #include "print.h"
 #include "misc.h"
+#include "options.h"
+#include "signals.h"
+
+static volatile sig_atomic_t hangup_pending = false;
 
 static void signal_handler(int signum)
 {
     UNUSED(signum);
+
+    /* When logging, hangup requests reopening log files instead (logrotate) */
+    if (option.log)
+    {
+        hangup_pending = true;
+        return;
+    }
+
     tio_printf("Received hangup signal!");
     exit(EXIT_FAILURE);
 }
 
+/* Returns true once per hangup signal received while logging */
+bool signal_hangup_pending(void)
+{
+    if (hangup_pending)
+    {
+        hangup_pending = false;
+        return true;
+    }
+
+    return false;
+}
+
+/* Create worker thread with hangup signal blocked, so it is always delivered
+ * to the main thread and interrupts its wait for events */
+int signal_thread_create(pthread_t *thread, void *(*start_routine)(void *), void *arg)
+{
+    sigset_t set, old;
+    int status;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    status = pthread_create(thread, NULL, start_routine, arg);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return status;
+}
+
 void signal_handlers_install(void)
 {
     signal(SIGHUP, signal_handler);
@@ -21,4 +21,9 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <pthread.h>
+
 void signal_handlers_install();
+bool signal_hangup_pending(void);
+int signal_thread_create(pthread_t *thread, void *(*start_routine)(void *), void *arg);
@@ -20,8 +20,11 @@
  * 02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -29,29 +32,140 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 
+#include "config.h"
 #include "socket.h"
 #include "options.h"
 #include "print.h"
+#include "event.h"
+#include "splice.h"
 
-#define MAX_SOCKET_CLIENTS 16
 #define SOCKET_PORT_DEFAULT 3333
+#define SOCKET_CLIENT_BUFFER_SIZE (64*1024)
+#define SOCKET_MESSAGE_SIZE 64
+#define SOCKET_ENCODE_SIZE (16*1024)
+
+/* Telnet commands and options (RFC 854, 856, 858) */
+#define TELNET_SE   240
+#define TELNET_SB   250
+#define TELNET_WILL 251
+#define TELNET_WONT 252
+#define TELNET_DO   253
+#define TELNET_DONT 254
+#define TELNET_IAC  255
+
+#define TELNET_OPTION_BINARY   0
+#define TELNET_OPTION_SGA      3
+#define TELNET_OPTION_COM_PORT 44
+
+/* COM port option commands (RFC 2217), server replies add 100 */
+#define RFC2217_SIGNATURE           0
+#define RFC2217_SET_BAUDRATE        1
+#define RFC2217_SET_DATASIZE        2
+#define RFC2217_SET_PARITY          3
+#define RFC2217_SET_STOPSIZE        4
+#define RFC2217_SET_CONTROL         5
+#define RFC2217_NOTIFY_LINESTATE    6
+#define RFC2217_NOTIFY_MODEMSTATE   7
+#define RFC2217_FLOWCONTROL_SUSPEND 8
+#define RFC2217_FLOWCONTROL_RESUME  9
+#define RFC2217_SET_LINESTATE_MASK  10
+#define RFC2217_SET_MODEMSTATE_MASK 11
+#define RFC2217_PURGE_DATA          12
+#define RFC2217_SERVER_OFFSET       100
+
+/* Modem state and line state bits, shared by framed protocol */
+#define MODEMSTATE_CTS_DELTA 0x01
+#define MODEMSTATE_DSR_DELTA 0x02
+#define MODEMSTATE_RI_EDGE   0x04
+#define MODEMSTATE_CD_DELTA  0x08
+#define MODEMSTATE_CTS       0x10
+#define MODEMSTATE_DSR       0x20
+#define MODEMSTATE_RI        0x40
+#define MODEMSTATE_CD        0x80
+
+#define LINESTATE_OVERRUN 0x02
+#define LINESTATE_PARITY  0x04
+#define LINESTATE_FRAME   0x08
+#define LINESTATE_BREAK   0x10
+
+/* Framed protocol message types, each message is type, 16 bit length, payload */
+#define FRAME_DATA       0
+#define FRAME_CONTROL    1
+#define FRAME_MODEMSTATE 2
+#define FRAME_LINESTATE  3
 
-static int sockfd;
-static int clientfds[MAX_SOCKET_CLIENTS];
-static int socket_family = AF_UNSPEC;
-static int port_number = SOCKET_PORT_DEFAULT;
+#define FRAME_HEADER_SIZE  3
+#define FRAME_CONTROL_SIZE 5
 
-static const char *socket_filename(void)
+/* Position of protocol decoder within client input */
+enum socket_decode_t
+{
+    DECODE_DATA,
+    DECODE_CR,
+    DECODE_IAC,
+    DECODE_OPTION,
+    DECODE_SUBNEG,
+    DECODE_SUBNEG_IAC,
+    DECODE_FRAME_HEADER,
+    DECODE_FRAME_PAYLOAD,
+};
+
+/* Connected client with queue of output not yet accepted by its socket */
+struct socket_client_t
+{
+    int fd;
+    char *buffer;
+    size_t head;
+    size_t count;
+    bool suspended;
+    enum socket_decode_t state;
+    unsigned char command;
+    unsigned char message[SOCKET_MESSAGE_SIZE];
+    size_t message_count;
+    size_t frame_remaining;
+    unsigned char options_local;
+    unsigned char options_remote;
+    unsigned char modemstate_mask;
+    unsigned char linestate_mask;
+};
+
+/* Listening socket of one tty device with its connected clients */
+struct socket_t
+{
+    int sockfd;
+    int family;
+    int port_number;
+    char *filename;
+    struct socket_client_t *clients;
+    int clients_size;
+    bool input_enabled;
+    socket_control_handler_t control;
+    socket_input_handler_t input;
+    void *context;
+    unsigned char modemstate;
+    bool modemstate_known;
+    struct socket_t *next;
+};
+
+static struct socket_t *sockets = NULL;
+static char encode_buffer[SOCKET_ENCODE_SIZE * 2];
+
+static void socket_client_start(struct socket_t *sock, struct socket_client_t *client);
+
+static const char *socket_filename(const char *address)
 {
     /* skip 'unix:' */
-    return option.socket + 5;
+    return address + 5;
 }
 
-static int socket_inet_port(void)
+static int socket_inet_port(const char *address)
 {
     /* skip 'inet:' */
-    int port_number = atoi(option.socket + 5);
+    int port_number = atoi(address + 5);
     if (port_number == 0)
     {
         port_number = SOCKET_PORT_DEFAULT;
@@ -59,10 +173,10 @@ static int socket_inet_port(void)
     return port_number;
 }
 
-static int socket_inet6_port(void)
+static int socket_inet6_port(const char *address)
 {
     /* skip 'inet6:' */
-    int port_number = atoi(option.socket + 6);
+    int port_number = atoi(address + 6);
     if (port_number == 0)
     {
         port_number = SOCKET_PORT_DEFAULT;
@@ -70,80 +184,812 @@ static int socket_inet6_port(void)
     return port_number;
 }
 
+static void socket_client_close(struct socket_client_t *client)
+{
+    event_remove(client->fd);
+    close(client->fd);
+    client->fd = -1;
+    client->head = 0;
+    client->count = 0;
+}
+
+static void socket_client_add(struct socket_t *sock, int clientfd)
+{
+    struct socket_client_t *client = NULL;
+
+    /* clients write to us in blocks, but must never stall us when writing to them */
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+
+    /* reuse free slot or grow client table */
+    for (int i = 0; i != sock->clients_size; ++i)
+    {
+        if (sock->clients[i].fd == -1)
+        {
+            client = &sock->clients[i];
+            break;
+        }
+    }
+
+    if (client == NULL)
+    {
+        int size = (sock->clients_size == 0) ? 16 : sock->clients_size * 2;
+        struct socket_client_t *p = realloc(sock->clients, size * sizeof(struct socket_client_t));
+        if (p == NULL)
+        {
+            error_printf_silent("Insufficient memory allocation for socket client");
+            close(clientfd);
+            return;
+        }
+        memset(&p[sock->clients_size], 0, (size - sock->clients_size) * sizeof(struct socket_client_t));
+        for (int i = sock->clients_size; i != size; ++i)
+        {
+            p[i].fd = -1;
+        }
+        client = &p[sock->clients_size];
+        sock->clients = p;
+        sock->clients_size = size;
+    }
+
+    if (client->buffer == NULL)
+    {
+        client->buffer = malloc(SOCKET_CLIENT_BUFFER_SIZE);
+        if (client->buffer == NULL)
+        {
+            error_printf_silent("Insufficient memory allocation for socket client");
+            close(clientfd);
+            return;
+        }
+    }
+
+    client->fd = clientfd;
+    client->head = 0;
+    client->count = 0;
+
+    if (sock->input_enabled)
+    {
+        event_add(clientfd);
+    }
+
+    socket_client_start(sock, client);
+}
+
+/* Write as much of queued output as the socket accepts without blocking */
+static bool socket_client_flush(struct socket_client_t *client)
+{
+    while (client->count > 0)
+    {
+        size_t length = MIN(client->count, SOCKET_CLIENT_BUFFER_SIZE - client->head);
+        ssize_t status = write(client->fd, client->buffer + client->head, length);
+        if (status < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            {
+                break;
+            }
+            error_printf_silent("Failed to write to socket (%s)", strerror(errno));
+            socket_client_close(client);
+            return false;
+        }
+        client->head = (client->head + status) % SOCKET_CLIENT_BUFFER_SIZE;
+        client->count -= status;
+    }
+
+    if (client->count == 0)
+    {
+        client->head = 0;
+        event_remove_write(client->fd);
+    }
+    else
+    {
+        event_add_write(client->fd);
+    }
+
+    return true;
+}
+
+static void socket_client_queue(struct socket_client_t *client, const char *buffer, size_t count)
+{
+    size_t space = SOCKET_CLIENT_BUFFER_SIZE - client->count;
+
+    if (count > space)
+    {
+        switch (option.socket_policy)
+        {
+            case SOCKET_POLICY_DISCONNECT:
+                warning_printf("Disconnected slow socket client");
+                socket_client_close(client);
+                return;
+
+            case SOCKET_POLICY_BLOCK:
+                /* wait for client to catch up */
+                while ((client->fd != -1) && (count > SOCKET_CLIENT_BUFFER_SIZE - client->count))
+                {
+                    struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+                    poll(&pfd, 1, -1);
+                    if (!socket_client_flush(client))
+                    {
+                        return;
+                    }
+                }
+                break;
+
+            case SOCKET_POLICY_DROP:
+            default:
+                if (option.socket_protocol != SOCKET_PROTOCOL_RAW)
+                {
+                    /* queued output always ends on a message boundary so
+                     * drop the new message as a whole instead of splitting
+                     * frames or telnet sequences, unless it can never fit */
+                    if (count > SOCKET_CLIENT_BUFFER_SIZE)
+                    {
+                        warning_printf("Disconnected slow socket client");
+                        socket_client_close(client);
+                    }
+                    return;
+                }
+
+                /* drop oldest queued output to make room */
+                if (count > SOCKET_CLIENT_BUFFER_SIZE)
+                {
+                    buffer += count - SOCKET_CLIENT_BUFFER_SIZE;
+                    count = SOCKET_CLIENT_BUFFER_SIZE;
+                }
+                if (count > space)
+                {
+                    size_t drop = count - space;
+                    client->head = (client->head + drop) % SOCKET_CLIENT_BUFFER_SIZE;
+                    client->count -= drop;
+                }
+                break;
+        }
+    }
+
+    /* append to ring, wrapping around end of buffer */
+    while (count > 0)
+    {
+        size_t tail = (client->head + client->count) % SOCKET_CLIENT_BUFFER_SIZE;
+        size_t length = MIN(count, SOCKET_CLIENT_BUFFER_SIZE - tail);
+
+        memcpy(client->buffer + tail, buffer, length);
+        client->count += length;
+        buffer += length;
+        count -= length;
+    }
+}
+
+/* Send to one client, queueing what its socket does not accept right away */
+static void socket_client_write(struct socket_client_t *client, const char *buffer, size_t count)
+{
+    if (client->fd == -1)
+    {
+        return;
+    }
+
+    /* write directly unless output is already queued or suspended for this client */
+    if ((client->count == 0) && !client->suspended)
+    {
+        ssize_t status = write(client->fd, buffer, count);
+        if (status < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            {
+                error_printf_silent("Failed to write to socket (%s)", strerror(errno));
+                socket_client_close(client);
+                return;
+            }
+            status = 0;
+        }
+        if ((size_t) status == count)
+        {
+            return;
+        }
+        socket_client_queue(client, buffer + status, count - status);
+    }
+    else
+    {
+        socket_client_queue(client, buffer, count);
+    }
+
+    if ((client->fd != -1) && !client->suspended)
+    {
+        event_add_write(client->fd);
+    }
+}
+
+static void socket_broadcast(struct socket_t *sock, const char *buffer, size_t count)
+{
+    for (int i = 0; i != sock->clients_size; ++i)
+    {
+        socket_client_write(&sock->clients[i], buffer, count);
+    }
+}
+
+static int socket_control(struct socket_t *sock, const char *buffer, size_t *count, enum socket_control_t control, int value)
+{
+    /* Input received before the request goes out with the old settings */
+    if ((*count > 0) && (sock->input != NULL))
+    {
+        sock->input(sock->context, buffer, *count);
+        *count = 0;
+    }
+
+    if ((sock->control == NULL) || (control < SOCKET_CONTROL_BAUDRATE) || (control > SOCKET_CONTROL_PURGE))
+    {
+        return -1;
+    }
+
+    return sock->control(sock->context, control, value);
+}
+
+static void socket_telnet_send(struct socket_client_t *client, unsigned char command, unsigned char option)
+{
+    char message[3] = { (char) TELNET_IAC, (char) command, (char) option };
+
+    socket_client_write(client, message, sizeof(message));
+}
+
+/* Telnet options we agree to, as bit in the option state of a client */
+static unsigned char socket_telnet_option_bit(unsigned char option)
+{
+    switch (option)
+    {
+        case TELNET_OPTION_BINARY:
+            return 0x01;
+        case TELNET_OPTION_SGA:
+            return 0x02;
+        case TELNET_OPTION_COM_PORT:
+            return 0x04;
+        default:
+            return 0;
+    }
+}
+
+/* Answer option negotiation, acknowledging changes only to avoid loops */
+static void socket_telnet_negotiate(struct socket_client_t *client, unsigned char command, unsigned char option)
+{
+    unsigned char bit = socket_telnet_option_bit(option);
+
+    switch (command)
+    {
+        case TELNET_WILL:
+            if (bit == 0)
+            {
+                socket_telnet_send(client, TELNET_DONT, option);
+            }
+            else if (!(client->options_remote & bit))
+            {
+                client->options_remote |= bit;
+                socket_telnet_send(client, TELNET_DO, option);
+            }
+            break;
+
+        case TELNET_WONT:
+            if (client->options_remote & bit)
+            {
+                client->options_remote &= ~bit;
+                socket_telnet_send(client, TELNET_DONT, option);
+            }
+            break;
+
+        case TELNET_DO:
+            if (bit == 0)
+            {
+                socket_telnet_send(client, TELNET_WONT, option);
+            }
+            else if (!(client->options_local & bit))
+            {
+                client->options_local |= bit;
+                socket_telnet_send(client, TELNET_WILL, option);
+            }
+            break;
+
+        case TELNET_DONT:
+            if (client->options_local & bit)
+            {
+                client->options_local &= ~bit;
+                socket_telnet_send(client, TELNET_WONT, option);
+            }
+            break;
+    }
+}
+
+/* Send COM port option reply, escaping IAC bytes of its data */
+static void socket_rfc2217_reply(struct socket_client_t *client, unsigned char command, const unsigned char *data, size_t count)
+{
+    char message[4 + SOCKET_MESSAGE_SIZE * 2 + 2];
+    size_t length = 0;
+
+    message[length++] = (char) TELNET_IAC;
+    message[length++] = (char) TELNET_SB;
+    message[length++] = TELNET_OPTION_COM_PORT;
+    message[length++] = command + RFC2217_SERVER_OFFSET;
+    for (size_t i = 0; i < MIN(count, SOCKET_MESSAGE_SIZE); i++)
+    {
+        message[length++] = data[i];
+        if (data[i] == TELNET_IAC)
+        {
+            message[length++] = (char) TELNET_IAC;
+        }
+    }
+    message[length++] = (char) TELNET_IAC;
+    message[length++] = (char) TELNET_SE;
+
+    socket_client_write(client, message, length);
+}
+
+static void socket_rfc2217_reply_byte(struct socket_client_t *client, unsigned char command, unsigned char value)
+{
+    socket_rfc2217_reply(client, command, &value, 1);
+}
+
+/* Map SET-CONTROL request of query, on, off codes onto a line, replying with its state */
+static void socket_rfc2217_switch(struct socket_t *sock, struct socket_client_t *client, const char *buffer, size_t *count,
+                                  enum socket_control_t control, unsigned char code, unsigned char query)
+{
+    int value = socket_control(sock, buffer, count, control, (code == query) ? SOCKET_CONTROL_QUERY : (code == query + 1));
+
+    socket_rfc2217_reply_byte(client, RFC2217_SET_CONTROL, (value > 0) ? query + 1 : query + 2);
+}
+
+static void socket_rfc2217_set_control(struct socket_t *sock, struct socket_client_t *client,
+                                       const char *buffer, size_t *count, unsigned char code)
+{
+    unsigned char base = 0;
+    int value;
+
+    if ((code >= 4) && (code <= 6))
+    {
+        socket_rfc2217_switch(sock, client, buffer, count, SOCKET_CONTROL_BREAK, code, 4);
+        return;
+    }
+    if ((code >= 7) && (code <= 9))
+    {
+        socket_rfc2217_switch(sock, client, buffer, count, SOCKET_CONTROL_DTR, code, 7);
+        return;
+    }
+    if ((code >= 10) && (code <= 12))
+    {
+        socket_rfc2217_switch(sock, client, buffer, count, SOCKET_CONTROL_RTS, code, 10);
+        return;
+    }
+
+    if ((code >= 13) && (code <= 16))
+    {
+        /* Inbound flow control is the same setting as outbound */
+        base = 13;
+    }
+    else if (code > 3)
+    {
+        /* DCD, DTR and DSR flow control are not supported */
+        code = 0;
+    }
+
+    /* Query, none, xon/xoff, hardware */
+    value = socket_control(sock, buffer, count, SOCKET_CONTROL_FLOW, (code == base) ? SOCKET_CONTROL_QUERY : code - base - 1);
+    socket_rfc2217_reply_byte(client, RFC2217_SET_CONTROL, base + 1 + MAX(value, 0));
+}
+
+static void socket_rfc2217_command(struct socket_t *sock, struct socket_client_t *client,
+                                   const char *buffer, size_t *count)
+{
+    const char *signature = "tio " VERSION;
+    unsigned char command = client->message[1];
+    const unsigned char *data = client->message + 2;
+    size_t length = client->message_count - 2;
+    unsigned char reply[4];
+    int value;
+
+    /* All but signature and flow control commands carry a value */
+    if ((length < 1) && (command != RFC2217_SIGNATURE) &&
+        (command != RFC2217_FLOWCONTROL_SUSPEND) && (command != RFC2217_FLOWCONTROL_RESUME))
+    {
+        return;
+    }
+
+    switch (command)
+    {
+        case RFC2217_SIGNATURE:
+            if (length == 0)
+            {
+                socket_rfc2217_reply(client, command, (const unsigned char *) signature, strlen(signature));
+            }
+            break;
+
+        case RFC2217_SET_BAUDRATE:
+            if (length < 4)
+            {
+                break;
+            }
+            value = (int) (((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | (uint32_t) data[3]);
+            value = socket_control(sock, buffer, count, SOCKET_CONTROL_BAUDRATE, (value <= 0) ? SOCKET_CONTROL_QUERY : value);
+            value = MAX(value, 0);
+            reply[0] = value >> 24;
+            reply[1] = value >> 16;
+            reply[2] = value >> 8;
+            reply[3] = value;
+            socket_rfc2217_reply(client, command, reply, 4);
+            break;
+
+        case RFC2217_SET_DATASIZE:
+            value = socket_control(sock, buffer, count, SOCKET_CONTROL_DATABITS, (data[0] == 0) ? SOCKET_CONTROL_QUERY : data[0]);
+            socket_rfc2217_reply_byte(client, command, MAX(value, 0));
+            break;
+
+        case RFC2217_SET_PARITY:
+            /* 1 none, 2 odd, 3 even, mark and space are not supported */
+            value = ((data[0] >= 1) && (data[0] <= 3)) ? data[0] - 1 : SOCKET_CONTROL_QUERY;
+            value = socket_control(sock, buffer, count, SOCKET_CONTROL_PARITY, value);
+            socket_rfc2217_reply_byte(client, command, (value < 0) ? 0 : value + 1);
+            break;
+
+        case RFC2217_SET_STOPSIZE:
+            /* 1 or 2 stop bits, 1.5 is not supported */
+            value = ((data[0] == 1) || (data[0] == 2)) ? data[0] : SOCKET_CONTROL_QUERY;
+            value = socket_control(sock, buffer, count, SOCKET_CONTROL_STOPBITS, value);
+            socket_rfc2217_reply_byte(client, command, MAX(value, 0));
+            break;
+
+        case RFC2217_SET_CONTROL:
+            socket_rfc2217_set_control(sock, client, buffer, count, data[0]);
+            break;
+
+        case RFC2217_NOTIFY_LINESTATE:
+            /* Line errors are reported as they happen only */
+            socket_rfc2217_reply_byte(client, command, 0);
+            break;
+
+        case RFC2217_NOTIFY_MODEMSTATE:
+            socket_rfc2217_reply_byte(client, command, sock->modemstate & client->modemstate_mask);
+            break;
+
+        case RFC2217_FLOWCONTROL_SUSPEND:
+            /* Queue output until resumed */
+            client->suspended = true;
+            event_remove_write(client->fd);
+            break;
+
+        case RFC2217_FLOWCONTROL_RESUME:
+            client->suspended = false;
+            socket_client_flush(client);
+            break;
+
+        case RFC2217_SET_LINESTATE_MASK:
+            client->linestate_mask = data[0];
+            socket_rfc2217_reply_byte(client, command, data[0]);
+            break;
+
+        case RFC2217_SET_MODEMSTATE_MASK:
+            client->modemstate_mask = data[0];
+            socket_rfc2217_reply_byte(client, command, data[0]);
+            break;
+
+        case RFC2217_PURGE_DATA:
+            socket_control(sock, buffer, count, SOCKET_CONTROL_PURGE, data[0]);
+            socket_rfc2217_reply_byte(client, command, data[0]);
+            break;
+    }
+}
+
+/* Strip telnet protocol from client input in place, returns data length */
+static size_t socket_telnet_decode(struct socket_t *sock, struct socket_client_t *client, char *buffer, size_t count)
+{
+    size_t length = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned char c = buffer[i];
+
+        switch (client->state)
+        {
+            case DECODE_CR:
+                /* Carriage return is followed by NUL in non-binary mode */
+                client->state = DECODE_DATA;
+                if (c == '\0')
+                {
+                    break;
+                }
+                /* fall through */
+            case DECODE_DATA:
+                if (c == TELNET_IAC)
+                {
+                    client->state = DECODE_IAC;
+                    break;
+                }
+                buffer[length++] = c;
+                if ((c == '\r') && !(client->options_remote & socket_telnet_option_bit(TELNET_OPTION_BINARY)))
+                {
+                    client->state = DECODE_CR;
+                }
+                break;
+
+            case DECODE_IAC:
+                client->state = DECODE_DATA;
+                switch (c)
+                {
+                    case TELNET_IAC:
+                        buffer[length++] = c;
+                        break;
+                    case TELNET_WILL:
+                    case TELNET_WONT:
+                    case TELNET_DO:
+                    case TELNET_DONT:
+                        client->command = c;
+                        client->state = DECODE_OPTION;
+                        break;
+                    case TELNET_SB:
+                        client->message_count = 0;
+                        client->state = DECODE_SUBNEG;
+                        break;
+                }
+                break;
+
+            case DECODE_OPTION:
+                socket_telnet_negotiate(client, client->command, c);
+                client->state = DECODE_DATA;
+                break;
+
+            case DECODE_SUBNEG:
+                if (c == TELNET_IAC)
+                {
+                    client->state = DECODE_SUBNEG_IAC;
+                }
+                else if (client->message_count < SOCKET_MESSAGE_SIZE)
+                {
+                    client->message[client->message_count++] = c;
+                }
+                break;
+
+            case DECODE_SUBNEG_IAC:
+                if (c == TELNET_IAC)
+                {
+                    if (client->message_count < SOCKET_MESSAGE_SIZE)
+                    {
+                        client->message[client->message_count++] = c;
+                    }
+                    client->state = DECODE_SUBNEG;
+                    break;
+                }
+                client->state = DECODE_DATA;
+                if ((c == TELNET_SE) && (client->message_count >= 2) && (client->message[0] == TELNET_OPTION_COM_PORT))
+                {
+                    socket_rfc2217_command(sock, client, buffer, &length);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return length;
+}
+
+static void socket_frame_send(struct socket_client_t *client, unsigned char type, const unsigned char *data, size_t count)
+{
+    char message[FRAME_HEADER_SIZE + SOCKET_MESSAGE_SIZE];
+
+    count = MIN(count, SOCKET_MESSAGE_SIZE);
+    message[0] = type;
+    message[1] = count >> 8;
+    message[2] = count & 0xff;
+    memcpy(message + FRAME_HEADER_SIZE, data, count);
+    socket_client_write(client, message, FRAME_HEADER_SIZE + count);
+}
+
+/* Answer control message with the value in effect */
+static void socket_frame_control(struct socket_t *sock, struct socket_client_t *client, const char *buffer, size_t *count)
+{
+    const unsigned char *data = client->message;
+    unsigned char reply[FRAME_CONTROL_SIZE];
+    int value;
+
+    if (client->message_count < FRAME_CONTROL_SIZE)
+    {
+        return;
+    }
+
+    value = (int) (((unsigned int) data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4]);
+    value = socket_control(sock, buffer, count, data[0], (value < 0) ? SOCKET_CONTROL_QUERY : value);
+
+    reply[0] = data[0];
+    reply[1] = (unsigned int) value >> 24;
+    reply[2] = (unsigned int) value >> 16;
+    reply[3] = (unsigned int) value >> 8;
+    reply[4] = (unsigned int) value;
+    socket_frame_send(client, FRAME_CONTROL, reply, sizeof(reply));
+}
+
+/* Extract data messages from client input in place, returns data length */
+static size_t socket_frame_decode(struct socket_t *sock, struct socket_client_t *client, char *buffer, size_t count)
+{
+    size_t length = 0;
+    size_t i = 0;
+
+    while (i < count)
+    {
+        if (client->state == DECODE_FRAME_HEADER)
+        {
+            client->message[client->message_count++] = buffer[i++];
+            if (client->message_count < FRAME_HEADER_SIZE)
+            {
+                continue;
+            }
+            client->command = client->message[0];
+            client->frame_remaining = (client->message[1] << 8) | client->message[2];
+            client->message_count = 0;
+            client->state = DECODE_FRAME_PAYLOAD;
+        }
+        else if (client->command == FRAME_DATA)
+        {
+            /* Move payload run in place */
+            size_t run = MIN(client->frame_remaining, count - i);
+
+            memmove(buffer + length, buffer + i, run);
+            length += run;
+            i += run;
+            client->frame_remaining -= run;
+        }
+        else
+        {
+            if (client->message_count < SOCKET_MESSAGE_SIZE)
+            {
+                client->message[client->message_count++] = buffer[i];
+            }
+            i++;
+            client->frame_remaining--;
+        }
+
+        if ((client->state == DECODE_FRAME_PAYLOAD) && (client->frame_remaining == 0))
+        {
+            if (client->command == FRAME_CONTROL)
+            {
+                socket_frame_control(sock, client, buffer, &length);
+            }
+            client->message_count = 0;
+            client->state = DECODE_FRAME_HEADER;
+        }
+    }
+
+    return length;
+}
+
+/* Set up protocol state of new client */
+static void socket_client_start(struct socket_t *sock, struct socket_client_t *client)
+{
+    client->suspended = false;
+    client->message_count = 0;
+    client->frame_remaining = 0;
+    client->options_local = 0;
+    client->options_remote = 0;
+    client->modemstate_mask = 0xff;
+    client->linestate_mask = 0;
+
+    switch (option.socket_protocol)
+    {
+        case SOCKET_PROTOCOL_RFC2217:
+            /* Offer binary transmission and invite COM port control */
+            client->state = DECODE_DATA;
+            client->options_local = socket_telnet_option_bit(TELNET_OPTION_BINARY) | socket_telnet_option_bit(TELNET_OPTION_SGA);
+            client->options_remote = socket_telnet_option_bit(TELNET_OPTION_BINARY) | socket_telnet_option_bit(TELNET_OPTION_COM_PORT);
+            socket_telnet_send(client, TELNET_WILL, TELNET_OPTION_BINARY);
+            socket_telnet_send(client, TELNET_DO, TELNET_OPTION_BINARY);
+            socket_telnet_send(client, TELNET_WILL, TELNET_OPTION_SGA);
+            socket_telnet_send(client, TELNET_DO, TELNET_OPTION_COM_PORT);
+            break;
+
+        case SOCKET_PROTOCOL_FRAMED:
+            client->state = DECODE_FRAME_HEADER;
+            if (sock->modemstate_known)
+            {
+                socket_frame_send(client, FRAME_MODEMSTATE, &sock->modemstate, 1);
+            }
+            break;
+
+        case SOCKET_PROTOCOL_RAW:
+        default:
+            client->state = DECODE_DATA;
+            break;
+    }
+}
+
 static void socket_exit(void)
 {
-    if (socket_family == AF_UNIX)
+    for (struct socket_t *sock = sockets; sock != NULL; sock = sock->next)
     {
-        unlink(socket_filename());
+        if (sock->family == AF_UNIX)
+        {
+            unlink(sock->filename);
+        }
     }
 }
 
-void socket_configure(void)
+struct socket_t *socket_configure(const char *address, int instance)
 {
+    struct socket_t *sock;
     struct sockaddr_un sockaddr_unix = {};
     struct sockaddr_in sockaddr_inet = {};
     struct sockaddr_in6 sockaddr_inet6 = {};
     struct sockaddr *sockaddr_p;
     socklen_t socklen;
 
+    sock = calloc(1, sizeof(struct socket_t));
+    if (sock == NULL)
+    {
+        error_printf("Insufficient memory allocation for socket");
+        exit(EXIT_FAILURE);
+    }
+    sock->family = AF_UNSPEC;
+
     /* Parse socket string */
 
-    if (strncmp(option.socket, "unix:", 5) == 0)
+    if (strncmp(address, "unix:", 5) == 0)
     {
-        socket_family = AF_UNIX;
+        sock->family = AF_UNIX;
 
-        if (strlen(socket_filename()) == 0)
+        if (strlen(socket_filename(address)) == 0)
         {
             error_printf("Missing socket filename");
             exit(EXIT_FAILURE);
         }
 
-        if (strlen(socket_filename()) > sizeof(sockaddr_unix.sun_path) - 1)
+        /* Further instances listen on numbered socket files */
+        if (instance > 0)
+        {
+            asprintf(&sock->filename, "%s.%d", socket_filename(address), instance);
+        }
+        else
+        {
+            sock->filename = strdup(socket_filename(address));
+        }
+
+        if (strlen(sock->filename) > sizeof(sockaddr_unix.sun_path) - 1)
         {
-            error_printf("Socket file path %s too long", option.socket);
+            error_printf("Socket file path %s too long", sock->filename);
             exit(EXIT_FAILURE);
         }
     }
 
-    if (strncmp(option.socket, "inet:", 5) == 0)
+    if (strncmp(address, "inet:", 5) == 0)
     {
-        socket_family = AF_INET;
+        sock->family = AF_INET;
 
-        port_number = socket_inet_port();
+        /* Further instances listen on consecutive ports */
+        sock->port_number = socket_inet_port(address) + MAX(instance, 0);
 
-        if (port_number < 0)
+        if (sock->port_number < 0)
         {
-            error_printf("Invalid port number: %d", port_number);
+            error_printf("Invalid port number: %d", sock->port_number);
             exit(EXIT_FAILURE);
         }
     }
 
-    if (strncmp(option.socket, "inet6:", 6) == 0)
+    if (strncmp(address, "inet6:", 6) == 0)
     {
-        socket_family = AF_INET6;
+        sock->family = AF_INET6;
 
-        port_number = socket_inet6_port();
+        /* Further instances listen on consecutive ports */
+        sock->port_number = socket_inet6_port(address) + MAX(instance, 0);
 
-        if (port_number < 0)
+        if (sock->port_number < 0)
         {
-            error_printf("Invalid port number: %d", port_number);
+            error_printf("Invalid port number: %d", sock->port_number);
             exit(EXIT_FAILURE);
         }
     }
 
-    if (socket_family == AF_UNSPEC)
+    if (sock->family == AF_UNSPEC)
     {
-        error_printf("%s: Invalid socket scheme, must be prefixed with 'unix:', 'inet:', or 'inet6:'", option.socket);
+        error_printf("%s: Invalid socket scheme, must be prefixed with 'unix:', 'inet:', or 'inet6:'", address);
         exit(EXIT_FAILURE);
     }
  
     /* Configure socket */
 
-    switch (socket_family)
+    switch (sock->family)
     {
         case AF_UNIX:
             sockaddr_unix.sun_family = AF_UNIX;
-            strncpy(sockaddr_unix.sun_path, socket_filename(), sizeof(sockaddr_unix.sun_path) - 1);
+            strncpy(sockaddr_unix.sun_path, sock->filename, sizeof(sockaddr_unix.sun_path) - 1);
             sockaddr_p = (struct sockaddr *) &sockaddr_unix;
             socklen = sizeof(sockaddr_unix);
             break;
@@ -151,7 +997,7 @@ void socket_configure(void)
         case AF_INET:
             sockaddr_inet.sin_family = AF_INET;
             sockaddr_inet.sin_addr.s_addr = INADDR_ANY;
-            sockaddr_inet.sin_port = htons(port_number);
+            sockaddr_inet.sin_port = htons(sock->port_number);
             sockaddr_p = (struct sockaddr *) &sockaddr_inet;
             socklen = sizeof(sockaddr_inet);
             break;
@@ -159,148 +1005,402 @@ void socket_configure(void)
         case AF_INET6:
             sockaddr_inet6.sin6_family = AF_INET6;
             sockaddr_inet6.sin6_addr = in6addr_any;
-            sockaddr_inet6.sin6_port = htons(port_number);
+            sockaddr_inet6.sin6_port = htons(sock->port_number);
             sockaddr_p = (struct sockaddr *) &sockaddr_inet6;
             socklen = sizeof(sockaddr_inet6);
             break;
 
         default:
-            error_printf("Invalid socket family (%d)", socket_family);
+            error_printf("Invalid socket family (%d)", sock->family);
             exit(EXIT_FAILURE);
             break;
     }
 
     /* Create socket */
-    sockfd = socket(socket_family, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    sock->sockfd = socket(sock->family, SOCK_STREAM, 0);
+    if (sock->sockfd < 0)
     {
         error_printf("Failed to create socket (%s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     /* Bind */
-    if (bind(sockfd, sockaddr_p, socklen) < 0)
+    if (bind(sock->sockfd, sockaddr_p, socklen) < 0)
     {
         error_printf("Failed to bind to socket (%s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     /* Listen */
-    if (listen(sockfd, MAX_SOCKET_CLIENTS) < 0)
+    if (listen(sock->sockfd, SOMAXCONN) < 0)
     {
         error_printf("Failed to listen on socket (%s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    memset(clientfds, -1, sizeof(clientfds));
-    atexit(socket_exit);
+    if (sockets == NULL)
+    {
+        atexit(socket_exit);
+    }
+    sock->next = sockets;
+    sockets = sock;
+
+    event_add(sock->sockfd);
 
-    if (socket_family == AF_UNIX)
+    if (sock->family == AF_UNIX)
     {
-        tio_printf("Listening on socket %s", socket_filename());
+        tio_printf("Listening on socket %s", sock->filename);
     }
     else
     {
-        tio_printf("Listening on socket port %d", port_number);
+        tio_printf("Listening on socket port %d", sock->port_number);
+    }
+
+    return sock;
+}
+
+void socket_set_handlers(struct socket_t *sock, socket_control_handler_t control, socket_input_handler_t input, void *context)
+{
+    if (sock == NULL)
+    {
+        return;
+    }
+
+    sock->control = control;
+    sock->input = input;
+    sock->context = context;
+}
+
+/* Tell clients about modem line state (TIOCM_* bits) and what changed since last time */
+void socket_notify_lines(struct socket_t *sock, int state)
+{
+    unsigned char modemstate = 0;
+    unsigned char changed, deltas = 0;
+
+    if (sock == NULL)
+    {
+        return;
+    }
+
+    modemstate |= (state & TIOCM_CTS) ? MODEMSTATE_CTS : 0;
+    modemstate |= (state & TIOCM_DSR) ? MODEMSTATE_DSR : 0;
+    modemstate |= (state & TIOCM_RNG) ? MODEMSTATE_RI : 0;
+    modemstate |= (state & TIOCM_CD) ? MODEMSTATE_CD : 0;
+
+    changed = modemstate ^ sock->modemstate;
+    if (sock->modemstate_known)
+    {
+        deltas |= (changed & MODEMSTATE_CTS) ? MODEMSTATE_CTS_DELTA : 0;
+        deltas |= (changed & MODEMSTATE_DSR) ? MODEMSTATE_DSR_DELTA : 0;
+        deltas |= (changed & sock->modemstate & MODEMSTATE_RI) ? MODEMSTATE_RI_EDGE : 0;
+        deltas |= (changed & MODEMSTATE_CD) ? MODEMSTATE_CD_DELTA : 0;
+    }
+
+    sock->modemstate = modemstate;
+    sock->modemstate_known = true;
+
+    for (int i = 0; i != sock->clients_size; ++i)
+    {
+        struct socket_client_t *client = &sock->clients[i];
+
+        if (client->fd == -1)
+        {
+            continue;
+        }
+
+        if (option.socket_protocol == SOCKET_PROTOCOL_RFC2217)
+        {
+            if ((changed | deltas) & client->modemstate_mask)
+            {
+                socket_rfc2217_reply_byte(client, RFC2217_NOTIFY_MODEMSTATE, (modemstate | deltas) & client->modemstate_mask);
+            }
+        }
+        else if (option.socket_protocol == SOCKET_PROTOCOL_FRAMED)
+        {
+            unsigned char message = modemstate | deltas;
+
+            socket_frame_send(client, FRAME_MODEMSTATE, &message, 1);
+        }
     }
 }
 
-void socket_write(char input_char)
+/* Tell clients about line errors detected since last time */
+void socket_notify_errors(struct socket_t *sock, bool overrun, bool parity, bool frame, bool brk)
 {
-    if (!option.socket)
+    unsigned char linestate = 0;
+
+    if (sock == NULL)
     {
         return;
     }
 
-    for (int i = 0; i != MAX_SOCKET_CLIENTS; ++i)
+    linestate |= overrun ? LINESTATE_OVERRUN : 0;
+    linestate |= parity ? LINESTATE_PARITY : 0;
+    linestate |= frame ? LINESTATE_FRAME : 0;
+    linestate |= brk ? LINESTATE_BREAK : 0;
+
+    for (int i = 0; i != sock->clients_size; ++i)
     {
-        if (clientfds[i] != -1)
+        struct socket_client_t *client = &sock->clients[i];
+
+        if (client->fd == -1)
+        {
+            continue;
+        }
+
+        if (option.socket_protocol == SOCKET_PROTOCOL_RFC2217)
         {
-            if (write(clientfds[i], &input_char, 1) <= 0)
+            if (linestate & client->linestate_mask)
             {
-                error_printf_silent("Failed to write to socket (%s)", strerror(errno));
-                close(clientfds[i]);
-                clientfds[i] = -1;
+                socket_rfc2217_reply_byte(client, RFC2217_NOTIFY_LINESTATE, linestate & client->linestate_mask);
             }
         }
+        else if (option.socket_protocol == SOCKET_PROTOCOL_FRAMED)
+        {
+            socket_frame_send(client, FRAME_LINESTATE, &linestate, 1);
+        }
     }
 }
 
-int socket_add_fds(fd_set *rdfs, bool connected)
+/* Send to all clients, encoded for the socket protocol */
+void socket_write(struct socket_t *sock, const char *buffer, size_t count)
 {
-    if (!option.socket)
+    if (sock == NULL)
     {
-        return 0;
+        return;
+    }
+
+    switch (option.socket_protocol)
+    {
+        case SOCKET_PROTOCOL_RFC2217:
+            /* Escape IAC bytes, sending runs without any as they are */
+            while (count > 0)
+            {
+                const char *iac = memchr(buffer, TELNET_IAC, count);
+                size_t length;
+
+                if (iac == NULL)
+                {
+                    socket_broadcast(sock, buffer, count);
+                    break;
+                }
+
+                length = 0;
+                while ((count > 0) && (length < sizeof(encode_buffer) - 1))
+                {
+                    encode_buffer[length++] = *buffer;
+                    if ((unsigned char) *buffer == TELNET_IAC)
+                    {
+                        encode_buffer[length++] = TELNET_IAC;
+                    }
+                    buffer++;
+                    count--;
+                }
+                socket_broadcast(sock, encode_buffer, length);
+            }
+            break;
+
+        case SOCKET_PROTOCOL_FRAMED:
+            /* One data message per block received */
+            while (count > 0)
+            {
+                size_t length = MIN(count, SOCKET_ENCODE_SIZE);
+
+                encode_buffer[0] = FRAME_DATA;
+                encode_buffer[1] = length >> 8;
+                encode_buffer[2] = length & 0xff;
+                memcpy(encode_buffer + FRAME_HEADER_SIZE, buffer, length);
+                socket_broadcast(sock, encode_buffer, FRAME_HEADER_SIZE + length);
+                buffer += length;
+                count -= length;
+            }
+            break;
+
+        case SOCKET_PROTOCOL_RAW:
+        default:
+            socket_broadcast(sock, buffer, count);
+            break;
+    }
+}
+
+#ifdef HAVE_SPLICE
+void socket_splice(struct socket_t *sock, size_t count)
+{
+    const char *leftover;
+    size_t rest;
+
+    if (sock == NULL)
+    {
+        return;
     }
 
-    int numclients = 0, maxfd = 0;
-    for (int i = 0; i != MAX_SOCKET_CLIENTS; ++i)
+    /* Protocols other than raw need the data encoded */
+    if (option.socket_protocol != SOCKET_PROTOCOL_RAW)
     {
-        if (clientfds[i] != -1)
+        rest = splice_copy(-1, count, &leftover);
+        socket_write(sock, leftover, rest);
+        return;
+    }
+
+    for (int i = 0; i != sock->clients_size; ++i)
+    {
+        struct socket_client_t *client = &sock->clients[i];
+
+        if (client->fd == -1)
         {
-            /* let clients block if they try to send while we're disconnected */
-            if (connected)
+            continue;
+        }
+
+        /* splice directly unless output is already queued or suspended for this client */
+        rest = splice_copy(((client->count == 0) && !client->suspended) ? client->fd : -1, count, &leftover);
+        if (rest > 0)
+        {
+            socket_client_queue(client, leftover, rest);
+            if ((client->fd != -1) && !client->suspended)
             {
-                FD_SET(clientfds[i], rdfs);
-                maxfd = MAX(maxfd, clientfds[i]);
+                event_add_write(client->fd);
             }
-            numclients++;
         }
     }
-    /* don't bother to accept clients if we're already full */
-    if (numclients != MAX_SOCKET_CLIENTS)
+}
+#endif
+
+void socket_handle_output(struct socket_t *sock)
+{
+    if (sock == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i != sock->clients_size; ++i)
+    {
+        if ((sock->clients[i].fd != -1) && (sock->clients[i].count > 0) && !sock->clients[i].suspended &&
+            event_writable(sock->clients[i].fd))
+        {
+            socket_client_flush(&sock->clients[i]);
+        }
+    }
+}
+
+/* Report connected clients and how much output is queued for them */
+void socket_queue_stats(struct socket_t *sock, int *clients, size_t *queued, size_t *queued_max)
+{
+    *clients = 0;
+    *queued = 0;
+    *queued_max = 0;
+
+    if (sock == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i != sock->clients_size; ++i)
     {
-        FD_SET(sockfd, rdfs);
-        maxfd = MAX(maxfd, sockfd);
+        if (sock->clients[i].fd == -1)
+        {
+            continue;
+        }
+        (*clients)++;
+        *queued += sock->clients[i].count;
+        *queued_max = MAX(*queued_max, sock->clients[i].count);
     }
-    return maxfd;
 }
 
-bool socket_handle_input(fd_set *rdfs, char *output_char)
+void socket_set_connected(struct socket_t *sock, bool connected)
 {
-    if (!option.socket)
+    if ((sock == NULL) || (connected == sock->input_enabled))
     {
-        return false;
+        return;
     }
 
-    if (FD_ISSET(sockfd, rdfs))
+    /* let clients block if they try to send while we're disconnected */
+    for (int i = 0; i != sock->clients_size; ++i)
     {
-        int clientfd = accept(sockfd, NULL, NULL);
-        /* this loop should always succeed because we don't select on sockfd when full */
-        for (int i = 0; i != MAX_SOCKET_CLIENTS; ++i)
+        if (sock->clients[i].fd != -1)
         {
-            if (clientfds[i] == -1)
+            if (connected)
             {
-                clientfds[i] = clientfd;
-                break;
+                event_add(sock->clients[i].fd);
+            }
+            else
+            {
+                event_remove(sock->clients[i].fd);
+                if ((sock->clients[i].count > 0) && !sock->clients[i].suspended)
+                {
+                    /* keep flushing queued output while disconnected */
+                    event_add_write(sock->clients[i].fd);
+                }
             }
         }
     }
-    for (int i = 0; i != MAX_SOCKET_CLIENTS; ++i)
+
+    sock->input_enabled = connected;
+}
+
+ssize_t socket_handle_input(struct socket_t *sock, char *buffer, size_t size)
+{
+    if (sock == NULL)
     {
-        if (clientfds[i] != -1 && FD_ISSET(clientfds[i], rdfs))
+        return 0;
+    }
+
+    if (event_ready(sock->sockfd))
+    {
+        int clientfd = accept(sock->sockfd, NULL, NULL);
+        if (clientfd >= 0)
+        {
+            socket_client_add(sock, clientfd);
+        }
+    }
+    for (int i = 0; (buffer != NULL) && (i != sock->clients_size); ++i)
+    {
+        if (sock->clients[i].fd != -1 && event_ready(sock->clients[i].fd))
         {
-            int status = read(clientfds[i], output_char, 1);
+            ssize_t status = read(sock->clients[i].fd, buffer, size);
             if (status == 0)
             {
-                close(clientfds[i]);
-                clientfds[i] = -1;
+                socket_client_close(&sock->clients[i]);
                 continue;
             }
             if (status < 0)
             {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                {
+                    continue;
+                }
                 error_printf_silent("Failed to read from socket (%s)", strerror(errno));
-                close(clientfds[i]);
-                clientfds[i] = -1;
+                socket_client_close(&sock->clients[i]);
                 continue;
             }
-            /* match the behavior of a terminal in raw mode */
-            if (*output_char == '\n')
+            switch (option.socket_protocol)
             {
-                *output_char = '\r';
+                case SOCKET_PROTOCOL_RFC2217:
+                    status = socket_telnet_decode(sock, &sock->clients[i], buffer, status);
+                    break;
+
+                case SOCKET_PROTOCOL_FRAMED:
+                    status = socket_frame_decode(sock, &sock->clients[i], buffer, status);
+                    break;
+
+                case SOCKET_PROTOCOL_RAW:
+                default:
+                    /* match the behavior of a terminal in raw mode */
+                    for (ssize_t j = 0; j < status; ++j)
+                    {
+                        if (buffer[j] == '\n')
+                        {
+                            buffer[j] = '\r';
+                        }
+                    }
+                    break;
+            }
+            if (status == 0)
+            {
+                /* protocol messages only */
+                continue;
             }
-            return true;
+            return status;
         }
     }
-    return false;
+    return 0;
 }
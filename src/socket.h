@@ -23,9 +23,54 @@
 #pragma once
 
 #include <stdbool.h>
-#include <sys/select.h>
+#include <stddef.h>
+#include <sys/types.h>
 
-void socket_configure(void);
-void socket_write(char input_char);
-int socket_add_fds(fd_set *fds, bool connected);
-bool socket_handle_input(fd_set *fds, char *output_char);
+struct socket_t;
+
+/* Serial port settings socket clients may change */
+enum socket_control_t
+{
+    SOCKET_CONTROL_BAUDRATE = 1,
+    SOCKET_CONTROL_DATABITS,
+    SOCKET_CONTROL_PARITY,
+    SOCKET_CONTROL_STOPBITS,
+    SOCKET_CONTROL_FLOW,
+    SOCKET_CONTROL_DTR,
+    SOCKET_CONTROL_RTS,
+    SOCKET_CONTROL_BREAK,
+    SOCKET_CONTROL_PURGE,
+};
+
+#define SOCKET_CONTROL_QUERY -1
+
+#define SOCKET_PARITY_NONE 0
+#define SOCKET_PARITY_ODD  1
+#define SOCKET_PARITY_EVEN 2
+
+#define SOCKET_FLOW_NONE 0
+#define SOCKET_FLOW_SOFT 1
+#define SOCKET_FLOW_HARD 2
+
+#define SOCKET_PURGE_RX   1
+#define SOCKET_PURGE_TX   2
+#define SOCKET_PURGE_BOTH 3
+
+/* Apply (or query) setting, returns value in effect or -1 if unsupported */
+typedef int (*socket_control_handler_t)(void *context, enum socket_control_t control, int value);
+
+/* Deliver client input preceding a control request so it is sent first */
+typedef void (*socket_input_handler_t)(void *context, const char *buffer, size_t count);
+
+struct socket_t *socket_configure(const char *address, int instance);
+void socket_set_handlers(struct socket_t *sock, socket_control_handler_t control, socket_input_handler_t input, void *context);
+void socket_notify_lines(struct socket_t *sock, int state);
+void socket_notify_errors(struct socket_t *sock, bool overrun, bool parity, bool frame, bool brk);
+void socket_write(struct socket_t *sock, const char *buffer, size_t count);
+#ifdef HAVE_SPLICE
+void socket_splice(struct socket_t *sock, size_t count);
+#endif
+void socket_handle_output(struct socket_t *sock);
+void socket_queue_stats(struct socket_t *sock, int *clients, size_t *queued, size_t *queued_max);
+void socket_set_connected(struct socket_t *sock, bool connected);
+ssize_t socket_handle_input(struct socket_t *sock, char *buffer, size_t size);
@@ -0,0 +1,155 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Zero-copy receive path (Linux)
+ *
+ * Received data is spliced from the tty device into a pipe. Each output
+ * (stdout, log file, socket clients) gets a tee() duplicate of the pipe
+ * contents spliced to it, so the bytes never pass through a user space
+ * buffer. Whatever an output does not accept is read back into user space
+ * so the caller can fall back to a normal write or queue it.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/param.h>
+#include "splice.h"
+#include "print.h"
+
+#define SPLICE_SIZE BUFSIZ
+
+static int rx_pipe[2] = { -1, -1 };
+static int copy_pipe[2] = { -1, -1 };
+static int null_fd = -1;
+static char leftover_buffer[SPLICE_SIZE];
+
+bool splice_init(void)
+{
+    if (rx_pipe[0] != -1)
+    {
+        return true;
+    }
+
+    if (pipe2(rx_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        return false;
+    }
+
+    if (pipe2(copy_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        goto error_copy_pipe;
+    }
+
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd < 0)
+    {
+        goto error_null;
+    }
+
+    return true;
+
+error_null:
+    close(copy_pipe[0]);
+    close(copy_pipe[1]);
+error_copy_pipe:
+    close(rx_pipe[0]);
+    close(rx_pipe[1]);
+    rx_pipe[0] = rx_pipe[1] = -1;
+    return false;
+}
+
+/* Move available input from fd into the receive pipe, at most size bytes */
+ssize_t splice_read(int fd, size_t size)
+{
+    return splice(fd, NULL, rx_pipe[1], NULL, MIN(size, (size_t) SPLICE_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+/* Copy count bytes held in the receive pipe to fd without consuming them.
+ * Returns number of trailing bytes fd did not accept, which are then
+ * available in leftover. A negative fd makes all bytes leftover. */
+size_t splice_copy(int fd, size_t count, const char **leftover)
+{
+    ssize_t status;
+    size_t copied = 0, written = 0, rest = 0;
+
+    while (copied < count)
+    {
+        status = tee(rx_pipe[0], copy_pipe[1], count - copied, SPLICE_F_NONBLOCK);
+        if (status <= 0)
+        {
+            break;
+        }
+        copied += status;
+    }
+
+    while ((fd >= 0) && (written < copied))
+    {
+        status = splice(copy_pipe[0], NULL, fd, NULL, copied - written, SPLICE_F_MOVE);
+        if (status <= 0)
+        {
+            /* Output would block or does not support splice */
+            break;
+        }
+        written += status;
+    }
+
+    while (rest < copied - written)
+    {
+        status = read(copy_pipe[0], leftover_buffer + rest, copied - written - rest);
+        if (status <= 0)
+        {
+            break;
+        }
+        rest += status;
+    }
+
+    *leftover = leftover_buffer;
+
+    return rest;
+}
+
+/* Discard count bytes from the receive pipe once all outputs got a copy */
+void splice_consume(size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t status = splice(rx_pipe[0], NULL, null_fd, NULL, count, SPLICE_F_MOVE);
+        if (status <= 0)
+        {
+            /* Fall back to reading data out of the pipe */
+            status = read(rx_pipe[0], leftover_buffer, MIN(count, sizeof(leftover_buffer)));
+            if (status <= 0)
+            {
+                break;
+            }
+        }
+        count -= status;
+    }
+}
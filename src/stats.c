@@ -0,0 +1,471 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Statistics
+ *
+ * Counters are only touched by the main thread, so the receive and
+ * transmit paths account with plain increments. Counters owned by other
+ * threads (reader, log writer) stay in their modules and are sampled
+ * when statistics are published. Byte counts are also kept per second in
+ * a ring covering the last minute, which yields 1s, 10s and 60s rates.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/param.h>
+#include "options.h"
+#include "print.h"
+#include "error.h"
+#include "misc.h"
+#include "pace.h"
+#include "stats.h"
+
+/* Seconds of history kept for rate windows */
+#define STATS_WINDOW 60
+
+/* Read sizes are counted in power of two buckets, the last one open ended */
+#define STATS_HISTOGRAM_BUCKETS 14
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Counters of one tty device */
+struct stats_t
+{
+    const char *label;
+    unsigned long rx_bytes, tx_bytes;
+    unsigned long rx_reads;
+    unsigned long read_histogram[STATS_HISTOGRAM_BUCKETS];
+    unsigned long rx_seconds[STATS_WINDOW];
+    unsigned long tx_seconds[STATS_WINDOW];
+    struct stats_t *next;
+};
+
+static struct stats_t *stats_list = NULL;
+static struct stats_t **stats_list_end = &stats_list;
+static uint64_t first_second = 0;
+static uint64_t current_second = 0;
+static unsigned int second_index = 0;
+static unsigned long wakeups_total = 0;
+static unsigned long wakeup_seconds[STATS_WINDOW];
+
+static const int rate_windows[] = { 1, 10, 60 };
+
+struct stats_t *stats_create(const char *label)
+{
+    struct stats_t *stats = calloc(1, sizeof(struct stats_t));
+
+    if (stats == NULL)
+    {
+        error_printf("Insufficient memory allocation for statistics");
+        exit(EXIT_FAILURE);
+    }
+
+    stats->label = label;
+
+    /* Keep creation order so published statistics follow device order */
+    *stats_list_end = stats;
+    stats_list_end = &stats->next;
+
+    return stats;
+}
+
+void stats_rx(struct stats_t *stats, size_t count)
+{
+    int bucket;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    bucket = (8 * sizeof(unsigned long) - 1) - __builtin_clzl(count);
+    if (bucket >= STATS_HISTOGRAM_BUCKETS)
+    {
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    stats->rx_bytes += count;
+    stats->rx_reads++;
+    stats->read_histogram[bucket]++;
+    stats->rx_seconds[second_index] += count;
+}
+
+void stats_tx(struct stats_t *stats, size_t count)
+{
+    stats->tx_bytes += count;
+    stats->tx_seconds[second_index] += count;
+}
+
+/* Account event loop wakeup, returns true when a new second has started */
+bool stats_tick(void)
+{
+    uint64_t now = pace_now() / NSEC_PER_SEC;
+    bool rolled = false;
+
+    if (first_second == 0)
+    {
+        first_second = now;
+        current_second = now;
+        second_index = now % STATS_WINDOW;
+    }
+    else if (now != current_second)
+    {
+        /* Clear seconds which have passed since last wakeup */
+        uint64_t from = MAX(current_second + 1, now - MIN(now, (uint64_t) STATS_WINDOW - 1));
+
+        for (uint64_t second = from; second <= now; second++)
+        {
+            unsigned int index = second % STATS_WINDOW;
+
+            wakeup_seconds[index] = 0;
+            for (struct stats_t *stats = stats_list; stats != NULL; stats = stats->next)
+            {
+                stats->rx_seconds[index] = 0;
+                stats->tx_seconds[index] = 0;
+            }
+        }
+
+        current_second = now;
+        second_index = now % STATS_WINDOW;
+        rolled = true;
+    }
+
+    wakeups_total++;
+    wakeup_seconds[second_index]++;
+
+    return rolled;
+}
+
+/* Milliseconds until next second starts, or -1 if nothing is published periodically */
+int stats_timeout(void)
+{
+    if ((option.stats_interval == 0) && (option.stats_filename == NULL))
+    {
+        return -1;
+    }
+
+    return 1000 - (pace_now() / 1000000) % 1000 + 1;
+}
+
+bool stats_interval_due(void)
+{
+    return (option.stats_interval > 0) && (current_second != first_second) &&
+           (((current_second - first_second) % option.stats_interval) == 0);
+}
+
+/* Average rate over the last completed seconds of window */
+static double stats_rate(const unsigned long *seconds, int window)
+{
+    unsigned long sum = 0;
+
+    window = MIN((uint64_t) window, current_second - first_second);
+    if (window == 0)
+    {
+        return 0;
+    }
+
+    for (int i = 1; i <= window; i++)
+    {
+        sum += seconds[(current_second - i) % STATS_WINDOW];
+    }
+
+    return (double) sum / window;
+}
+
+static unsigned long bucket_low(int bucket)
+{
+    return 1UL << bucket;
+}
+
+static unsigned long bucket_high(int bucket)
+{
+    return (1UL << (bucket + 1)) - 1;
+}
+
+void stats_print(struct stats_t *stats, const struct stats_sample_t *sample)
+{
+    tio_printf(" Sent %lu bytes", stats->tx_bytes);
+    tio_printf(" Received %lu bytes in %lu reads", stats->rx_bytes, stats->rx_reads);
+    tio_printf(" RX rate 1s/10s/60s: %.0f / %.0f / %.0f bytes/s",
+               stats_rate(stats->rx_seconds, 1), stats_rate(stats->rx_seconds, 10), stats_rate(stats->rx_seconds, 60));
+    tio_printf(" TX rate 1s/10s/60s: %.0f / %.0f / %.0f bytes/s",
+               stats_rate(stats->tx_seconds, 1), stats_rate(stats->tx_seconds, 10), stats_rate(stats->tx_seconds, 60));
+
+    if (stats->rx_reads > 0)
+    {
+        tio_printf(" Read sizes:");
+        for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        {
+            if (stats->read_histogram[i] == 0)
+            {
+                continue;
+            }
+            if (i == STATS_HISTOGRAM_BUCKETS - 1)
+            {
+                tio_printf("  %5lu+      %lu", bucket_low(i), stats->read_histogram[i]);
+            }
+            else
+            {
+                tio_printf("  %5lu-%-5lu %lu", bucket_low(i), bucket_high(i), stats->read_histogram[i]);
+            }
+        }
+    }
+
+    if (sample->icount_valid)
+    {
+        tio_printf(" Overruns: %lu, buffer overruns: %lu", sample->overrun, sample->buf_overrun);
+        tio_printf(" Framing errors: %lu, parity errors: %lu, breaks: %lu", sample->frame, sample->parity, sample->brk);
+    }
+
+    if (sample->rx_buffer_size > 0)
+    {
+        tio_printf(" RX buffer high-water mark: %zu of %zu bytes", sample->rx_buffer_high_water, sample->rx_buffer_size);
+        tio_printf(" RX buffer full: %lu times", sample->rx_buffer_full);
+    }
+
+    if (option.socket)
+    {
+        tio_printf(" Socket clients: %d, queued %zu bytes (max %zu bytes)",
+                   sample->socket_clients, sample->socket_queued, sample->socket_queued_max);
+    }
+
+    if (option.log)
+    {
+        tio_printf(" Log writes: %lu, latency avg %.1f us, max %.1f us", sample->log_writes,
+                   sample->log_writes ? sample->log_write_ns_total / 1000.0 / sample->log_writes : 0,
+                   sample->log_write_ns_max / 1000.0);
+        if (option.log_async)
+        {
+            tio_printf(" Dropped %lu log bytes", sample->log_dropped);
+        }
+    }
+}
+
+void stats_print_wakeups(void)
+{
+    tio_printf(" Event loop wakeups: %lu (%.0f / s)", wakeups_total, stats_rate(wakeup_seconds, 10));
+}
+
+/* Periodic one line summary */
+void stats_print_status(struct stats_t *stats)
+{
+    tio_printf("%s%sRX %.0f/%.0f/%.0f B/s, TX %.0f/%.0f/%.0f B/s, %.0f wakeups/s",
+               (stats_list->next != NULL) ? stats->label : "",
+               (stats_list->next != NULL) ? ": " : "",
+               stats_rate(stats->rx_seconds, 1), stats_rate(stats->rx_seconds, 10), stats_rate(stats->rx_seconds, 60),
+               stats_rate(stats->tx_seconds, 1), stats_rate(stats->tx_seconds, 10), stats_rate(stats->tx_seconds, 60),
+               stats_rate(wakeup_seconds, 1));
+}
+
+static void fprint_label(FILE *fp, const char *label)
+{
+    fputs("device=\"", fp);
+    for (const char *c = label; *c != 0; c++)
+    {
+        if ((*c == '"') || (*c == '\\'))
+        {
+            fputc('\\', fp);
+        }
+        fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void fprint_family(FILE *fp, const char *name, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n", name, help);
+    fprintf(fp, "# TYPE %s %s\n", name, type);
+}
+
+/* Write one sample per device for each metric, samples in device order */
+#define FPRINT_METRIC(fp, name, format, value) \
+    do { \
+        int i = 0; \
+        for (struct stats_t *stats = stats_list; stats != NULL; stats = stats->next, i++) \
+        { \
+            const struct stats_sample_t *sample = &samples[i]; \
+            UNUSED(sample); \
+            fprintf(fp, "%s{", name); \
+            fprint_label(fp, stats->label); \
+            fprintf(fp, "} " format "\n", value); \
+        } \
+    } while (0)
+
+/* Publish statistics in Prometheus text format, replaced atomically */
+void stats_file_write(const struct stats_sample_t *samples)
+{
+    char *tmp_filename = NULL;
+    FILE *fp;
+
+    if (asprintf(&tmp_filename, "%s.tmp", option.stats_filename) < 0)
+    {
+        return;
+    }
+
+    fp = fopen(tmp_filename, "w");
+    if (fp == NULL)
+    {
+        warning_printf("Could not write statistics file %s (%s)", tmp_filename, strerror(errno));
+        free(tmp_filename);
+        return;
+    }
+
+    fprint_family(fp, "tio_connected", "gauge", "Whether tty device is connected");
+    FPRINT_METRIC(fp, "tio_connected", "%d", sample->connected ? 1 : 0);
+
+    fprint_family(fp, "tio_rx_bytes_total", "counter", "Bytes received from tty device");
+    FPRINT_METRIC(fp, "tio_rx_bytes_total", "%lu", stats->rx_bytes);
+
+    fprint_family(fp, "tio_tx_bytes_total", "counter", "Bytes sent to tty device");
+    FPRINT_METRIC(fp, "tio_tx_bytes_total", "%lu", stats->tx_bytes);
+
+    fprint_family(fp, "tio_rx_read_size_bytes", "histogram", "Size of reads from tty device");
+    for (struct stats_t *stats = stats_list; stats != NULL; stats = stats->next)
+    {
+        unsigned long cumulative = 0;
+
+        for (int b = 0; b < STATS_HISTOGRAM_BUCKETS - 1; b++)
+        {
+            cumulative += stats->read_histogram[b];
+            fprintf(fp, "tio_rx_read_size_bytes_bucket{");
+            fprint_label(fp, stats->label);
+            fprintf(fp, ",le=\"%lu\"} %lu\n", bucket_high(b), cumulative);
+        }
+        fprintf(fp, "tio_rx_read_size_bytes_bucket{");
+        fprint_label(fp, stats->label);
+        fprintf(fp, ",le=\"+Inf\"} %lu\n", stats->rx_reads);
+        fprintf(fp, "tio_rx_read_size_bytes_sum{");
+        fprint_label(fp, stats->label);
+        fprintf(fp, "} %lu\n", stats->rx_bytes);
+        fprintf(fp, "tio_rx_read_size_bytes_count{");
+        fprint_label(fp, stats->label);
+        fprintf(fp, "} %lu\n", stats->rx_reads);
+    }
+
+    fprint_family(fp, "tio_rx_rate_bytes_per_second", "gauge", "Average receive rate over window");
+    for (size_t w = 0; w < sizeof(rate_windows) / sizeof(rate_windows[0]); w++)
+    {
+        for (struct stats_t *stats = stats_list; stats != NULL; stats = stats->next)
+        {
+            fprintf(fp, "tio_rx_rate_bytes_per_second{");
+            fprint_label(fp, stats->label);
+            fprintf(fp, ",window=\"%ds\"} %.0f\n", rate_windows[w], stats_rate(stats->rx_seconds, rate_windows[w]));
+        }
+    }
+
+    fprint_family(fp, "tio_tx_rate_bytes_per_second", "gauge", "Average transmit rate over window");
+    for (size_t w = 0; w < sizeof(rate_windows) / sizeof(rate_windows[0]); w++)
+    {
+        for (struct stats_t *stats = stats_list; stats != NULL; stats = stats->next)
+        {
+            fprintf(fp, "tio_tx_rate_bytes_per_second{");
+            fprint_label(fp, stats->label);
+            fprintf(fp, ",window=\"%ds\"} %.0f\n", rate_windows[w], stats_rate(stats->tx_seconds, rate_windows[w]));
+        }
+    }
+
+    fprint_family(fp, "tio_wakeups_total", "counter", "Event loop wakeups");
+    fprintf(fp, "tio_wakeups_total %lu\n", wakeups_total);
+    fprint_family(fp, "tio_wakeups_per_second", "gauge", "Event loop wakeups per second over last 10 seconds");
+    fprintf(fp, "tio_wakeups_per_second %.1f\n", stats_rate(wakeup_seconds, 10));
+
+    /* Error counters are only available from real serial drivers */
+    int i = 0;
+    bool header = false;
+    for (struct stats_t *stats = stats_list; stats != NULL; stats = stats->next, i++)
+    {
+        const struct
+        {
+            const char *type;
+            unsigned long value;
+        } errors[] =
+        {
+            { "overrun", samples[i].overrun },
+            { "buffer_overrun", samples[i].buf_overrun },
+            { "frame", samples[i].frame },
+            { "parity", samples[i].parity },
+            { "break", samples[i].brk },
+        };
+
+        if (!samples[i].icount_valid)
+        {
+            continue;
+        }
+
+        if (!header)
+        {
+            fprint_family(fp, "tio_serial_errors_total", "counter", "Errors counted by serial driver");
+            header = true;
+        }
+
+        for (size_t e = 0; e < sizeof(errors) / sizeof(errors[0]); e++)
+        {
+            fprintf(fp, "tio_serial_errors_total{");
+            fprint_label(fp, stats->label);
+            fprintf(fp, ",type=\"%s\"} %lu\n", errors[e].type, errors[e].value);
+        }
+    }
+
+    if (option.rx_buffer_size > 0)
+    {
+        fprint_family(fp, "tio_rx_buffer_high_water_bytes", "gauge", "Highest fill level of receive buffer");
+        FPRINT_METRIC(fp, "tio_rx_buffer_high_water_bytes", "%zu", sample->rx_buffer_high_water);
+        fprint_family(fp, "tio_rx_buffer_full_total", "counter", "Times receive buffer was full");
+        FPRINT_METRIC(fp, "tio_rx_buffer_full_total", "%lu", sample->rx_buffer_full);
+    }
+
+    if (option.socket)
+    {
+        fprint_family(fp, "tio_socket_clients", "gauge", "Connected socket clients");
+        FPRINT_METRIC(fp, "tio_socket_clients", "%d", sample->socket_clients);
+        fprint_family(fp, "tio_socket_queued_bytes", "gauge", "Output queued for socket clients");
+        FPRINT_METRIC(fp, "tio_socket_queued_bytes", "%zu", sample->socket_queued);
+        fprint_family(fp, "tio_socket_queued_max_bytes", "gauge", "Output queued for slowest socket client");
+        FPRINT_METRIC(fp, "tio_socket_queued_max_bytes", "%zu", sample->socket_queued_max);
+    }
+
+    if (option.log)
+    {
+        fprint_family(fp, "tio_log_writes_total", "counter", "Writes to log file");
+        FPRINT_METRIC(fp, "tio_log_writes_total", "%lu", sample->log_writes);
+        fprint_family(fp, "tio_log_write_seconds_total", "counter", "Time spent writing log file");
+        FPRINT_METRIC(fp, "tio_log_write_seconds_total", "%.9f", sample->log_write_ns_total / 1e9);
+        fprint_family(fp, "tio_log_write_max_seconds", "gauge", "Longest write to log file");
+        FPRINT_METRIC(fp, "tio_log_write_max_seconds", "%.9f", sample->log_write_ns_max / 1e9);
+        fprint_family(fp, "tio_log_dropped_bytes_total", "counter", "Log bytes dropped due to full log buffer");
+        FPRINT_METRIC(fp, "tio_log_dropped_bytes_total", "%lu", sample->log_dropped);
+    }
+
+    if ((fclose(fp) != 0) || (rename(tmp_filename, option.stats_filename) != 0))
+    {
+        warning_printf("Could not write statistics file %s (%s)", option.stats_filename, strerror(errno));
+    }
+
+    free(tmp_filename);
+}
@@ -0,0 +1,54 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters sampled from other modules and threads when publishing */
+struct stats_sample_t
+{
+    bool connected;
+    bool icount_valid;
+    unsigned long overrun, buf_overrun, frame, parity, brk;
+    size_t rx_buffer_size, rx_buffer_high_water;
+    unsigned long rx_buffer_full;
+    int socket_clients;
+    size_t socket_queued, socket_queued_max;
+    unsigned long log_writes;
+    uint64_t log_write_ns_total, log_write_ns_max;
+    unsigned long log_dropped;
+};
+
+struct stats_t;
+
+struct stats_t *stats_create(const char *label);
+void stats_rx(struct stats_t *stats, size_t count);
+void stats_tx(struct stats_t *stats, size_t count);
+bool stats_tick(void);
+int stats_timeout(void);
+bool stats_interval_due(void);
+void stats_print(struct stats_t *stats, const struct stats_sample_t *sample);
+void stats_print_status(struct stats_t *stats);
+void stats_print_wakeups(void);
+void stats_file_write(const struct stats_sample_t *samples);
@@ -0,0 +1,569 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+/*
+ * File transfer
+ *
+ * The file is mapped into memory and sent either as is (raw) or framed as
+ * XMODEM, 128 byte blocks, or YMODEM, 1024 byte blocks preceded by a block
+ * announcing name and size, with CRC-16 or checksum as the receiver asks.
+ *
+ * The transfer runs inside the event loop: transfer_peek() hands out what
+ * is to be written next, which the caller writes without blocking and
+ * reports with transfer_consume(), responses of the receiver are fed to
+ * transfer_receive() and transfer_poll() handles timeouts. Raw data is
+ * written straight from the mapping in large chunks, framed data one block
+ * at a time as each is acknowledged.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "print.h"
+#include "transfer.h"
+
+#define SOH 0x01
+#define STX 0x02
+#define EOT 0x04
+#define ACK 0x06
+#define NAK 0x15
+#define CAN 0x18
+#define CPMEOF 0x1a
+#define CRC_REQUEST 'C'
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Raw bytes handed out per write */
+#define TRANSFER_CHUNK_SIZE (64*1024)
+
+/* Receiver response timeouts (s), retries per block and progress interval (s) */
+#define TRANSFER_START_TIMEOUT 60
+#define TRANSFER_ACK_TIMEOUT 10
+#define TRANSFER_RETRY_MAX 10
+#define TRANSFER_PROGRESS_INTERVAL 1
+
+#define TRANSFER_CANCEL_COUNT 8
+
+enum transfer_state_t
+{
+    TRANSFER_WAIT_START,
+    TRANSFER_SEND,
+    TRANSFER_WAIT_ACK,
+    TRANSFER_DONE,
+    TRANSFER_FAILED,
+};
+
+/* Packet sent in framed protocols */
+enum transfer_stage_t
+{
+    STAGE_HEADER,
+    STAGE_DATA,
+    STAGE_END,
+    STAGE_TRAILER,
+    STAGE_CANCEL,
+};
+
+struct transfer_t
+{
+    enum transfer_protocol_t protocol;
+    char *filename;
+    const char *map;
+    size_t size;
+    time_t mtime;
+    size_t position;
+    enum transfer_state_t state;
+    enum transfer_stage_t stage;
+    bool crc;
+    unsigned char block;
+    int retries;
+    int cancels;
+    const char *failure;
+    uint64_t deadline;
+    uint64_t started;
+    uint64_t progress_time;
+    bool progress_shown;
+    char packet[3 + 1024 + 2];
+    size_t packet_length;
+    size_t packet_sent;
+    size_t packet_data;
+};
+
+static const char *protocol_names[] = { "raw", "XMODEM", "YMODEM" };
+
+static uint16_t crc_table[256];
+
+static void transfer_crc_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t crc = i << 8;
+
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+/* CRC-16/XMODEM (polynomial 0x1021, initial value 0) */
+static uint16_t transfer_crc16(const unsigned char *data, size_t count)
+{
+    uint16_t crc = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        crc = (crc << 8) ^ crc_table[(crc >> 8) ^ data[i]];
+    }
+
+    return crc;
+}
+
+/* Frame data as block of given size, padded with pad characters */
+static void transfer_block(struct transfer_t *transfer, const char *data, size_t count, size_t size, char pad)
+{
+    unsigned char *packet = (unsigned char *) transfer->packet;
+    unsigned char *payload = packet + 3;
+
+    packet[0] = (size == 1024) ? STX : SOH;
+    packet[1] = transfer->block;
+    packet[2] = ~transfer->block;
+    memcpy(payload, data, count);
+    memset(payload + count, pad, size - count);
+
+    if (transfer->crc)
+    {
+        uint16_t crc = transfer_crc16(payload, size);
+
+        payload[size] = crc >> 8;
+        payload[size + 1] = crc & 0xff;
+        transfer->packet_length = 3 + size + 2;
+    }
+    else
+    {
+        unsigned char checksum = 0;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            checksum += payload[i];
+        }
+        payload[size] = checksum;
+        transfer->packet_length = 3 + size + 1;
+    }
+
+    transfer->packet_data = count;
+}
+
+/* Prepare packet of current stage for sending */
+static void transfer_packet(struct transfer_t *transfer)
+{
+    char header[1024] = {};
+    size_t remaining = transfer->size - transfer->position;
+    size_t size, length;
+
+    switch (transfer->stage)
+    {
+        case STAGE_HEADER:
+            /* Block 0: name, NUL, decimal size and octal modification time */
+            length = snprintf(header, sizeof(header) - 1, "%s", transfer->filename) + 1;
+            length += snprintf(header + length, sizeof(header) - length, "%zu %lo",
+                               transfer->size, (unsigned long) transfer->mtime);
+            transfer->block = 0;
+            transfer_block(transfer, header, MIN(length, sizeof(header)), (length < 128) ? 128 : 1024, 0);
+            break;
+
+        case STAGE_DATA:
+            size = ((transfer->protocol == TRANSFER_YMODEM) && (remaining > 128)) ? 1024 : 128;
+            transfer_block(transfer, transfer->map + transfer->position, MIN(remaining, size), size, CPMEOF);
+            break;
+
+        case STAGE_END:
+            transfer->packet[0] = EOT;
+            transfer->packet_length = 1;
+            transfer->packet_data = 0;
+            break;
+
+        case STAGE_TRAILER:
+            /* Empty block 0 ends batch */
+            transfer->block = 0;
+            transfer_block(transfer, header, 0, 128, 0);
+            break;
+
+        case STAGE_CANCEL:
+            memset(transfer->packet, CAN, TRANSFER_CANCEL_COUNT);
+            transfer->packet_length = TRANSFER_CANCEL_COUNT;
+            transfer->packet_data = 0;
+            break;
+    }
+
+    transfer->packet_sent = 0;
+    transfer->state = TRANSFER_SEND;
+}
+
+static void transfer_wait_start(struct transfer_t *transfer, enum transfer_stage_t stage, uint64_t now, int timeout)
+{
+    transfer->stage = stage;
+    transfer->state = TRANSFER_WAIT_START;
+    transfer->deadline = now + timeout * NSEC_PER_SEC;
+}
+
+/* Advance to next packet once receiver acknowledged current one */
+static void transfer_acknowledged(struct transfer_t *transfer, uint64_t now)
+{
+    transfer->retries = 0;
+
+    switch (transfer->stage)
+    {
+        case STAGE_HEADER:
+            /* Receiver asks for data blocks anew */
+            transfer->block = 1;
+            transfer_wait_start(transfer, (transfer->size > 0) ? STAGE_DATA : STAGE_END, now, TRANSFER_ACK_TIMEOUT);
+            break;
+
+        case STAGE_DATA:
+            transfer->position += transfer->packet_data;
+            transfer->block++;
+            if (transfer->position == transfer->size)
+            {
+                transfer->stage = STAGE_END;
+            }
+            transfer_packet(transfer);
+            break;
+
+        case STAGE_END:
+            if (transfer->protocol == TRANSFER_YMODEM)
+            {
+                transfer_wait_start(transfer, STAGE_TRAILER, now, TRANSFER_ACK_TIMEOUT);
+            }
+            else
+            {
+                transfer->state = TRANSFER_DONE;
+            }
+            break;
+
+        case STAGE_TRAILER:
+            transfer->state = TRANSFER_DONE;
+            break;
+
+        case STAGE_CANCEL:
+            break;
+    }
+}
+
+/* Send current packet again, until retries are exhausted */
+static void transfer_retry(struct transfer_t *transfer)
+{
+    if (++transfer->retries > TRANSFER_RETRY_MAX)
+    {
+        transfer_cancel(transfer, "Too many retries");
+        return;
+    }
+
+    transfer->packet_sent = 0;
+    transfer->state = TRANSFER_SEND;
+}
+
+struct transfer_t *transfer_open(const char *filename, enum transfer_protocol_t protocol, uint64_t now)
+{
+    struct transfer_t *transfer;
+    struct stat st;
+    char *name;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        warning_printf("Could not open %s (%s)", filename, strerror(errno));
+        return NULL;
+    }
+
+    if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode))
+    {
+        warning_printf("Could not send %s (not a regular file)", filename);
+        close(fd);
+        return NULL;
+    }
+
+    transfer = calloc(1, sizeof(struct transfer_t));
+    if (transfer == NULL)
+    {
+        error_printf("Insufficient memory allocation");
+        exit(EXIT_FAILURE);
+    }
+
+    transfer->size = st.st_size;
+    transfer->mtime = st.st_mtime;
+    if (transfer->size > 0)
+    {
+        void *map = mmap(NULL, transfer->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            warning_printf("Could not map %s (%s)", filename, strerror(errno));
+            close(fd);
+            free(transfer);
+            return NULL;
+        }
+        madvise(map, transfer->size, MADV_SEQUENTIAL);
+        transfer->map = map;
+    }
+    close(fd);
+
+    name = strdup(filename);
+    transfer->filename = strdup(basename(name));
+    free(name);
+
+    if (crc_table[1] == 0)
+    {
+        transfer_crc_init();
+    }
+
+    transfer->protocol = protocol;
+    transfer->started = now;
+    transfer->progress_time = now + TRANSFER_PROGRESS_INTERVAL * NSEC_PER_SEC;
+
+    if (protocol == TRANSFER_RAW)
+    {
+        transfer->state = (transfer->size > 0) ? TRANSFER_SEND : TRANSFER_DONE;
+        tio_printf("Sending %s (%zu bytes)", transfer->filename, transfer->size);
+    }
+    else
+    {
+        transfer->block = 1;
+        transfer_wait_start(transfer, (protocol == TRANSFER_YMODEM) ? STAGE_HEADER : STAGE_DATA, now,
+                            TRANSFER_START_TIMEOUT);
+        if ((protocol == TRANSFER_XMODEM) && (transfer->size == 0))
+        {
+            transfer->stage = STAGE_END;
+        }
+        tio_printf("Sending %s (%zu bytes) using %s, waiting for receiver", transfer->filename,
+                   transfer->size, protocol_names[protocol]);
+    }
+
+    return transfer;
+}
+
+/* Data to write next, none while waiting for the receiver */
+size_t transfer_peek(struct transfer_t *transfer, const char **buffer)
+{
+    if (transfer->state != TRANSFER_SEND)
+    {
+        return 0;
+    }
+
+    if (transfer->protocol == TRANSFER_RAW)
+    {
+        *buffer = transfer->map + transfer->position;
+        return MIN(transfer->size - transfer->position, (size_t) TRANSFER_CHUNK_SIZE);
+    }
+
+    *buffer = transfer->packet + transfer->packet_sent;
+    return transfer->packet_length - transfer->packet_sent;
+}
+
+void transfer_consume(struct transfer_t *transfer, size_t count, uint64_t now)
+{
+    if (transfer->protocol == TRANSFER_RAW)
+    {
+        transfer->position += count;
+        if (transfer->position == transfer->size)
+        {
+            transfer->state = TRANSFER_DONE;
+        }
+        return;
+    }
+
+    transfer->packet_sent += count;
+    if (transfer->packet_sent == transfer->packet_length)
+    {
+        if (transfer->stage == STAGE_CANCEL)
+        {
+            transfer->state = TRANSFER_FAILED;
+            return;
+        }
+        transfer->state = TRANSFER_WAIT_ACK;
+        transfer->deadline = now + TRANSFER_ACK_TIMEOUT * NSEC_PER_SEC;
+    }
+}
+
+/* Handle responses of receiver */
+void transfer_receive(struct transfer_t *transfer, const char *buffer, size_t count, uint64_t now)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned char c = buffer[i];
+
+        if (c == CAN)
+        {
+            /* Receiver cancels with two consecutive CAN */
+            if ((++transfer->cancels >= 2) && (transfer->state < TRANSFER_DONE))
+            {
+                transfer->failure = "Cancelled by receiver";
+                transfer->state = TRANSFER_FAILED;
+            }
+            continue;
+        }
+        transfer->cancels = 0;
+
+        switch (transfer->state)
+        {
+            case TRANSFER_WAIT_START:
+                if ((c == CRC_REQUEST) || (c == NAK))
+                {
+                    transfer->crc = (c == CRC_REQUEST);
+                    transfer_packet(transfer);
+                }
+                break;
+
+            case TRANSFER_WAIT_ACK:
+                if (c == ACK)
+                {
+                    transfer_acknowledged(transfer, now);
+                }
+                else if (c == NAK)
+                {
+                    transfer_retry(transfer);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+/* Handle receiver timeouts and print progress */
+void transfer_poll(struct transfer_t *transfer, uint64_t now)
+{
+    if (((transfer->state == TRANSFER_WAIT_START) || (transfer->state == TRANSFER_WAIT_ACK)) &&
+        (now >= transfer->deadline))
+    {
+        if (transfer->state == TRANSFER_WAIT_START)
+        {
+            transfer_cancel(transfer, "No response from receiver");
+        }
+        else
+        {
+            transfer_retry(transfer);
+        }
+    }
+
+    if ((now >= transfer->progress_time) && (transfer->state < TRANSFER_DONE))
+    {
+        double seconds = (double) (now - transfer->started) / NSEC_PER_SEC;
+
+        /* Progress line is updated in place */
+        if (print_tainted && !transfer->progress_shown)
+        {
+            putchar('\n');
+        }
+        ansi_printf_raw("\r[%s] Sent %zu/%zu KiB (%3d%%), %8.1f KiB/s", current_time(),
+                        transfer->position / 1024, transfer->size / 1024,
+                        (int) ((transfer->position * 100.0) / MAX(transfer->size, (size_t) 1)),
+                        transfer->position / 1024.0 / seconds);
+        fflush(stdout);
+        print_tainted = true;
+        transfer->progress_shown = true;
+        transfer->progress_time = now + TRANSFER_PROGRESS_INTERVAL * NSEC_PER_SEC;
+    }
+}
+
+/* Time until next timeout or progress update (ms) */
+int transfer_timeout(struct transfer_t *transfer, uint64_t now)
+{
+    uint64_t deadline;
+
+    if (transfer == NULL)
+    {
+        return -1;
+    }
+
+    deadline = transfer->progress_time;
+    if ((transfer->state == TRANSFER_WAIT_START) || (transfer->state == TRANSFER_WAIT_ACK))
+    {
+        deadline = MIN(deadline, transfer->deadline);
+    }
+
+    return (deadline <= now) ? 0 : (int) ((deadline - now + 999999) / 1000000);
+}
+
+/* Stop transfer, framed transfers tell the receiver first */
+void transfer_cancel(struct transfer_t *transfer, const char *reason)
+{
+    if (transfer->state >= TRANSFER_DONE)
+    {
+        return;
+    }
+
+    transfer->failure = reason;
+
+    if ((transfer->protocol == TRANSFER_RAW) || (transfer->stage == STAGE_CANCEL))
+    {
+        transfer->state = TRANSFER_FAILED;
+        return;
+    }
+
+    transfer->stage = STAGE_CANCEL;
+    transfer_packet(transfer);
+}
+
+/* Received data is consumed by protocol */
+bool transfer_framed(struct transfer_t *transfer)
+{
+    return transfer->protocol != TRANSFER_RAW;
+}
+
+bool transfer_done(struct transfer_t *transfer)
+{
+    return transfer->state >= TRANSFER_DONE;
+}
+
+/* Report outcome and release transfer */
+void transfer_close(struct transfer_t *transfer, uint64_t now)
+{
+    double seconds = (double) (now - transfer->started) / NSEC_PER_SEC;
+
+    if (transfer->state == TRANSFER_DONE)
+    {
+        tio_printf("Sent %s: %zu bytes in %.1f s (%.1f KiB/s)", transfer->filename, transfer->size, seconds,
+                   (seconds > 0) ? transfer->size / 1024.0 / seconds : 0);
+    }
+    else
+    {
+        tio_printf("Sending %s failed after %zu bytes: %s", transfer->filename, transfer->position,
+                   transfer->failure ? transfer->failure : "Interrupted");
+    }
+
+    if (transfer->map != NULL)
+    {
+        munmap((void *) transfer->map, transfer->size);
+    }
+    free(transfer->filename);
+    free(transfer);
+}
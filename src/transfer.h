@@ -0,0 +1,47 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum transfer_protocol_t
+{
+    TRANSFER_RAW,
+    TRANSFER_XMODEM,
+    TRANSFER_YMODEM,
+};
+
+struct transfer_t;
+
+struct transfer_t *transfer_open(const char *filename, enum transfer_protocol_t protocol, uint64_t now);
+size_t transfer_peek(struct transfer_t *transfer, const char **buffer);
+void transfer_consume(struct transfer_t *transfer, size_t count, uint64_t now);
+void transfer_receive(struct transfer_t *transfer, const char *buffer, size_t count, uint64_t now);
+void transfer_poll(struct transfer_t *transfer, uint64_t now);
+int transfer_timeout(struct transfer_t *transfer, uint64_t now);
+void transfer_cancel(struct transfer_t *transfer, const char *reason);
+bool transfer_framed(struct transfer_t *transfer);
+bool transfer_done(struct transfer_t *transfer);
+void transfer_close(struct transfer_t *transfer, uint64_t now);
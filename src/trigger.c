@@ -0,0 +1,350 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+/*
+ * Triggers
+ *
+ * Each trigger is configured as "<pattern> => <action> [<argument>]" and
+ * fires its action whenever the pattern is received. All patterns are
+ * compiled into one Aho-Corasick automaton with its failure transitions
+ * folded into a full transition table, so scanning costs one table lookup
+ * per received byte regardless of the number of patterns, and matches
+ * spanning several reads are found as the state is kept per device.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "misc.h"
+#include "trigger.h"
+
+#define TRIGGER_STATES_MAX UINT16_MAX
+
+static struct trigger_t *triggers = NULL;
+static int triggers_count = 0;
+
+/* Automaton: transitions of each state and triggers matching in it */
+static uint16_t *transitions = NULL;
+static unsigned int *hits_start = NULL;
+static unsigned int *hits_count = NULL;
+static unsigned int *hits = NULL;
+
+static char *trigger_trim(char *text)
+{
+    char *end;
+
+    while (isspace((unsigned char) *text))
+    {
+        text++;
+    }
+
+    end = text + strlen(text);
+    while ((end > text) && isspace((unsigned char) end[-1]))
+    {
+        *--end = 0;
+    }
+
+    return text;
+}
+
+/* Parse and add trigger of the form "<pattern> => <action> [<argument>]" */
+void trigger_add(const char *spec)
+{
+    struct trigger_t trigger = {};
+    char *buffer, *separator, *pattern, *action, *argument;
+    struct trigger_t *p;
+
+    buffer = strdup(spec);
+    separator = strstr(buffer, "=>");
+    if (separator == NULL)
+    {
+        printf("Error: Invalid trigger %s, must be of the form <pattern> => <action>\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    *separator = 0;
+
+    pattern = trigger_trim(buffer);
+    action = trigger_trim(separator + 2);
+    argument = action + strcspn(action, " \t");
+    if (*argument != 0)
+    {
+        *argument++ = 0;
+        argument = trigger_trim(argument);
+    }
+
+    trigger.name = strdup(pattern);
+    trigger.pattern = string_unescape(pattern, &trigger.length);
+    if (trigger.length == 0)
+    {
+        printf("Error: Invalid trigger %s, pattern is empty\n", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(action, "highlight") == 0)
+    {
+        trigger.action = TRIGGER_HIGHLIGHT;
+    }
+    else if (strcmp(action, "marker") == 0)
+    {
+        trigger.action = TRIGGER_MARKER;
+    }
+    else if (strcmp(action, "send") == 0)
+    {
+        trigger.action = TRIGGER_SEND;
+        trigger.argument = string_unescape(argument, &trigger.argument_length);
+    }
+    else if (strcmp(action, "toggle") == 0)
+    {
+        trigger.action = TRIGGER_TOGGLE;
+        if (strcasecmp(argument, "DTR") == 0)
+        {
+            trigger.line = TIOCM_DTR;
+            trigger.argument = "DTR";
+        }
+        else if (strcasecmp(argument, "RTS") == 0)
+        {
+            trigger.line = TIOCM_RTS;
+            trigger.argument = "RTS";
+        }
+        else
+        {
+            printf("Error: Invalid trigger line %s, must be DTR or RTS\n", argument);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (strcmp(action, "hook") == 0)
+    {
+        trigger.action = TRIGGER_HOOK;
+        if (*argument == 0)
+        {
+            printf("Error: Invalid trigger %s, hook command is missing\n", spec);
+            exit(EXIT_FAILURE);
+        }
+        trigger.argument = strdup(argument);
+    }
+    else
+    {
+        printf("Error: Invalid trigger action %s\n", action);
+        exit(EXIT_FAILURE);
+    }
+
+    free(buffer);
+
+    p = realloc(triggers, (triggers_count + 1) * sizeof(struct trigger_t));
+    if (p == NULL)
+    {
+        printf("Error: Insufficient memory allocation for trigger\n");
+        exit(EXIT_FAILURE);
+    }
+    triggers = p;
+    triggers[triggers_count++] = trigger;
+}
+
+bool trigger_enabled(void)
+{
+    return triggers_count > 0;
+}
+
+/* Build automaton of all triggers added */
+void trigger_compile(void)
+{
+    size_t states_max = 1;
+    unsigned int states = 1;
+    unsigned int *failure, *queue, *own, *own_next;
+    unsigned int head = 0, tail = 0, total = 0;
+
+    if (triggers_count == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < triggers_count; i++)
+    {
+        states_max += triggers[i].length;
+    }
+    if (states_max > TRIGGER_STATES_MAX)
+    {
+        printf("Error: Trigger patterns too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    transitions = calloc(states_max * 256, sizeof(uint16_t));
+    failure = calloc(states_max, sizeof(unsigned int));
+    queue = calloc(states_max, sizeof(unsigned int));
+    own = calloc(states_max, sizeof(unsigned int));
+    own_next = calloc(triggers_count, sizeof(unsigned int));
+    hits_start = calloc(states_max, sizeof(unsigned int));
+    hits_count = calloc(states_max, sizeof(unsigned int));
+    if (!transitions || !failure || !queue || !own || !own_next || !hits_start || !hits_count)
+    {
+        printf("Error: Insufficient memory allocation for triggers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Trie of patterns, state 0 is the root. Triggers ending in a state
+     * are kept as list (own, own_next) with indices offset by one */
+    for (int i = 0; i < triggers_count; i++)
+    {
+        unsigned int state = 0;
+
+        for (size_t j = 0; j < triggers[i].length; j++)
+        {
+            uint16_t *next = &transitions[state * 256 + (unsigned char) triggers[i].pattern[j]];
+            if (*next == 0)
+            {
+                *next = states++;
+            }
+            state = *next;
+        }
+        own_next[i] = own[state];
+        own[state] = i + 1;
+    }
+
+    /* Breadth first, complete missing transitions with those of the
+     * failure state, which is always closer to the root */
+    queue[tail++] = 0;
+    while (head < tail)
+    {
+        unsigned int state = queue[head++];
+
+        for (int c = 0; c < 256; c++)
+        {
+            uint16_t *next = &transitions[state * 256 + c];
+
+            /* Rows still hold trie edges only when their state is visited */
+            if (*next != 0)
+            {
+                failure[*next] = (state == 0) ? 0 : transitions[failure[state] * 256 + c];
+                queue[tail++] = *next;
+                continue;
+            }
+            *next = (state == 0) ? 0 : transitions[failure[state] * 256 + c];
+        }
+    }
+
+    /* Triggers matching in a state are its own and those of its failure
+     * state, laid out in breadth first order so the latter exist already */
+    for (unsigned int i = 0; i < tail; i++)
+    {
+        unsigned int state = queue[i];
+
+        for (unsigned int t = own[state]; t != 0; t = own_next[t - 1])
+        {
+            hits_count[state]++;
+        }
+        if (state != 0)
+        {
+            hits_count[state] += hits_count[failure[state]];
+        }
+        total += hits_count[state];
+    }
+
+    hits = calloc(total + 1, sizeof(unsigned int));
+    if (hits == NULL)
+    {
+        printf("Error: Insufficient memory allocation for triggers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    total = 0;
+    for (unsigned int i = 0; i < tail; i++)
+    {
+        unsigned int state = queue[i];
+        unsigned int n = 0;
+
+        hits_start[state] = total;
+        for (unsigned int t = own[state]; t != 0; t = own_next[t - 1])
+        {
+            hits[total + n++] = t - 1;
+        }
+        if (state != 0)
+        {
+            memcpy(&hits[total + n], &hits[hits_start[failure[state]]], hits_count[failure[state]] * sizeof(unsigned int));
+        }
+        total += hits_count[state];
+    }
+
+    free(failure);
+    free(queue);
+    free(own);
+    free(own_next);
+}
+
+/* Scan buffer from position for the next match, returns its trigger and
+ * moves position to the end of the match. Patterns ending at the same
+ * position are returned by subsequent calls. */
+const struct trigger_t *trigger_scan(struct trigger_cursor_t *cursor, const char *buffer, size_t count, size_t *position)
+{
+    unsigned int state = cursor->state;
+
+    if (cursor->pending_count > 0)
+    {
+        cursor->pending_count--;
+        return &triggers[hits[cursor->pending++]];
+    }
+
+    for (size_t i = *position; i < count; i++)
+    {
+        state = transitions[state * 256 + (unsigned char) buffer[i]];
+        if (hits_count[state] > 0)
+        {
+            cursor->state = state;
+            cursor->pending = hits_start[state] + 1;
+            cursor->pending_count = hits_count[state] - 1;
+            *position = i + 1;
+            return &triggers[hits[hits_start[state]]];
+        }
+    }
+
+    cursor->state = state;
+    *position = count;
+    return NULL;
+}
+
+/* Run hook command in background, detached so it needs no reaping */
+void trigger_hook(const struct trigger_t *trigger, const char *device)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        if (fork() == 0)
+        {
+            setenv("TIO_DEVICE", device, 1);
+            setenv("TIO_TRIGGER", trigger->name, 1);
+            execl("/bin/sh", "sh", "-c", trigger->argument, (char *) NULL);
+            _exit(127);
+        }
+        _exit(0);
+    }
+    else if (pid > 0)
+    {
+        waitpid(pid, NULL, 0);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * tio - a simple serial terminal I/O tool
+ *
+ * Copyright (c) 2022  Martin Lund
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum trigger_action_t
+{
+    TRIGGER_HIGHLIGHT,
+    TRIGGER_MARKER,
+    TRIGGER_SEND,
+    TRIGGER_TOGGLE,
+    TRIGGER_HOOK,
+};
+
+struct trigger_t
+{
+    const char *name;
+    const char *pattern;
+    size_t length;
+    enum trigger_action_t action;
+    const char *argument;
+    size_t argument_length;
+    int line;
+};
+
+/* Scan position within received data of one device */
+struct trigger_cursor_t
+{
+    unsigned int state;
+    unsigned int pending;
+    unsigned int pending_count;
+};
+
+void trigger_add(const char *spec);
+void trigger_compile(void);
+bool trigger_enabled(void);
+const struct trigger_t *trigger_scan(struct trigger_cursor_t *cursor, const char *buffer, size_t count, size_t *position);
+void trigger_hook(const struct trigger_t *trigger, const char *device);
@@ -19,6 +19,8 @@
  * 02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,9 +38,16 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <errno.h>
 #include <time.h>
 #include <dirent.h>
+#include <poll.h>
+#include <glob.h>
+#include <libgen.h>
+#ifdef HAVE_TIOCGICOUNT
+#include <linux/serial.h>
+#endif
 #include "config.h"
 #include "configfile.h"
 #include "tty.h"
@@ -48,189 +57,469 @@
 #include "log.h"
 #include "error.h"
 #include "socket.h"
+#include "event.h"
+#include "pace.h"
+#include "reader.h"
+#include "capture.h"
+#include "bench.h"
+#include "stats.h"
+#include "monitor.h"
+#include "latency.h"
+#include "hotplug.h"
+#include "splice.h"
+#include "trigger.h"
+#include "script.h"
+#include "signals.h"
+#include "scrollback.h"
+#include "transfer.h"
+#include "profile.h"
 
 #ifdef HAVE_TERMIOS2
 extern int setspeed2(int fd, int baudrate);
+extern void *getattr2(int fd);
+extern int setattr2(int fd, const void *tio);
 #endif
 
 #ifdef HAVE_IOSSIOSPEED
 extern int iossiospeed(int fd, int baudrate);
 #endif
 
-#ifdef __APPLE__
-#define PATH_SERIAL_DEVICES "/dev/"
-#else
-#define PATH_SERIAL_DEVICES "/dev/serial/by-id/"
+/* Retry timing for awaited tty devices (ms) */
+#define TTY_RETRY_DELAY_MIN 10
+#define TTY_RETRY_DELAY_MAX 500
+#define TTY_POLL_INTERVAL 1000
+
+/* Streaming mode buffer size and output drain poll interval (ms) */
+#define TTY_STREAM_BUFFER_SIZE (64*1024)
+#define TTY_DRAIN_INTERVAL 5
+
+/* Prompt line size, lines and bytes of context shown for scrollback search */
+#define TTY_PROMPT_SIZE 256
+#define TTY_SEARCH_CONTEXT 2
+#define TTY_SEARCH_WINDOW 4096
+
+struct tty_t;
+
+/* Receive kernel, processing one block of received data */
+typedef void (*rx_kernel_t)(struct tty_t *tty, const char *buffer, size_t count);
+
+/* Transmit mapping kernel, returns number of bytes written to output */
+typedef size_t (*tx_map_kernel_t)(const char *buffer, size_t count, char *output);
+
+/* State of one connected (or awaited) tty device */
+struct tty_t
+{
+    const char *device;
+    char *label;
+    int fd;
+    bool connected;
+    int last_errno;
+    struct termios tio, tio_old;
+    bool settings_cached;
+#ifdef HAVE_TERMIOS2
+    void *tio2;
+#endif
+    int baudrate;
+    bool standard_baudrate;
+    bool break_on;
+    bool map_i_nl_crnl;
+    bool map_o_cr_nl;
+    bool map_o_nl_crnl;
+    bool map_o_del_bs;
+    int hex_nibble;
+    char tty_buffer[BUFSIZ*2];
+    size_t tty_buffer_count;
+    bool next_timestamp;
+    rx_kernel_t rx_kernel;
+    rx_kernel_t rx_next;
+    rx_kernel_t rx_script_next;
+    rx_kernel_t rx_scrollback_next;
+    struct trigger_cursor_t trigger_cursor;
+    tx_map_kernel_t tx_map;
+#ifdef HAVE_SPLICE
+    bool rx_splice;
 #endif
+    struct stats_t *stats;
+    struct reader_t *reader;
+    struct monitor_t *monitor;
+    struct latency_t *latency;
+    struct hotplug_t *hotplug;
+    bool hotplug_watching;
+    unsigned int retry_delay;
+    uint64_t retry_time;
+    uint64_t rx_left;
+    struct log_t *log;
+    struct capture_t *capture;
+    struct socket_t *socket;
+    struct script_t *script;
+    struct transfer_t *transfer;
+};
 
 bool interactive_mode = true;
 
-static struct termios tio, tio_old, stdout_new, stdout_old, stdin_new, stdin_old;
-static unsigned long rx_total = 0, tx_total = 0;
-static bool connected = false;
+static struct termios tio, stdout_new, stdout_old, stdin_new, stdin_old;
 static bool print_mode = NORMAL;
 static bool standard_baudrate = true;
 static void (*print)(char c);
-static int fd;
+static void (*print_buffer)(const char *buffer, size_t count);
 static bool map_i_nl_crnl = false;
 static bool map_o_cr_nl = false;
 static bool map_o_nl_crnl = false;
 static bool map_o_del_bs = false;
-static char hex_chars[2];
-static unsigned char hex_char_index = 0;
-static char tty_buffer[BUFSIZ*2];
-static size_t tty_buffer_count = 0;
-static char *tty_buffer_write_ptr = tty_buffer;
+static struct tty_t *ttys = NULL;
+static int ttys_count = 0;
+static struct tty_t *tty_active = NULL;
+static struct tty_t *rx_last = NULL;
+static bool rx_line_start = true;
 
-static void optional_local_echo(char c)
+enum tty_prompt_t
 {
-    if (!option.local_echo)
-    {
-        return;
-    }
-    print(c);
-    if (option.log)
-    {
-        log_putc(c);
-    }
-}
+    PROMPT_NONE,
+    PROMPT_SEARCH,
+    PROMPT_SEND,
+};
 
-inline static bool is_valid_hex(char c)
+/* Line entered after ctrl-t f (scrollback search) or ctrl-t x, X, Y (send file) */
+static struct
 {
-    return ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'));
-}
+    enum tty_prompt_t type;
+    char text[TTY_PROMPT_SIZE];
+    size_t length;
+    uint64_t before;
+    enum transfer_protocol_t protocol;
+} prompt;
 
-inline static unsigned char char_to_nibble(char c)
+static void tty_select_kernels(void);
+static int tty_socket_control(void *context, enum socket_control_t control, int value);
+static void tty_socket_input(void *context, const char *buffer, size_t count);
+
+inline static bool is_valid_hex(char c)
 {
-    if(c >= '0' && c <= '9')
-    {
-        return c - '0';
-    }
-    else if (c >= 'a' && c <= 'f')
-    {
-        return c - 'a' + 10;
-    }
-    else if (c >= 'A' && c <= 'F')
-    {
-        return c - 'A' + 10;
-    }
-    else
-    {
-        return 0;
-    }
+    return ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'));
 }
 
-void tty_flush(int fd)
+void tty_flush(struct tty_t *tty)
 {
     ssize_t count;
+    char *buffer = tty->tty_buffer;
 
-    do
+    capture_write(tty->capture, CAPTURE_TX, tty->tty_buffer, tty->tty_buffer_count);
+
+    while (tty->tty_buffer_count > 0)
     {
-        count = write(fd, tty_buffer, tty_buffer_count);
+        count = write(tty->fd, buffer, tty->tty_buffer_count);
         if (count < 0)
         {
+            if ((errno == EAGAIN) || (errno == EINTR))
+            {
+                // Wait until device accepts more output
+                struct pollfd pfd = { .fd = tty->fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
             // Error
             debug_printf("Write error while flushing tty buffer (%s)", strerror(errno));
             break;
         }
-        tty_buffer_count -= count;
+        buffer += count;
+        tty->tty_buffer_count -= count;
     }
-    while (tty_buffer_count > 0);
 
     // Reset
-    tty_buffer_write_ptr = tty_buffer;
-    tty_buffer_count = 0;
+    tty->tty_buffer_count = 0;
 }
 
-ssize_t tty_write(int fd, const void *buffer, size_t count)
+ssize_t tty_write(struct tty_t *tty, const void *buffer, size_t count)
 {
     ssize_t bytes_written = 0;
 
-    if (option.output_delay)
+    if (pace_enabled())
     {
-        // Write byte by byte with output delay
-        for (size_t i=0; i<count; i++)
-        {
-            ssize_t retval = write(fd, buffer, 1);
-            if (retval < 0)
-            {
-                // Error
-                debug_printf("Write error (%s)", strerror(errno));
-                break;
-            }
-            bytes_written += retval;
-            fsync(fd);
-            delay(option.output_delay);
-        }
+        // Write according to output pacing schedule
+        capture_write(tty->capture, CAPTURE_TX, buffer, count);
+        bytes_written = pace_write(tty->fd, buffer, count);
     }
     else
     {
         // Flush tty buffer if too full
-        if ((tty_buffer_count + count) > BUFSIZ)
+        if ((tty->tty_buffer_count + count) > BUFSIZ)
         {
-            tty_flush(fd);
+            tty_flush(tty);
         }
 
         // Copy bytes to tty write buffer
-        memcpy(tty_buffer_write_ptr, buffer, count);
-        tty_buffer_write_ptr += count;
-        tty_buffer_count += count;
+        memcpy(tty->tty_buffer + tty->tty_buffer_count, buffer, count);
+        tty->tty_buffer_count += count;
         bytes_written = count;
     }
 
     return bytes_written;
 }
 
-static void output_hex(char c)
+static void toggle_line(struct tty_t *tty, const char *line_name, int mask)
 {
-    hex_chars[hex_char_index++] = c;
+    int state;
 
-    if (hex_char_index == 2)
+    if (ioctl(tty->fd, TIOCMGET, &state) < 0)
     {
-        unsigned char hex_value = char_to_nibble(hex_chars[0]) << 4 | (char_to_nibble(hex_chars[1]) & 0x0F);
-        hex_char_index = 0;
-
-        optional_local_echo(hex_value);
-
-        ssize_t status = tty_write(fd, &hex_value, 1);
-        if (status < 0)
+        warning_printf("Could not get line state (%s)", strerror(errno));
+    }
+    else
+    {
+        if (state & mask)
         {
-            warning_printf("Could not write to tty device");
+            state &= ~mask;
+            tio_printf("set %s to LOW", line_name);
+        }
+        else
+        {
+            state |= mask;
+            tio_printf("set %s to HIGH", line_name);
+        }
+        if (ioctl(tty->fd, TIOCMSET, &state) < 0)
+        {
+            warning_printf("Could not set line state (%s)", strerror(errno));
         }
         else
         {
-            tx_total++;
+            capture_lines(tty->capture, state);
         }
     }
 }
 
-static void toggle_line(const char *line_name, int mask)
+/* Gather counters kept by other modules and the serial driver */
+static void tty_stats_sample(struct tty_t *tty, struct stats_sample_t *sample)
 {
-    int state;
+    memset(sample, 0, sizeof(struct stats_sample_t));
+
+    sample->connected = tty->connected;
 
-    if (ioctl(fd, TIOCMGET, &state) < 0)
+#ifdef HAVE_TIOCGICOUNT
+    struct serial_icounter_struct icount;
+
+    if (tty->connected && (ioctl(tty->fd, TIOCGICOUNT, &icount) == 0))
     {
-        warning_printf("Could not get line state (%s)", strerror(errno));
+        sample->icount_valid = true;
+        sample->overrun = icount.overrun;
+        sample->buf_overrun = icount.buf_overrun;
+        sample->frame = icount.frame;
+        sample->parity = icount.parity;
+        sample->brk = icount.brk;
     }
-    else
+#endif
+
+    if (tty->reader != NULL)
     {
-        if (state & mask)
+        sample->rx_buffer_size = reader_size(tty->reader);
+        sample->rx_buffer_high_water = reader_high_water(tty->reader);
+        sample->rx_buffer_full = reader_full_count(tty->reader);
+    }
+
+    socket_queue_stats(tty->socket, &sample->socket_clients, &sample->socket_queued, &sample->socket_queued_max);
+    log_write_latency(tty->log, &sample->log_writes, &sample->log_write_ns_total, &sample->log_write_ns_max);
+    sample->log_dropped = log_dropped(tty->log);
+}
+
+/* Publish statistics once per second to status line and statistics file */
+static void tty_stats_publish(void)
+{
+    struct stats_sample_t samples[ttys_count];
+
+    for (int i = 0; i < ttys_count; i++)
+    {
+        tty_stats_sample(&ttys[i], &samples[i]);
+    }
+
+    if (stats_interval_due())
+    {
+        for (int i = 0; i < ttys_count; i++)
         {
-            state &= ~mask;
-            tio_printf("set %s to LOW", line_name);
+            stats_print_status(ttys[i].stats);
         }
-        else
+    }
+
+    if (option.stats_filename)
+    {
+        stats_file_write(samples);
+    }
+}
+
+static void tty_prompt_show(void)
+{
+    static const char *send_labels[] = { "Send file", "Send file (XMODEM)", "Send file (YMODEM)" };
+
+    if (print_tainted)
+    {
+        putchar('\n');
+    }
+    ansi_printf_raw("\r[%s] %s: ", current_time(),
+                    (prompt.type == PROMPT_SEARCH) ? "Search" : send_labels[prompt.protocol]);
+    print_normal_buffer(prompt.text, prompt.length);
+    print_tainted = true;
+}
+
+static void tty_prompt_start(enum tty_prompt_t type, enum transfer_protocol_t protocol)
+{
+    prompt.type = type;
+    prompt.length = 0;
+    prompt.before = scrollback_end();
+    prompt.protocol = protocol;
+    tty_prompt_show();
+}
+
+static void tty_prompt_end(void)
+{
+    tio_printf("%s", (prompt.type == PROMPT_SEARCH) ? "Search ended" : "Send file cancelled");
+    prompt.type = PROMPT_NONE;
+}
+
+/* Show lines around match with pattern highlighted */
+static void tty_search_show(uint64_t match)
+{
+    char buffer[TTY_SEARCH_WINDOW * 2 + TTY_PROMPT_SIZE];
+    uint64_t start = MAX(match - MIN(match, (uint64_t) TTY_SEARCH_WINDOW), scrollback_start());
+    size_t count = scrollback_read(start, buffer, sizeof(buffer));
+    size_t position = match - start;
+    size_t end = position + prompt.length;
+    size_t first = position, last = end;
+    int lines;
+
+    for (lines = 0; first > 0; first--)
+    {
+        if ((buffer[first - 1] == '\n') && (lines++ == TTY_SEARCH_CONTEXT))
         {
-            state |= mask;
-            tio_printf("set %s to HIGH", line_name);
+            break;
         }
-        if (ioctl(fd, TIOCMSET, &state) < 0)
-            warning_printf("Could not set line state (%s)", strerror(errno));
+    }
+    for (lines = 0; last < count; last++)
+    {
+        if ((buffer[last] == '\n') && (lines++ == TTY_SEARCH_CONTEXT))
+        {
+            last++;
+            break;
+        }
+    }
+
+    tio_printf("Match %llu bytes back:", (unsigned long long) (scrollback_end() - match));
+    print_normal_buffer(buffer + first, position - first);
+    if (option.color >= 0)
+    {
+        print_normal_buffer("\e[7m", 4);
+    }
+    print_normal_buffer(buffer + position, prompt.length);
+    if (option.color >= 0)
+    {
+        print_normal_buffer("\e[27m", 5);
+    }
+    print_normal_buffer(buffer + end, last - end);
+    print_tainted = true;
+}
+
+/* Find next older match of search pattern, search continues while matches are found */
+static void tty_search_next(void)
+{
+    uint64_t match;
+
+    if (scrollback_search(prompt.text, prompt.length, prompt.before, &match))
+    {
+        tty_search_show(match);
+        prompt.before = match;
+        tty_prompt_show();
+    }
+    else
+    {
+        tio_printf("No %smatch for %.*s", (prompt.before < scrollback_end()) ? "older " : "",
+                   (int) prompt.length, prompt.text);
+        prompt.type = PROMPT_NONE;
+    }
+}
+
+/* Start sending file entered on the active tty device */
+static void tty_send_file(void)
+{
+    struct tty_t *tty = tty_active;
+
+    prompt.text[prompt.length] = 0;
+    prompt.type = PROMPT_NONE;
+
+    if (!tty->connected)
+    {
+        tio_printf("Not connected");
+        return;
+    }
+
+    /* Output typed so far goes first */
+    tty_flush(tty);
+
+    tty->transfer = transfer_open(prompt.text, prompt.protocol, pace_now());
+}
+
+/* Edit prompt line, enter performs search or send, escape or ctrl-t ends prompt */
+static void tty_prompt_input(char input_char)
+{
+    switch (input_char)
+    {
+        case '\r':
+        case '\n':
+            if (prompt.length == 0)
+            {
+                tty_prompt_end();
+            }
+            else if (prompt.type == PROMPT_SEARCH)
+            {
+                tty_search_next();
+            }
+            else
+            {
+                tty_send_file();
+            }
+            break;
+
+        case '\b':
+        case 127:
+            if (prompt.length > 0)
+            {
+                prompt.length--;
+                prompt.before = scrollback_end();
+                print_normal_buffer("\b \b", 3);
+            }
+            break;
+
+        case '\e':
+        case KEY_CTRL_T:
+            tty_prompt_end();
+            break;
+
+        default:
+            /* Leave room for terminating file name */
+            if (isprint((unsigned char) input_char) && (prompt.length < TTY_PROMPT_SIZE - 1))
+            {
+                prompt.text[prompt.length++] = input_char;
+                prompt.before = scrollback_end();
+                putchar(input_char);
+            }
+            break;
     }
 }
 
+static void tty_scrollback_print(void)
+{
+    char buffer[BUFSIZ];
+    uint64_t offset = scrollback_start();
+    size_t count;
+
+    tio_printf("Scrollback (%llu bytes):", (unsigned long long) (scrollback_end() - offset));
+    while ((count = scrollback_read(offset, buffer, sizeof(buffer))) > 0)
+    {
+        print_normal_buffer(buffer, count);
+        offset += count;
+    }
+    print_tainted = true;
+}
+
 void handle_command_sequence(char input_char, char previous_char, char *output_char, bool *forward)
 {
+    struct tty_t *tty = tty_active;
     char unused_char;
     bool unused_bool;
     int state;
@@ -257,19 +546,34 @@ void handle_command_sequence(char input_char, char previous_char, char *output_c
                 tio_printf(" ctrl-t c   Show configuration");
                 tio_printf(" ctrl-t d   Toggle DTR line");
                 tio_printf(" ctrl-t e   Toggle local echo mode");
+                if (scrollback_enabled())
+                {
+                    tio_printf(" ctrl-t f   Search scrollback");
+                }
                 tio_printf(" ctrl-t h   Toggle hexadecimal mode");
                 tio_printf(" ctrl-t l   Clear screen");
                 tio_printf(" ctrl-t L   Show line states");
+                if (ttys_count > 1)
+                {
+                    tio_printf(" ctrl-t n   Switch to next tty device");
+                }
+                if (scrollback_enabled())
+                {
+                    tio_printf(" ctrl-t p   Print scrollback");
+                }
                 tio_printf(" ctrl-t q   Quit");
                 tio_printf(" ctrl-t r   Toggle RTS line");
                 tio_printf(" ctrl-t s   Show statistics");
                 tio_printf(" ctrl-t t   Send ctrl-t key code");
                 tio_printf(" ctrl-t T   Toggle line timestamp mode");
                 tio_printf(" ctrl-t v   Show version");
+                tio_printf(" ctrl-t x   Send file");
+                tio_printf(" ctrl-t X   Send file using XMODEM");
+                tio_printf(" ctrl-t Y   Send file using YMODEM");
                 break;
 
             case KEY_SHIFT_L:
-                if (ioctl(fd, TIOCMGET, &state) < 0)
+                if (ioctl(tty->fd, TIOCMGET, &state) < 0)
                 {
                     warning_printf("Could not get line state (%s)", strerror(errno));
                     break;
@@ -283,15 +587,15 @@ void handle_command_sequence(char input_char, char previous_char, char *output_c
                 tio_printf(" RI : %s", (state & TIOCM_RI) ? "HIGH" : "LOW");
                 break;
             case KEY_D:
-                toggle_line("DTR", TIOCM_DTR);
+                toggle_line(tty, "DTR", TIOCM_DTR);
                 break;
 
             case KEY_R:
-                toggle_line("RTS", TIOCM_RTS);
+                toggle_line(tty, "RTS", TIOCM_RTS);
                 break;
 
             case KEY_B:
-                tcsendbreak(fd, 0);
+                tcsendbreak(tty->fd, 0);
                 break;
 
             case KEY_C:
@@ -310,12 +614,14 @@ void handle_command_sequence(char input_char, char previous_char, char *output_c
                 if (print_mode == NORMAL)
                 {
                     print = print_hex;
+                    print_buffer = option.hex_dump ? print_hex_dump_buffer : print_hex_buffer;
                     print_mode = HEX;
                     tio_printf("Switched to hexadecimal mode");
                 }
                 else
                 {
                     print = print_normal;
+                    print_buffer = print_normal_buffer;
                     print_mode = NORMAL;
                     tio_printf("Switched to normal mode");
                 }
@@ -326,15 +632,64 @@ void handle_command_sequence(char input_char, char previous_char, char *output_c
                 printf("\033c");
                 break;
 
+            case KEY_N:
+                /* Switch keyboard input to next tty device */
+                if (ttys_count > 1)
+                {
+                    tty_active = &ttys[(tty_active - ttys + 1) % ttys_count];
+                    tio_printf("Switched to tty device %s", tty_active->device);
+                }
+                break;
+
+            case KEY_F:
+                if (!scrollback_enabled())
+                {
+                    tio_printf("Scrollback not enabled");
+                    break;
+                }
+                tty_prompt_start(PROMPT_SEARCH, TRANSFER_RAW);
+                break;
+
+            case KEY_X:
+            case KEY_SHIFT_X:
+            case KEY_SHIFT_Y:
+                if (tty->transfer != NULL)
+                {
+                    transfer_cancel(tty->transfer, "Cancelled");
+                    break;
+                }
+                tty_prompt_start(PROMPT_SEND, (input_char == KEY_X) ? TRANSFER_RAW :
+                                 (input_char == KEY_SHIFT_X) ? TRANSFER_XMODEM : TRANSFER_YMODEM);
+                break;
+
+            case KEY_P:
+                if (!scrollback_enabled())
+                {
+                    tio_printf("Scrollback not enabled");
+                    break;
+                }
+                tty_scrollback_print();
+                break;
+
             case KEY_Q:
                 /* Exit upon ctrl-t q sequence */
                 exit(EXIT_SUCCESS);
 
             case KEY_S:
-                /* Show tx/rx statistics upon ctrl-t s sequence */
+                /* Show statistics upon ctrl-t s sequence */
                 tio_printf("Statistics:");
-                tio_printf(" Sent %lu bytes", tx_total);
-                tio_printf(" Received %lu bytes", rx_total);
+                for (int i = 0; i < ttys_count; i++)
+                {
+                    struct stats_sample_t sample;
+
+                    if (ttys_count > 1)
+                    {
+                        tio_printf(" %s:", ttys[i].label);
+                    }
+                    tty_stats_sample(&ttys[i], &sample);
+                    stats_print(ttys[i].stats, &sample);
+                }
+                stats_print_wakeups();
                 break;
 
             case KEY_T:
@@ -376,6 +731,9 @@ void handle_command_sequence(char input_char, char previous_char, char *output_c
                 /* Ignore unknown ctrl-t escaped keys */
                 break;
         }
+
+        /* Key command may have changed how data is processed */
+        tty_select_kernels();
     }
 }
 
@@ -419,6 +777,7 @@ void stdin_configure(void)
 
 void stdout_restore(void)
 {
+    print_flush();
     tcsetattr(STDOUT_FILENO, TCSANOW, &stdout_old);
 }
 
@@ -426,10 +785,6 @@ void stdout_configure(void)
 {
     int status;
 
-    /* Disable line buffering in stdout. This is necessary if we
-     * want things like local echo to work correctly. */
-    setvbuf(stdout, NULL, _IONBF, 0);
-
     /* Save current stdout settings */
     if (tcgetattr(STDOUT_FILENO, &stdout_old) < 0)
     {
@@ -457,11 +812,69 @@ void stdout_configure(void)
 
     /* At start use normal print function */
     print = print_normal;
+    print_buffer = print_normal_buffer;
 
     /* Make sure we restore old stdout settings on exit */
     atexit(&stdout_restore);
 }
 
+static void tty_add_device(const char *device)
+{
+    struct tty_t *tty;
+    char *name;
+
+    tty = realloc(ttys, (ttys_count + 1) * sizeof(struct tty_t));
+    if (tty == NULL)
+    {
+        error_printf("Insufficient memory allocation for tty device");
+        exit(EXIT_FAILURE);
+    }
+    ttys = tty;
+    tty = &ttys[ttys_count++];
+
+    memset(tty, 0, sizeof(struct tty_t));
+    tty->device = device;
+    tty->fd = -1;
+    tty->tio = tio;
+    tty->baudrate = option.baudrate;
+    tty->standard_baudrate = standard_baudrate;
+    tty->map_i_nl_crnl = map_i_nl_crnl;
+    tty->map_o_cr_nl = map_o_cr_nl;
+    tty->map_o_nl_crnl = map_o_nl_crnl;
+    tty->map_o_del_bs = map_o_del_bs;
+    tty->rx_left = UINT64_MAX;
+    tty->hex_nibble = -1;
+
+    name = strdup(device);
+    tty->label = strdup(basename(name));
+    free(name);
+
+    tty->stats = stats_create(tty->label);
+}
+
+static void tty_add_devices(const char *pattern)
+{
+    glob_t matches;
+
+    if (strpbrk(pattern, "*?[") == NULL)
+    {
+        tty_add_device(pattern);
+        return;
+    }
+
+    if (glob(pattern, 0, NULL, &matches) != 0)
+    {
+        error_printf("No tty device matches %s", pattern);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Matches are kept for the lifetime of the process */
+    for (size_t i = 0; i < matches.gl_pathc; i++)
+    {
+        tty_add_device(matches.gl_pathv[i]);
+    }
+}
+
 void tty_configure(void)
 {
     bool token_found = true;
@@ -659,47 +1072,233 @@ void tty_configure(void)
         }
     }
     free(buffer);
+
+    /* Create device contexts, tty device names may be glob patterns */
+    tty_add_devices(option.tty_device);
+    for (int i = 0; i < option.extra_tty_devices_count; i++)
+    {
+        tty_add_devices(option.extra_tty_devices[i]);
+    }
+    tty_active = &ttys[0];
+
+    if (option.script_filename != NULL)
+    {
+        tty_active->script = script_load(option.script_filename);
+    }
+
+    if (option.scrollback_size > 0)
+    {
+        scrollback_init(option.scrollback_size, option.scrollback_compress);
+    }
+
+    trigger_compile();
 }
 
-void tty_wait_for_device(void)
+void tty_log_open(void)
 {
-    fd_set rdfs;
-    int    status;
-    int    maxfd;
-    struct timeval tv;
-    static char input_char, previous_char = 0;
-    static bool first = true;
-    static int last_errno = 0;
-
-    /* Loop until device pops up */
-    while (true)
+    for (int i = 0; i < ttys_count; i++)
     {
-        if (first)
+        char *filename = NULL;
+
+        /* Further devices log to numbered files */
+        if ((option.log_filename != NULL) && (i > 0))
         {
-            /* Don't wait first time */
-            tv.tv_sec = 0;
-            tv.tv_usec = 1;
-            first = false;
+            asprintf(&filename, "%s.%d", option.log_filename, i);
         }
-        else
+
+        ttys[i].log = log_open(filename ? filename : option.log_filename, ttys[i].device);
+        free(filename);
+    }
+
+    if (ttys_count == 1)
+    {
+        option.log_filename = log_filename(ttys[0].log);
+    }
+}
+
+void tty_capture_open(void)
+{
+    for (int i = 0; i < ttys_count; i++)
+    {
+        char *filename = NULL;
+
+        /* Further devices capture to numbered files */
+        if (i > 0)
         {
-            /* Wait up to 1 second */
-            tv.tv_sec = 1;
-            tv.tv_usec = 0;
+            asprintf(&filename, "%s.%d", option.capture_filename, i);
         }
 
-        FD_ZERO(&rdfs);
-        FD_SET(STDIN_FILENO, &rdfs);
-        maxfd = MAX(STDIN_FILENO, socket_add_fds(&rdfs, false));
+        ttys[i].capture = capture_open(filename ? filename : option.capture_filename);
+        free(filename);
+    }
+}
 
-        /* Block until input becomes available or timeout */
-        status = select(maxfd + 1, &rdfs, NULL, NULL, &tv);
-        if (status > 0)
+void tty_socket_configure(void)
+{
+    for (int i = 0; i < ttys_count; i++)
+    {
+        if (ttys_count > 1)
         {
-            if (FD_ISSET(STDIN_FILENO, &rdfs))
-            {
-                /* Input from stdin ready */
-
+            tio_printf("Socket for tty device %s:", ttys[i].device);
+        }
+        ttys[i].socket = socket_configure(option.socket, i);
+        socket_set_handlers(ttys[i].socket, tty_socket_control, tty_socket_input, &ttys[i]);
+    }
+}
+
+/* Test for accessible device file, telling why not once per change */
+static bool tty_device_available(struct tty_t *tty)
+{
+    if (access(tty->device, R_OK) == 0)
+    {
+        tty->last_errno = 0;
+        return true;
+    }
+    else if (tty->last_errno != errno)
+    {
+        if (ttys_count > 1)
+        {
+            warning_printf("Could not open tty device %s (%s)", tty->device, strerror(errno));
+            tio_printf("Waiting for tty device %s..", tty->device);
+        }
+        else
+        {
+            warning_printf("Could not open tty device (%s)", strerror(errno));
+            tio_printf("Waiting for tty device..");
+        }
+        tty->last_errno = errno;
+    }
+
+    /* Get notified when device shows up, it may have done so meanwhile */
+    if (!tty->hotplug_watching)
+    {
+        if (tty->hotplug == NULL)
+        {
+            tty->hotplug = hotplug_start(tty->device);
+        }
+        else
+        {
+            /* Discard changes seen while connected, rearming watches as needed */
+            hotplug_acknowledge(tty->hotplug);
+        }
+        if (tty->hotplug != NULL)
+        {
+            event_add(hotplug_event_fd(tty->hotplug));
+            tty->hotplug_watching = true;
+            if (access(tty->device, R_OK) == 0)
+            {
+                tty->last_errno = 0;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* Watches are kept while connected, closing them is slow (inotify) and the
+ * next wait for the device would set them up again */
+static void tty_hotplug_pause(struct tty_t *tty)
+{
+    if (tty->hotplug_watching)
+    {
+        event_remove(hotplug_event_fd(tty->hotplug));
+        tty->hotplug_watching = false;
+    }
+}
+
+/* Retry opening soon, backing off while device keeps failing (udev permissions etc.) */
+static void tty_retry_later(struct tty_t *tty)
+{
+    tty->retry_delay = tty->retry_delay ? MIN(tty->retry_delay * 2, TTY_RETRY_DELAY_MAX) : TTY_RETRY_DELAY_MIN;
+    tty->retry_time = pace_now() + tty->retry_delay * 1000000ULL;
+}
+
+/* Test if awaited device is due for a retry, after hotplug event or timeout */
+static bool tty_retry_due(struct tty_t *tty)
+{
+    if ((tty->hotplug != NULL) && event_ready(hotplug_event_fd(tty->hotplug)) &&
+        hotplug_acknowledge(tty->hotplug))
+    {
+        tty->retry_delay = 0;
+        tty->retry_time = 0;
+    }
+
+    if (pace_now() < tty->retry_time)
+    {
+        return false;
+    }
+
+    if (tty_device_available(tty))
+    {
+        return true;
+    }
+
+    /* Nothing to back off from until device file shows up */
+    tty->retry_delay = 0;
+    tty->retry_time = (tty->hotplug != NULL) ? UINT64_MAX : pace_now() + TTY_POLL_INTERVAL * 1000000ULL;
+
+    return false;
+}
+
+/* Time until first awaited device is due for a retry (ms, -1 for none) */
+static int tty_retry_timeout(void)
+{
+    uint64_t now = pace_now();
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < ttys_count; i++)
+    {
+        if (!ttys[i].connected)
+        {
+            next = MIN(next, ttys[i].retry_time);
+        }
+    }
+
+    if (next == UINT64_MAX)
+    {
+        return -1;
+    }
+
+    return (next <= now) ? 0 : (int) ((next - now + 999999) / 1000000);
+}
+
+/* Shorter of two event loop timeouts (ms, -1 for none) */
+static int tty_timeout_min(int a, int b)
+{
+    if (a < 0)
+    {
+        return b;
+    }
+
+    return (b < 0) ? a : MIN(a, b);
+}
+
+void tty_wait_for_device(void)
+{
+    struct tty_t *tty = &ttys[0];
+    int    status;
+    static char input_char, previous_char = 0;
+
+    /* Devices are awaited from the input loop in multi-device mode */
+    if (ttys_count > 1)
+    {
+        return;
+    }
+
+    /* Loop until device pops up */
+    while (true)
+    {
+        /* Block until input, hotplug event or retry becomes due */
+        status = event_wait(tty_timeout_min(tty_retry_timeout(), print_flush_timeout()));
+        if (status > 0)
+        {
+            socket_handle_output(tty->socket);
+
+            if (event_ready(STDIN_FILENO))
+            {
+                /* Input from stdin ready */
+
                 /* Read one character */
                 status = read(STDIN_FILENO, &input_char, 1);
                 if (status <= 0)
@@ -713,394 +1312,1915 @@ void tty_wait_for_device(void)
 
                 previous_char = input_char;
             }
-            socket_handle_input(&rdfs, NULL);
+            socket_handle_input(tty->socket, NULL, 0);
         }
         else if (status == -1)
         {
-            error_printf("select() failed (%s)", strerror(errno));
+            error_printf("Waiting for events failed (%s)", strerror(errno));
             exit(EXIT_FAILURE);
         }
 
-        /* Test for accessible device file */
-        status = access(option.tty_device, R_OK);
-        if (status == 0)
-        {
-            last_errno = 0;
-            return;
-        }
-        else if (last_errno != errno)
+        print_flush_check(status > 0);
+
+        /* Test for accessible device file */
+        if (tty_retry_due(tty))
+        {
+            return;
+        }
+    }
+}
+
+static void tty_disconnect(struct tty_t *tty)
+{
+    if (tty->connected)
+    {
+        if (ttys_count > 1)
+        {
+            tio_printf("Disconnected from %s", tty->device);
+        }
+        else
+        {
+            tio_printf("Disconnected");
+        }
+        if (tty->reader != NULL)
+        {
+            event_remove(reader_event_fd(tty->reader));
+            reader_stop(tty->reader);
+            tty->reader = NULL;
+        }
+        else
+        {
+            event_remove(tty->fd);
+        }
+        if (tty->monitor != NULL)
+        {
+            event_remove(monitor_event_fd(tty->monitor));
+            monitor_stop(tty->monitor);
+            tty->monitor = NULL;
+        }
+        if (tty->transfer != NULL)
+        {
+            event_remove_write(tty->fd);
+            transfer_close(tty->transfer, pace_now());
+            tty->transfer = NULL;
+        }
+        latency_restore(tty->latency);
+        tty->latency = NULL;
+        socket_set_connected(tty->socket, false);
+        flock(tty->fd, LOCK_UN);
+        close(tty->fd);
+        tty->fd = -1;
+        tty->connected = false;
+        tty->break_on = false;
+        tty_retry_later(tty);
+    }
+}
+
+void tty_restore(void)
+{
+    for (int i = 0; i < ttys_count; i++)
+    {
+        struct tty_t *tty = &ttys[i];
+
+        if (tty->connected)
+        {
+            tcsetattr(tty->fd, TCSANOW, &tty->tio_old);
+            tty_disconnect(tty);
+        }
+    }
+}
+
+/* Send output to tty device as is, in blocks which fit the write buffer */
+static void tty_transmit(struct tty_t *tty, const char *buffer, size_t count)
+{
+    while (count > 0)
+    {
+        size_t length = MIN(count, (size_t) BUFSIZ);
+
+        if (tty_write(tty, buffer, length) < 0)
+        {
+            warning_printf("Could not write to tty device");
+        }
+
+        /* Update transmit statistics */
+        stats_tx(tty->stats, length);
+
+        buffer += length;
+        count -= length;
+    }
+}
+
+/* Send output through output mappings and local echo, typed input in hex
+ * mode is decoded first */
+static void tty_send(struct tty_t *tty, const char *buffer, size_t count, bool hex)
+{
+    char output_buffer[BUFSIZ*2];
+
+    if ((count == 0) || !tty->connected)
+    {
+        return;
+    }
+
+    while (count > 0)
+    {
+        size_t length = MIN(count, (size_t) BUFSIZ);
+        const char *output = buffer;
+        size_t output_count = length;
+
+        if (hex)
+        {
+            /* Decode hex input block by block, a digit without its pair waits for the next */
+            output_count = hex_decode(buffer, length, output_buffer, &tty->hex_nibble);
+            output = output_buffer;
+        }
+        else if (tty->tx_map != NULL)
+        {
+            /* Map output characters in one pass, unmapped output is sent as is */
+            output_count = tty->tx_map(buffer, length, output_buffer);
+            output = output_buffer;
+        }
+
+        if (option.local_echo)
+        {
+            print_buffer(output, output_count);
+            if (option.log)
+            {
+                log_write(tty->log, output, output_count);
+            }
+        }
+
+        /* Send output to tty device */
+        tty_transmit(tty, output, output_count);
+
+        buffer += length;
+        count -= length;
+    }
+}
+
+static void forward_buffer_to_tty(struct tty_t *tty, const char *buffer, size_t count)
+{
+    tty_send(tty, buffer, count, print_mode == HEX);
+}
+
+/* Deliver socket client input queued ahead of a control request */
+static void tty_socket_input(void *context, const char *buffer, size_t count)
+{
+    struct tty_t *tty = context;
+
+    forward_buffer_to_tty(tty, buffer, count);
+    if (tty->connected)
+    {
+        tty_flush(tty);
+    }
+}
+
+/* Keep port settings applied on connect, so reconnects apply them in one call */
+static void tty_settings_cache(struct tty_t *tty)
+{
+#ifdef HAVE_TERMIOS2
+    if (!tty->standard_baudrate)
+    {
+        /* Read back includes baudrate set via termios2 */
+        tty->tio2 = getattr2(tty->fd);
+        tty->settings_cached = (tty->tio2 != NULL);
+        return;
+    }
+#endif
+#ifdef HAVE_IOSSIOSPEED
+    if (!tty->standard_baudrate)
+    {
+        /* Baudrate is set apart from termios settings */
+        return;
+    }
+#endif
+    tty->settings_cached = true;
+}
+
+static void tty_settings_forget(struct tty_t *tty)
+{
+#ifdef HAVE_TERMIOS2
+    free(tty->tio2);
+    tty->tio2 = NULL;
+#endif
+    tty->settings_cached = false;
+}
+
+static int tty_settings_reapply(struct tty_t *tty)
+{
+#ifdef HAVE_TERMIOS2
+    if (tty->tio2 != NULL)
+    {
+        return setattr2(tty->fd, tty->tio2);
+    }
+#endif
+    return tcsetattr(tty->fd, TCSANOW, &tty->tio);
+}
+
+/* Apply termios settings changed by socket client once pending output is sent */
+static bool tty_socket_apply(struct tty_t *tty)
+{
+    /* Changed settings are read back once applied */
+    tty_settings_forget(tty);
+
+    if (!tty->connected)
+    {
+        /* Takes effect when connecting */
+        return true;
+    }
+
+    if (tcsetattr(tty->fd, TCSADRAIN, &tty->tio) < 0)
+    {
+        warning_printf("Could not apply port settings (%s)", strerror(errno));
+        return false;
+    }
+
+#ifdef HAVE_TERMIOS2
+    if (!tty->standard_baudrate && (setspeed2(tty->fd, tty->baudrate) != 0))
+    {
+        warning_printf("Could not set baudrate speed (%s)", strerror(errno));
+        return false;
+    }
+#endif
+
+#ifdef HAVE_IOSSIOSPEED
+    if (!tty->standard_baudrate && (iossiospeed(tty->fd, tty->baudrate) != 0))
+    {
+        warning_printf("Could not set baudrate speed (%s)", strerror(errno));
+        return false;
+    }
+#endif
+
+    tty_settings_cache(tty);
+
+    return true;
+}
+
+static int tty_socket_baudrate(struct tty_t *tty, int value)
+{
+    struct termios tio_saved = tty->tio;
+    bool standard_saved = tty->standard_baudrate;
+    int baudrate_saved = tty->baudrate;
+    bool standard = true;
+    speed_t baudrate;
+
+    switch (value)
+    {
+        /* See tty_configure() */
+        BAUDRATE_CASES
+
+        default:
+#if defined (HAVE_TERMIOS2) || defined (HAVE_IOSSIOSPEED)
+            standard = false;
+            break;
+#else
+            return tty->baudrate;
+#endif
+    }
+
+    if (standard)
+    {
+        cfsetispeed(&tty->tio, baudrate);
+        cfsetospeed(&tty->tio, baudrate);
+    }
+    tty->standard_baudrate = standard;
+    tty->baudrate = value;
+
+    if (!tty_socket_apply(tty))
+    {
+        tty->tio = tio_saved;
+        tty->standard_baudrate = standard_saved;
+        tty->baudrate = baudrate_saved;
+        tty_socket_apply(tty);
+    }
+
+    return tty->baudrate;
+}
+
+/* Modem line controlled by socket client, returns line state in effect */
+static int tty_socket_line(struct tty_t *tty, int mask, int value)
+{
+    int state;
+
+    if (!tty->connected)
+    {
+        return -1;
+    }
+
+    if ((value != SOCKET_CONTROL_QUERY) && (ioctl(tty->fd, value ? TIOCMBIS : TIOCMBIC, &mask) < 0))
+    {
+        warning_printf("Could not set line state (%s)", strerror(errno));
+    }
+
+    if (ioctl(tty->fd, TIOCMGET, &state) < 0)
+    {
+        return -1;
+    }
+
+    if (value != SOCKET_CONTROL_QUERY)
+    {
+        capture_lines(tty->capture, state);
+    }
+
+    return (state & mask) ? 1 : 0;
+}
+
+/* Serial port settings changed by socket client, see socket_control_handler_t */
+static int tty_socket_control(void *context, enum socket_control_t control, int value)
+{
+    struct tty_t *tty = context;
+    struct termios tio_saved = tty->tio;
+    bool query = (value == SOCKET_CONTROL_QUERY);
+
+    switch (control)
+    {
+        case SOCKET_CONTROL_BAUDRATE:
+            if (!query && (value > 0))
+            {
+                return tty_socket_baudrate(tty, value);
+            }
+            return tty->baudrate;
+
+        case SOCKET_CONTROL_DATABITS:
+            if (!query)
+            {
+                int sizes[] = { CS5, CS6, CS7, CS8 };
+
+                if ((value < 5) || (value > 8))
+                {
+                    break;
+                }
+                tty->tio.c_cflag = (tty->tio.c_cflag & ~CSIZE) | sizes[value - 5];
+            }
+            break;
+
+        case SOCKET_CONTROL_PARITY:
+            if (!query)
+            {
+                tty->tio.c_cflag &= ~(PARENB | PARODD);
+                if (value == SOCKET_PARITY_ODD)
+                {
+                    tty->tio.c_cflag |= PARENB | PARODD;
+                }
+                else if (value == SOCKET_PARITY_EVEN)
+                {
+                    tty->tio.c_cflag |= PARENB;
+                }
+            }
+            break;
+
+        case SOCKET_CONTROL_STOPBITS:
+            if (!query)
+            {
+                if (value == 2)
+                {
+                    tty->tio.c_cflag |= CSTOPB;
+                }
+                else
+                {
+                    tty->tio.c_cflag &= ~CSTOPB;
+                }
+            }
+            break;
+
+        case SOCKET_CONTROL_FLOW:
+            if (!query)
+            {
+                tty->tio.c_cflag &= ~CRTSCTS;
+                tty->tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+                if (value == SOCKET_FLOW_HARD)
+                {
+                    tty->tio.c_cflag |= CRTSCTS;
+                }
+                else if (value == SOCKET_FLOW_SOFT)
+                {
+                    tty->tio.c_iflag |= IXON | IXOFF;
+                }
+            }
+            break;
+
+        case SOCKET_CONTROL_DTR:
+            return tty_socket_line(tty, TIOCM_DTR, value);
+
+        case SOCKET_CONTROL_RTS:
+            return tty_socket_line(tty, TIOCM_RTS, value);
+
+        case SOCKET_CONTROL_BREAK:
+            if (!query && tty->connected)
+            {
+                if (ioctl(tty->fd, value ? TIOCSBRK : TIOCCBRK) < 0)
+                {
+                    warning_printf("Could not set break (%s)", strerror(errno));
+                    return -1;
+                }
+                tty->break_on = value;
+            }
+            return tty->break_on;
+
+        case SOCKET_CONTROL_PURGE:
+            if (!tty->connected)
+            {
+                return -1;
+            }
+            tcflush(tty->fd, (value == SOCKET_PURGE_RX) ? TCIFLUSH : (value == SOCKET_PURGE_TX) ? TCOFLUSH : TCIOFLUSH);
+            return value;
+
+        default:
+            return -1;
+    }
+
+    /* Character format and flow control */
+    if (!query && !tty_socket_apply(tty))
+    {
+        tty->tio = tio_saved;
+        tty_socket_apply(tty);
+    }
+
+    switch (control)
+    {
+        case SOCKET_CONTROL_DATABITS:
+            switch (tty->tio.c_cflag & CSIZE)
+            {
+                case CS5:
+                    return 5;
+                case CS6:
+                    return 6;
+                case CS7:
+                    return 7;
+                default:
+                    return 8;
+            }
+
+        case SOCKET_CONTROL_PARITY:
+            if (!(tty->tio.c_cflag & PARENB))
+            {
+                return SOCKET_PARITY_NONE;
+            }
+            return (tty->tio.c_cflag & PARODD) ? SOCKET_PARITY_ODD : SOCKET_PARITY_EVEN;
+
+        case SOCKET_CONTROL_STOPBITS:
+            return (tty->tio.c_cflag & CSTOPB) ? 2 : 1;
+
+        case SOCKET_CONTROL_FLOW:
+            if (tty->tio.c_cflag & CRTSCTS)
+            {
+                return SOCKET_FLOW_HARD;
+            }
+            return (tty->tio.c_iflag & IXON) ? SOCKET_FLOW_SOFT : SOCKET_FLOW_NONE;
+
+        default:
+            return -1;
+    }
+}
+
+static void rx_output(struct tty_t *tty, const char *buffer, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    /* Print received tty characters to stdout */
+    if ((buffer[count-1] == '\n') && (tty->map_i_nl_crnl))
+    {
+        /* Map input character (newline is always last in block) */
+        print_buffer(buffer, count - 1);
+        print_buffer("\r\n", 2);
+    }
+    else
+    {
+        print_buffer(buffer, count);
+    }
+
+    /* Write to log */
+    if (option.log)
+    {
+        log_write(tty->log, buffer, count);
+    }
+
+    socket_write(tty->socket, buffer, count);
+}
+
+/* Tag output with device name at line starts and whenever devices take turns */
+static void rx_label(struct tty_t *tty)
+{
+    if ((tty == rx_last) && !rx_line_start)
+    {
+        return;
+    }
+
+    if (!rx_line_start)
+    {
+        print_normal_buffer("\r\n", 2);
+    }
+    ansi_printf_raw("[%s] ", tty->label);
+
+    rx_last = tty;
+    rx_line_start = false;
+}
+
+static void tty_handle_rx(struct tty_t *tty, const char *buffer, size_t count)
+{
+    /* Only split input into lines when something needs to act on line
+     * boundaries, otherwise pass the whole read buffer through at once */
+    bool line_mode = (option.timestamp != TIMESTAMP_NONE) || tty->map_i_nl_crnl || (ttys_count > 1);
+
+    while (count > 0)
+    {
+        size_t length = count;
+
+        if (line_mode)
+        {
+            const char *newline = memchr(buffer, '\n', count);
+            if (newline != NULL)
+            {
+                length = newline - buffer + 1;
+            }
+        }
+
+        if (ttys_count > 1)
+        {
+            rx_label(tty);
+        }
+
+        /* Print timestamp in front of first character of new line if enabled */
+        if (tty->next_timestamp)
+        {
+            size_t skip = 0;
+
+            while ((skip < length) && ((buffer[skip] == '\n') || (buffer[skip] == '\r')))
+            {
+                skip++;
+            }
+
+            if (skip < length)
+            {
+                char *now = current_time();
+
+                if (now)
+                {
+                    rx_output(tty, buffer, skip);
+                    buffer += skip;
+                    count -= skip;
+                    length -= skip;
+
+                    /* Hex dump rows have a fixed layout so only log timestamps there */
+                    if (print_buffer != print_hex_dump_buffer)
+                    {
+                        ansi_printf_raw("[%s] ", now);
+                    }
+                    if (option.log)
+                    {
+                        log_printf(tty->log, "[%s] ", now);
+                    }
+                    tty->next_timestamp = false;
+                }
+            }
+        }
+
+        rx_output(tty, buffer, length);
+
+        if (buffer[length-1] == '\n')
+        {
+            rx_line_start = true;
+            if (option.timestamp)
+            {
+                tty->next_timestamp = true;
+            }
+        }
+
+        buffer += length;
+        count -= length;
+    }
+
+    print_tainted = true;
+}
+
+/*
+ * Specialized kernels
+ *
+ * tty_handle_rx() copes with any combination of options. For the common case
+ * of passing received data through unchanged, and for each combination of
+ * output mappings, the kernels below are generated with the options as
+ * compile-time constants, so they run without testing any option per block
+ * or byte. The kernels of each device are selected by
+ * tty_select_kernels() on connect and after every key command.
+ */
+#define RX_PASSTHROUGH_KERNEL(name, LOG)                                    \
+static void name(struct tty_t *tty, const char *buffer, size_t count)      \
+{                                                                           \
+    print_buffer(buffer, count);                                            \
+    if (LOG)                                                                \
+    {                                                                       \
+        log_write(tty->log, buffer, count);                                 \
+    }                                                                       \
+    socket_write(tty->socket, buffer, count);                               \
+    print_tainted = true;                                                   \
+}
+
+RX_PASSTHROUGH_KERNEL(rx_passthrough, false)
+RX_PASSTHROUGH_KERNEL(rx_passthrough_log, true)
+
+/* Set modem line to given level, unless it is at that level already */
+static void tty_script_set_line(struct tty_t *tty, const struct script_command_t *command)
+{
+    int state;
+
+    if (ioctl(tty->fd, TIOCMGET, &state) < 0)
+    {
+        warning_printf("Could not get line state (%s)", strerror(errno));
+        return;
+    }
+
+    if (((state & command->line_mask) != 0) != (command->value != 0))
+    {
+        toggle_line(tty, command->line, command->line_mask);
+    }
+}
+
+/* Perform script commands until the script waits for data or time */
+static void tty_script_run(struct tty_t *tty)
+{
+    const struct script_command_t *command;
+
+    if (!tty->connected)
+    {
+        return;
+    }
+
+    while ((command = script_step(tty->script, pace_now())) != NULL)
+    {
+        switch (command->type)
+        {
+            case SCRIPT_SEND:
+                /* Script strings are text, escapes already cover binary data */
+                tty_send(tty, command->text, command->length, false);
+                tty_flush(tty);
+                break;
+
+            case SCRIPT_SET:
+                tty_script_set_line(tty, command);
+                break;
+
+            case SCRIPT_BREAK:
+                tcsendbreak(tty->fd, 0);
+                break;
+
+            case SCRIPT_EXIT:
+                exit(command->value);
+
+            default:
+                break;
+        }
+    }
+}
+
+/* Feeds received data to the script after passing it on, so commands
+ * following an expect see the data received after its match */
+static void rx_script(struct tty_t *tty, const char *buffer, size_t count)
+{
+    size_t done = 0;
+
+    tty->rx_script_next(tty, buffer, count);
+
+    while (done < count)
+    {
+        done += script_receive(tty->script, buffer + done, count - done);
+        tty_script_run(tty);
+    }
+}
+
+/* Records received data in scrollback */
+static void rx_scrollback(struct tty_t *tty, const char *buffer, size_t count)
+{
+    scrollback_append(buffer, count);
+    tty->rx_scrollback_next(tty, buffer, count);
+}
+
+/* Scans received data for triggers ahead of the receive kernel selected,
+ * which gets the data split at the end of each match */
+static void rx_trigger(struct tty_t *tty, const char *buffer, size_t count)
+{
+    const struct trigger_t *trigger;
+    size_t done = 0, position = 0;
+
+    while ((trigger = trigger_scan(&tty->trigger_cursor, buffer, count, &position)) != NULL)
+    {
+        if (trigger->action == TRIGGER_HIGHLIGHT)
+        {
+            /* Match may have started in previous read, highlight the rest */
+            size_t start = (position > trigger->length) ? position - trigger->length : 0;
+
+            if ((option.color < 0) || (print_buffer != print_normal_buffer) || (position <= done))
+            {
+                continue;
+            }
+            start = MAX(start, done);
+            if (start > done)
+            {
+                tty->rx_next(tty, buffer + done, start - done);
+            }
+            print_normal_buffer("\e[7m", 4);
+            tty->rx_next(tty, buffer + start, position - start);
+            print_normal_buffer("\e[27m", 5);
+            done = position;
+            continue;
+        }
+
+        if (position > done)
+        {
+            tty->rx_next(tty, buffer + done, position - done);
+            done = position;
+        }
+
+        switch (trigger->action)
+        {
+            case TRIGGER_MARKER:
+                tio_printf("Trigger: %s", trigger->name);
+                if (option.log)
+                {
+                    log_printf(tty->log, "\n[%s] Trigger: %s\n", current_time(), trigger->name);
+                }
+                break;
+
+            case TRIGGER_SEND:
+                tty_transmit(tty, trigger->argument, trigger->argument_length);
+                tty_flush(tty);
+                break;
+
+            case TRIGGER_TOGGLE:
+                toggle_line(tty, trigger->argument, trigger->line);
+                break;
+
+            case TRIGGER_HOOK:
+                trigger_hook(trigger, tty->device);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (count > done)
+    {
+        tty->rx_next(tty, buffer + done, count - done);
+    }
+}
+
+#define TX_MAP_KERNEL(name, DEL_BS, CR_NL, NL_CRNL)                         \
+static size_t name(const char *buffer, size_t count, char *output)         \
+{                                                                           \
+    char *p = output;                                                       \
+                                                                            \
+    for (size_t i = 0; i < count; i++)                                      \
+    {                                                                       \
+        char c = buffer[i];                                                 \
+                                                                            \
+        if (DEL_BS && (c == 127))                                           \
+        {                                                                   \
+            c = '\b';                                                       \
+        }                                                                   \
+        if (CR_NL && (c == '\r'))                                           \
+        {                                                                   \
+            c = '\n';                                                       \
+        }                                                                   \
+        if (NL_CRNL && ((c == '\n') || (c == '\r')))                        \
+        {                                                                   \
+            *p++ = '\r';                                                    \
+            *p++ = '\n';                                                    \
+        }                                                                   \
+        else                                                                \
+        {                                                                   \
+            *p++ = c;                                                       \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    return p - output;                                                      \
+}
+
+TX_MAP_KERNEL(tx_map_del_bs, true, false, false)
+TX_MAP_KERNEL(tx_map_cr_nl, false, true, false)
+TX_MAP_KERNEL(tx_map_del_bs_cr_nl, true, true, false)
+TX_MAP_KERNEL(tx_map_nl_crnl, false, false, true)
+TX_MAP_KERNEL(tx_map_del_bs_nl_crnl, true, false, true)
+TX_MAP_KERNEL(tx_map_cr_nl_nl_crnl, false, true, true)
+TX_MAP_KERNEL(tx_map_all, true, true, true)
+
+/* Indexed by map flags: del-bs (bit 0), cr-nl (bit 1), nl-crnl (bit 2) */
+static const tx_map_kernel_t tx_map_kernels[8] =
+{
+    NULL,
+    tx_map_del_bs,
+    tx_map_cr_nl,
+    tx_map_del_bs_cr_nl,
+    tx_map_nl_crnl,
+    tx_map_del_bs_nl_crnl,
+    tx_map_cr_nl_nl_crnl,
+    tx_map_all,
+};
+
+static void tty_select_kernels(void)
+{
+    for (int i = 0; i < ttys_count; i++)
+    {
+        struct tty_t *tty = &ttys[i];
+
+        /* Data needs to be split into lines for timestamps, mapping and labels */
+        if ((option.timestamp != TIMESTAMP_NONE) || tty->map_i_nl_crnl || (ttys_count > 1))
+        {
+            tty->rx_kernel = tty_handle_rx;
+        }
+        else
+        {
+            tty->rx_kernel = option.log ? rx_passthrough_log : rx_passthrough;
+        }
+
+        /* Triggers cost nothing unless configured */
+        if (trigger_enabled())
+        {
+            tty->rx_next = tty->rx_kernel;
+            tty->rx_kernel = rx_trigger;
+        }
+
+        if (tty->script != NULL)
+        {
+            tty->rx_script_next = tty->rx_kernel;
+            tty->rx_kernel = rx_script;
+        }
+
+        if (scrollback_enabled())
+        {
+            tty->rx_scrollback_next = tty->rx_kernel;
+            tty->rx_kernel = rx_scrollback;
+        }
+
+        tty->tx_map = tx_map_kernels[tty->map_o_del_bs | (tty->map_o_cr_nl << 1) | (tty->map_o_nl_crnl << 2)];
+    }
+}
+
+#ifdef HAVE_SPLICE
+/* Zero-copy path is only usable while received bytes need no processing */
+static bool tty_splice_enabled(struct tty_t *tty)
+{
+    return tty->rx_splice &&
+           (tty->reader == NULL) &&
+           (tty->capture == NULL) &&
+           !option.bench &&
+           (ttys_count == 1) &&
+           (option.timestamp == TIMESTAMP_NONE) &&
+           (print_mode == NORMAL) &&
+           !tty->map_i_nl_crnl &&
+           !trigger_enabled() &&
+           (tty->script == NULL) &&
+           (tty->transfer == NULL) &&
+           !scrollback_enabled() &&
+           !(option.log && option.log_strip);
+}
+
+static ssize_t tty_splice_rx(struct tty_t *tty)
+{
+    const char *leftover;
+    ssize_t bytes_spliced;
+    size_t rest;
+
+    bytes_spliced = splice_read(tty->fd, MIN(tty->rx_left, (uint64_t) SIZE_MAX));
+    if (bytes_spliced <= 0)
+    {
+        return bytes_spliced;
+    }
+
+    /* Print received tty characters to stdout */
+    print_flush();
+    rest = splice_copy(STDOUT_FILENO, bytes_spliced, &leftover);
+    if (rest > 0)
+    {
+        fwrite(leftover, 1, rest, stdout);
+    }
+
+    /* Write to log */
+    if (option.log)
+    {
+        log_splice(tty->log, bytes_spliced);
+    }
+
+    socket_splice(tty->socket, bytes_spliced);
+
+    splice_consume(bytes_spliced);
+
+    print_tainted = true;
+
+    return bytes_spliced;
+}
+#endif
+
+/* Save port settings found and apply configured ones. Reconnects reapply the
+ * settings of the first connect in one call, restored on exit are those found first. */
+static int tty_settings_apply(struct tty_t *tty)
+{
+    static bool first = true;
+
+    if (tty->settings_cached)
+    {
+        if (tty_settings_reapply(tty) == 0)
+        {
+            return TIO_SUCCESS;
+        }
+        if (errno == ENOTTY)
+        {
+            error_printf("Not a tty device");
+            exit(EXIT_FAILURE);
+        }
+        error_printf_silent("Could not apply port settings (%s)", strerror(errno));
+        return TIO_ERROR;
+    }
+
+    /* Save current port settings */
+    if (tcgetattr(tty->fd, &tty->tio_old) < 0)
+    {
+        return TIO_ERROR;
+    }
+
+#ifdef HAVE_IOSSIOSPEED
+    if (!tty->standard_baudrate)
+    {
+        /* OS X wants these fields left alone. We'll set baudrate with iossiospeed below. */
+        tty->tio.c_ispeed = tty->tio_old.c_ispeed;
+        tty->tio.c_ospeed = tty->tio_old.c_ospeed;
+    }
+#endif
+
+    /* Make sure we restore tty settings on exit */
+    if (first)
+    {
+        atexit(&tty_restore);
+        first = false;
+    }
+
+    /* Activate new port settings */
+    if (tcsetattr(tty->fd, TCSANOW, &tty->tio) == -1)
+    {
+        error_printf_silent("Could not apply port settings (%s)", strerror(errno));
+        return TIO_ERROR;
+    }
+
+#ifdef HAVE_TERMIOS2
+    if (!tty->standard_baudrate)
+    {
+        if (setspeed2(tty->fd, tty->baudrate) != 0)
+        {
+            error_printf_silent("Could not set baudrate speed (%s)", strerror(errno));
+            return TIO_ERROR;
+        }
+    }
+#endif
+
+#ifdef HAVE_IOSSIOSPEED
+    if (!tty->standard_baudrate)
+    {
+        if (iossiospeed(tty->fd, tty->baudrate) != 0)
+        {
+            error_printf_silent("Could not set baudrate speed (%s)", strerror(errno));
+            return TIO_ERROR;
+        }
+    }
+#endif
+
+    tty_settings_cache(tty);
+
+    return TIO_SUCCESS;
+}
+
+static int tty_open(struct tty_t *tty)
+{
+    int    status;
+
+    /* Time spent waiting for device is not part of connecting */
+    profile_mark(NULL);
+
+    /* Open tty device */
+    tty->fd = open(tty->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (tty->fd < 0)
+    {
+        error_printf_silent("Could not open tty device (%s)", strerror(errno));
+        goto error_open;
+    }
+
+    /* Make sure device is of tty type, on reconnect applying settings does */
+    if (!tty->settings_cached && !isatty(tty->fd))
+    {
+        error_printf("Not a tty device");
+        exit(EXIT_FAILURE);;
+    }
+    profile_mark("Open device");
+
+    /* Lock device file */
+    status = flock(tty->fd, LOCK_EX | LOCK_NB);
+    if ((status == -1) && (errno == EWOULDBLOCK))
+    {
+        error_printf("Device file is locked by another process");
+        exit(EXIT_FAILURE);
+    }
+    profile_mark("Lock device");
+
+    /* Flush stale I/O data (if any) */
+    tcflush(tty->fd, TCIOFLUSH);
+    profile_mark("Flush device");
+
+    /* Print connect status */
+    if (ttys_count > 1)
+    {
+        tio_printf("Connected to %s", tty->device);
+    }
+    else
+    {
+        tio_printf("Connected");
+    }
+    tty->connected = true;
+    tty_hotplug_pause(tty);
+    print_tainted = false;
+
+    tty->next_timestamp = (option.timestamp != TIMESTAMP_NONE);
+
+    /* Apply port settings */
+    if (tty_settings_apply(tty) != TIO_SUCCESS)
+    {
+        goto error_settings;
+    }
+    profile_mark("Port settings");
+
+#ifdef HAVE_SPLICE
+    /* Use zero-copy receive path when output is not a terminal */
+    tty->rx_splice = !isatty(STDOUT_FILENO) && splice_init();
+#endif
+
+    /* Record initial line states */
+    if ((tty->capture != NULL) || (tty->socket != NULL))
+    {
+        int state;
+
+        if (ioctl(tty->fd, TIOCMGET, &state) == 0)
+        {
+            capture_lines(tty->capture, state);
+            socket_notify_lines(tty->socket, state);
+        }
+    }
+
+    /* Watch serial driver error counters and modem lines */
+    tty->monitor = monitor_start(tty->fd);
+    if (tty->monitor != NULL)
+    {
+        event_add(monitor_event_fd(tty->monitor));
+    }
+
+    /* Register tty device (or its reader thread) and socket clients with event loop */
+    if (option.rx_buffer_size > 0)
+    {
+        tty->reader = reader_start(tty->fd, option.rx_buffer_size);
+        event_add(reader_event_fd(tty->reader));
+    }
+    else
+    {
+        event_add(tty->fd);
+    }
+    socket_set_connected(tty->socket, true);
+    tty_select_kernels();
+
+    /* Apply low latency profile, real-time settings go to the thread reading the device */
+    if (option.low_latency || (option.rx_priority > 0) || (option.rx_cpu >= 0))
+    {
+        tty->latency = latency_apply(tty->fd, tty->device);
+        if (tty->reader != NULL)
+        {
+            latency_realtime(tty->latency, reader_thread_id(tty->reader));
+        }
+        else if (ttys_count == 1)
+        {
+            latency_realtime(tty->latency, pthread_self());
+        }
+    }
+    profile_mark("Receive setup");
+    profile_report();
+
+    return TIO_SUCCESS;
+
+error_settings:
+    tty_disconnect(tty);
+    return TIO_ERROR;
+
+error_open:
+    tty->fd = -1;
+    tty_retry_later(tty);
+    return TIO_ERROR;
+}
+
+/* Report lost data, line errors and modem line changes as they happen */
+static void tty_monitor_check(struct tty_t *tty)
+{
+    struct monitor_event_t event;
+    char *now;
+
+    if (!monitor_check(tty->monitor, &event))
+    {
+        return;
+    }
+
+    if (event.overrun || event.buf_overrun)
+    {
+        /* Buffer overruns mean tio did not read fast enough */
+        warning_printf("%s%sLost data: %u UART overruns, %u tty buffer overruns",
+                       (ttys_count > 1) ? tty->label : "", (ttys_count > 1) ? ": " : "",
+                       event.overrun, event.buf_overrun);
+        if (option.log)
+        {
+            now = current_time();
+            log_printf(tty->log, "\n[%s] Warning: Lost data: %u UART overruns, %u tty buffer overruns\n",
+                       now, event.overrun, event.buf_overrun);
+        }
+    }
+
+    if (event.frame || event.parity || event.brk)
+    {
+        warning_printf("%s%sLine errors: %u framing, %u parity, %u breaks",
+                       (ttys_count > 1) ? tty->label : "", (ttys_count > 1) ? ": " : "",
+                       event.frame, event.parity, event.brk);
+        if (option.log)
+        {
+            now = current_time();
+            log_printf(tty->log, "\n[%s] Warning: Line errors: %u framing, %u parity, %u breaks\n",
+                       now, event.frame, event.parity, event.brk);
+        }
+    }
+
+    if (event.overrun || event.buf_overrun || event.frame || event.parity || event.brk)
+    {
+        capture_errors(tty->capture, event.overrun, event.buf_overrun, event.frame, event.parity, event.brk);
+        socket_notify_errors(tty->socket, event.overrun || event.buf_overrun, event.parity, event.frame, event.brk);
+    }
+
+    if (event.cts || event.dsr || event.rng || event.dcd)
+    {
+        int state;
+
+        if (ioctl(tty->fd, TIOCMGET, &state) == 0)
+        {
+            tio_printf("%s%sLine state changed: CTS %s, DSR %s, RI %s, DCD %s",
+                       (ttys_count > 1) ? tty->label : "", (ttys_count > 1) ? ": " : "",
+                       (state & TIOCM_CTS) ? "HIGH" : "LOW", (state & TIOCM_DSR) ? "HIGH" : "LOW",
+                       (state & TIOCM_RNG) ? "HIGH" : "LOW", (state & TIOCM_CD) ? "HIGH" : "LOW");
+            capture_lines(tty->capture, state);
+            socket_notify_lines(tty->socket, state);
+        }
+    }
+}
+
+/* Responses to framed file transfers are consumed by the protocol */
+static void tty_receive(struct tty_t *tty, const char *buffer, size_t count)
+{
+    if ((tty->transfer != NULL) && transfer_framed(tty->transfer))
+    {
+        transfer_receive(tty->transfer, buffer, count, pace_now());
+        return;
+    }
+
+    tty->rx_kernel(tty, buffer, count);
+}
+
+/* Write file being sent as far as the tty device accepts without blocking,
+ * paced output is written one segment whenever the schedule allows */
+static void tty_transfer_run(struct tty_t *tty)
+{
+    uint64_t now = pace_now();
+    const char *buffer;
+    size_t count;
+    ssize_t status;
+
+    if (tty->transfer == NULL)
+    {
+        return;
+    }
+
+    transfer_poll(tty->transfer, now);
+
+    while ((count = transfer_peek(tty->transfer, &buffer)) > 0)
+    {
+        if (pace_enabled())
+        {
+            if (pace_deadline() > now)
+            {
+                break;
+            }
+            status = pace_write(tty->fd, buffer, pace_segment(buffer, count));
+        }
+        else
+        {
+            status = write(tty->fd, buffer, count);
+        }
+
+        if (status <= 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            warning_printf("Could not write to tty device (%s)", strerror(errno));
+            transfer_cancel(tty->transfer, "Write error");
+            break;
+        }
+
+        capture_write(tty->capture, CAPTURE_TX, buffer, status);
+        stats_tx(tty->stats, status);
+
+        now = pace_now();
+        transfer_consume(tty->transfer, status, now);
+    }
+
+    if (transfer_done(tty->transfer))
+    {
+        transfer_close(tty->transfer, now);
+        tty->transfer = NULL;
+        count = 0;
+    }
+
+    /* Wait for device to accept more unless pacing schedule decides */
+    if ((count > 0) && !pace_enabled())
+    {
+        event_add_write(tty->fd);
+    }
+    else
+    {
+        event_remove_write(tty->fd);
+    }
+}
+
+/* Time until file transfer needs attention (ms) */
+static int tty_transfer_timeout(struct tty_t *tty)
+{
+    uint64_t now = pace_now();
+    int timeout = transfer_timeout(tty->transfer, now);
+    const char *buffer;
+
+    /* Paced output continues when its next segment is due */
+    if ((tty->transfer != NULL) && pace_enabled() && (transfer_peek(tty->transfer, &buffer) > 0))
+    {
+        uint64_t deadline = pace_deadline();
+
+        timeout = tty_timeout_min(timeout, (deadline <= now) ? 0 : (int) ((deadline - now + 999999) / 1000000));
+    }
+
+    return timeout;
+}
+
+/* Handle input buffered by reader thread */
+static int tty_read_ring(struct tty_t *tty)
+{
+    const char *buffer;
+    size_t count;
+
+    reader_acknowledge(tty->reader);
+
+    while (((count = reader_peek(tty->reader, &buffer)) > 0) && (tty->rx_left > 0))
+    {
+        /* Stop at stream size */
+        count = MIN(count, tty->rx_left);
+
+        /* Update receive statistics */
+        stats_rx(tty->stats, count);
+        tty->rx_left -= count;
+
+        capture_write(tty->capture, CAPTURE_RX, buffer, count);
+
+        /* Process input block by block */
+        tty_receive(tty, buffer, count);
+
+        if (option.bench)
+        {
+            bench_rx(buffer, count);
+        }
+
+        reader_consume(tty->reader, count);
+    }
+
+    if (reader_failed(tty->reader))
+    {
+        /* Error reading - device is likely unplugged */
+        error_printf_silent("Could not read from tty device");
+        return TIO_ERROR;
+    }
+
+    return TIO_SUCCESS;
+}
+
+/* Handle input from tty device ready */
+static int tty_read(struct tty_t *tty, char *input_buffer)
+{
+    if (tty->reader != NULL)
+    {
+        return tty_read_ring(tty);
+    }
+
+#ifdef HAVE_SPLICE
+    if (tty_splice_enabled(tty))
+    {
+        ssize_t bytes_spliced = tty_splice_rx(tty);
+        if (bytes_spliced > 0)
+        {
+            /* Update receive statistics */
+            stats_rx(tty->stats, bytes_spliced);
+            tty->rx_left -= bytes_spliced;
+            return TIO_SUCCESS;
+        }
+        else if ((bytes_spliced < 0) && (errno == EAGAIN))
+        {
+            return TIO_SUCCESS;
+        }
+        else if ((bytes_spliced < 0) && (errno == EINVAL))
+        {
+            /* Device does not support splice, use normal read */
+            tty->rx_splice = false;
+        }
+    }
+#endif
+    ssize_t bytes_read = read(tty->fd, input_buffer, MIN(tty->rx_left, (uint64_t) BUFSIZ));
+    if (bytes_read <= 0)
+    {
+        /* Error reading - device is likely unplugged */
+        error_printf_silent("Could not read from tty device");
+        return TIO_ERROR;
+    }
+
+    /* Update receive statistics */
+    stats_rx(tty->stats, bytes_read);
+    tty->rx_left -= bytes_read;
+
+    capture_write(tty->capture, CAPTURE_RX, input_buffer, bytes_read);
+
+    /* Process input block by block */
+    tty_receive(tty, input_buffer, bytes_read);
+
+    if (option.bench)
+    {
+        bench_rx(input_buffer, bytes_read);
+    }
+
+    return TIO_SUCCESS;
+}
+
+/* Handle input from stdin, forwarded to the active tty device */
+static void tty_handle_stdin(const char *input_buffer, ssize_t bytes_read)
+{
+    static char previous_char = 0;
+    char   output_buffer[BUFSIZ];
+    size_t output_count = 0;
+    char   input_char, output_char;
+    bool   forward;
+
+    /* Process input byte by byte, forward to tty in blocks */
+    for (int i=0; i<bytes_read; i++)
+    {
+        input_char = input_buffer[i];
+
+        /* Forward input to output */
+        output_char = input_char;
+        forward = true;
+
+        if (interactive_mode && (prompt.type != PROMPT_NONE))
+        {
+            tty_prompt_input(input_char);
+            continue;
+        }
+
+        if (interactive_mode)
+        {
+            /* Forward pending input before key command may change modes */
+            if ((input_char == KEY_CTRL_T) || (previous_char == KEY_CTRL_T))
+            {
+                forward_buffer_to_tty(tty_active, output_buffer, output_count);
+                output_count = 0;
+            }
+
+            /* Do not forward ctrl-t key */
+            if (input_char == KEY_CTRL_T)
+            {
+                forward = false;
+            }
+
+            /* Handle commands */
+            handle_command_sequence(input_char, previous_char, &output_char, &forward);
+
+            /* Save previous key */
+            previous_char = input_char;
+
+            if (print_mode == HEX)
+            {
+                /* Whitespace separating pasted hex bytes is skipped when decoding */
+                if (!is_valid_hex(input_char) && !isspace((unsigned char) input_char))
+                {
+                    warning_printf("Invalid hex character: '%d' (0x%02x)", input_char, input_char);
+                    forward = false;
+                }
+            }
+        }
+
+        /* Keyboard input would interleave with file being sent */
+        if (forward && (tty_active->transfer == NULL))
         {
-            warning_printf("Could not open tty device (%s)", strerror(errno));
-            tio_printf("Waiting for tty device..");
-            last_errno = errno;
+            output_buffer[output_count++] = output_char;
         }
     }
+
+    forward_buffer_to_tty(tty_active, output_buffer, output_count);
 }
 
-void tty_disconnect(void)
+/* Longest time event loop may sleep before periodic work is due */
+static int tty_event_timeout(bool retry)
 {
-    if (connected)
+    int timeout = tty_timeout_min(stats_timeout(), print_flush_timeout());
+
+    if (retry)
+    {
+        timeout = tty_timeout_min(timeout, tty_retry_timeout());
+    }
+
+    if (option.bench)
     {
-        tio_printf("Disconnected");
-        flock(fd, LOCK_UN);
-        close(fd);
-        connected = false;
+        timeout = tty_timeout_min(timeout, 100);
     }
+
+    for (int i = 0; i < ttys_count; i++)
+    {
+        timeout = tty_timeout_min(timeout, tty_transfer_timeout(&ttys[i]));
+    }
+
+    return tty_timeout_min(timeout, script_timeout(tty_active->script, pace_now()));
 }
 
-void tty_restore(void)
+/* Stdin data of streaming mode not yet accepted by the tty device */
+struct tty_stream_t
+{
+    char buffer[TTY_STREAM_BUFFER_SIZE];
+    size_t head;
+    size_t count;
+    uint64_t last_activity;
+};
+
+/* Write queued stream data as far as the tty device accepts without blocking */
+static int tty_stream_write(struct tty_t *tty, struct tty_stream_t *stream)
 {
-    tcsetattr(fd, TCSANOW, &tio_old);
+    while (stream->count > 0)
+    {
+        ssize_t status = write(tty->fd, stream->buffer + stream->head, stream->count);
+        if (status < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            error_printf_silent("Could not write to tty device (%s)", strerror(errno));
+            return TIO_ERROR;
+        }
+
+        capture_write(tty->capture, CAPTURE_TX, stream->buffer + stream->head, status);
+        stats_tx(tty->stats, status);
 
-    if (connected)
+        stream->head += status;
+        stream->count -= status;
+        stream->last_activity = pace_now();
+    }
+
+    /* Wait for device to accept more while data is left */
+    if (stream->count == 0)
+    {
+        stream->head = 0;
+        event_remove_write(tty->fd);
+    }
+    else
     {
-        tty_disconnect();
+        event_add_write(tty->fd);
     }
+
+    return TIO_SUCCESS;
 }
 
-void forward_to_tty(int fd, char output_char)
+/* Append next block of stdin to stream data, returns false at end of input */
+static bool tty_stream_read(struct tty_t *tty, struct tty_stream_t *stream)
 {
-    int status;
+    char input_buffer[BUFSIZ];
+    char *tail;
+    size_t space;
+    ssize_t status;
 
-    /* Map output character */
-    if ((output_char == 127) && (map_o_del_bs))
+    /* Move data left to start of buffer */
+    if (stream->head > 0)
     {
-        output_char = '\b';
+        memmove(stream->buffer, stream->buffer + stream->head, stream->count);
+        stream->head = 0;
     }
-    if ((output_char == '\r') && (map_o_cr_nl))
+    tail = stream->buffer + stream->count;
+    space = sizeof(stream->buffer) - stream->count;
+
+    if (tty->tx_map != NULL)
     {
-        output_char = '\n';
+        /* Mapping may double the size */
+        status = read(STDIN_FILENO, input_buffer, MIN(space / 2, sizeof(input_buffer)));
     }
-
-    /* Map newline character */
-    if ((output_char == '\n' || output_char == '\r') && (map_o_nl_crnl))
+    else
     {
-        const char *crlf = "\r\n";
+        status = read(STDIN_FILENO, tail, space);
+    }
 
-        optional_local_echo(crlf[0]);
-        optional_local_echo(crlf[1]);
-        status = tty_write(fd, crlf, 2);
-        if (status < 0)
+    if (status < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
         {
-            warning_printf("Could not write to tty device");
+            return true;
         }
+        error_printf_silent("Could not read from stdin (%s)", strerror(errno));
+        return false;
+    }
+    if (status == 0)
+    {
+        return false;
+    }
 
-        tx_total += 2;
+    if (tty->tx_map != NULL)
+    {
+        status = tty->tx_map(input_buffer, status, tail);
     }
-    else
+
+    if (option.local_echo)
     {
-        if (print_mode == HEX)
-        {
-            output_hex(output_char);
-        }
-        else
+        print_buffer(tail, status);
+        if (option.log)
         {
-            /* Send output to tty device */
-            optional_local_echo(output_char);
-            status = tty_write(fd, &output_char, 1);
-            if (status < 0)
-            {
-                warning_printf("Could not write to tty device");
-            }
-
-            /* Update transmit statistics */
-            tx_total++;
+            log_write(tty->log, tail, status);
         }
     }
+
+    stream->count += status;
+    return true;
 }
 
-int tty_connect(void)
+/* Test whether tty device has sent all output, without blocking while it has not */
+static bool tty_stream_drained(struct tty_t *tty)
 {
-    fd_set rdfs;           /* Read file descriptor set */
-    int    maxfd;          /* Maximum file descriptor used */
-    char   input_char, output_char;
-    char   input_buffer[BUFSIZ];
-    static char previous_char = 0;
-    static bool first = true;
-    int    status;
-    bool   next_timestamp = false;
-    char*  now = NULL;
+#ifdef TIOCOUTQ
+    int pending;
 
-    /* Open tty device */
-    fd = open(option.tty_device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-    if (fd < 0)
+    if ((ioctl(tty->fd, TIOCOUTQ, &pending) == 0) && (pending > 0))
     {
-        error_printf_silent("Could not open tty device (%s)", strerror(errno));
-        goto error_open;
+        return false;
     }
+#endif
+
+    /* Wait for last character to leave */
+    tcdrain(tty->fd);
+    return true;
+}
 
-    /* Make sure device is of tty type */
-    if (!isatty(fd))
+/* Streaming loop when piping data through tio: stdin is sent to the tty
+ * device without blocking while receiving, until end of input and drained
+ * output or until stream size or idle timeout are reached */
+static int tty_stream(struct tty_t *tty)
+{
+    static struct tty_stream_t stream;
+    char input_buffer[BUFSIZ];
+    bool direct = (print_mode != HEX) && !pace_enabled();
+    bool input_file, input_done = false, drained = false;
+    struct stat st;
+    int rx_fd = tty->reader ? reader_event_fd(tty->reader) : tty->fd;
+    int status, timeout;
+
+    /* Regular files and eg. /dev/null are always readable, but cannot be polled */
+    input_file = ((fstat(STDIN_FILENO, &st) == 0) && S_ISREG(st.st_mode)) || !event_add(STDIN_FILENO);
+
+    if (option.stream_size > 0)
     {
-        error_printf("Not a tty device");
-        exit(EXIT_FAILURE);;
+        tty->rx_left = option.stream_size;
     }
+    stream.last_activity = pace_now();
 
-    /* Lock device file */
-    status = flock(fd, LOCK_EX | LOCK_NB);
-    if ((status == -1) && (errno == EWOULDBLOCK))
+    while (true)
     {
-        error_printf("Device file is locked by another process");
-        exit(EXIT_FAILURE);
-    }
+        /* Stop reading stdin while device is not keeping up */
+        bool input_wanted = !input_done && (stream.count < sizeof(stream.buffer) / 2);
 
-    /* Flush stale I/O data (if any) */
-    tcflush(fd, TCIOFLUSH);
+        if (!input_file)
+        {
+            if (input_wanted)
+            {
+                event_add(STDIN_FILENO);
+            }
+            else
+            {
+                event_remove(STDIN_FILENO);
+            }
+        }
 
-    /* Print connect status */
-    tio_printf("Connected");
-    connected = true;
-    print_tainted = false;
+        timeout = tty_event_timeout(false);
+        if (input_wanted && input_file)
+        {
+            timeout = 0;
+        }
+        if (input_done && (stream.count == 0) && !drained)
+        {
+            timeout = tty_timeout_min(timeout, TTY_DRAIN_INTERVAL);
+        }
+        if (option.stream_timeout > 0)
+        {
+            int64_t idle = (pace_now() - stream.last_activity) / 1000000;
+            timeout = tty_timeout_min(timeout, MAX(option.stream_timeout - idle, 0));
+        }
 
-    if (option.timestamp)
-    {
-        next_timestamp = true;
+        status = event_wait(timeout);
+        if (stats_tick())
+        {
+            tty_stats_publish();
+        }
+        if (signal_hangup_pending())
+        {
+            log_reopen();
+        }
+        if (status == -1)
+        {
+            error_printf("Waiting for events failed (%s)", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if ((status > 0) && event_ready(rx_fd))
+        {
+            if (tty_read(tty, input_buffer) != TIO_SUCCESS)
+            {
+                tty_disconnect(tty);
+                return TIO_ERROR;
+            }
+            stream.last_activity = pace_now();
+            if (monitor_due(tty->monitor))
+            {
+                tty_monitor_check(tty);
+            }
+        }
+
+        /* Modem line change */
+        if ((status > 0) && (tty->monitor != NULL) && event_ready(monitor_event_fd(tty->monitor)))
+        {
+            monitor_acknowledge(tty->monitor);
+            tty_monitor_check(tty);
+        }
+
+        if (input_wanted && (input_file || ((status > 0) && event_ready(STDIN_FILENO))))
+        {
+            if (direct)
+            {
+                input_done = !tty_stream_read(tty, &stream);
+            }
+            else
+            {
+                /* Hexadecimal and paced input is sent as when typed */
+                ssize_t bytes_read = read(STDIN_FILENO, input_buffer, BUFSIZ);
+                if (bytes_read > 0)
+                {
+                    tty_handle_stdin(input_buffer, bytes_read);
+                    tty_flush(tty);
+                    stream.last_activity = pace_now();
+                }
+                input_done = (bytes_read == 0) || ((bytes_read < 0) && (errno != EAGAIN) && (errno != EINTR));
+            }
+            if (input_done && !input_file)
+            {
+                event_remove(STDIN_FILENO);
+            }
+        }
+
+        if ((stream.count > 0) && (tty_stream_write(tty, &stream) != TIO_SUCCESS))
+        {
+            tty_disconnect(tty);
+            return TIO_ERROR;
+        }
+
+        /* Write out output of this iteration when due */
+        print_flush_check(status > 0);
+
+        if (tty->rx_left == 0)
+        {
+            break;
+        }
+
+        if (input_done && (stream.count == 0) && !drained)
+        {
+            drained = tty_stream_drained(tty);
+        }
+
+        if (drained && (option.stream_size == 0) && (option.stream_timeout == 0))
+        {
+            break;
+        }
+
+        if ((option.stream_timeout > 0) &&
+            ((pace_now() - stream.last_activity) >= (uint64_t) option.stream_timeout * 1000000))
+        {
+            break;
+        }
     }
 
+    tty_disconnect(tty);
+    return TIO_SUCCESS;
+}
+
+int tty_connect(void)
+{
+    char   input_buffer[BUFSIZ];
+    bool   reconnect = (ttys_count > 1) && !option.no_autoconnect;
+    int    connected_count = 0;
+    int    status;
+
     /* Manage print output mode */
     if (option.hex_mode)
     {
         print = print_hex;
+        print_buffer = option.hex_dump ? print_hex_dump_buffer : print_hex_buffer;
         print_mode = HEX;
     }
     else
     {
         print = print_normal;
+        print_buffer = print_normal_buffer;
         print_mode = NORMAL;
     }
 
-    /* Save current port settings */
-    if (tcgetattr(fd, &tio_old) < 0)
+    /* Connect tty devices */
+    for (int i = 0; i < ttys_count; i++)
     {
-        goto error_tcgetattr;
+        if (tty_open(&ttys[i]) == TIO_SUCCESS)
+        {
+            connected_count++;
+        }
+        else if (ttys_count == 1)
+        {
+            return TIO_ERROR;
+        }
     }
 
-#ifdef HAVE_IOSSIOSPEED
-    if (!standard_baudrate)
+    /* Generate benchmark pattern once receiving is set up */
+    if (option.bench)
     {
-        /* OS X wants these fields left alone. We'll set baudrate with iossiospeed below. */
-        tio.c_ispeed = tio_old.c_ispeed;
-        tio.c_ospeed = tio_old.c_ospeed;
+        bench_start(ttys[0].fd);
     }
-#endif
 
-    /* Make sure we restore tty settings on exit */
-    if (first)
+    /* Scripts piping data through tio are served by the streaming loop */
+    if (!interactive_mode && (ttys_count == 1) && !option.bench && (option.socket == NULL) &&
+        (option.script_filename == NULL))
     {
-        atexit(&tty_restore);
-        first = false;
+        return tty_stream(&ttys[0]);
     }
 
-    /* Activate new port settings */
-    status = tcsetattr(fd, TCSANOW, &tio);
-    if (status == -1)
-    {
-        error_printf_silent("Could not apply port settings (%s)", strerror(errno));
-        goto error_tcsetattr;
-    }
+    /* Start script, it continues as data is received and its timers expire */
+    tty_script_run(tty_active);
 
-#ifdef HAVE_TERMIOS2
-    if (!standard_baudrate)
+    /* Input loop */
+    while (reconnect || (connected_count > 0))
     {
-        if (setspeed2(fd, option.baudrate) != 0)
+        /* Block until input becomes available, periodically retry lost devices */
+        status = event_wait(tty_event_timeout(reconnect && (connected_count < ttys_count)));
+        if (stats_tick())
         {
-            error_printf_silent("Could not set baudrate speed (%s)", strerror(errno));
-            goto error_setspeed;
+            tty_stats_publish();
         }
-    }
-#endif
-
-#ifdef HAVE_IOSSIOSPEED
-    if (!standard_baudrate)
-    {
-        if (iossiospeed(fd, option.baudrate) != 0)
+        if (signal_hangup_pending())
         {
-            error_printf_silent("Could not set baudrate speed (%s)", strerror(errno));
-            goto error_setspeed;
+            log_reopen();
         }
-    }
-#endif
-
-    /* Input loop */
-    while (true)
-    {
-        FD_ZERO(&rdfs);
-        FD_SET(fd, &rdfs);
-        FD_SET(STDIN_FILENO, &rdfs);
-        maxfd = MAX(fd, STDIN_FILENO);
-        maxfd = MAX(maxfd, socket_add_fds(&rdfs, true));
-
-        /* Block until input becomes available */
-        status = select(maxfd + 1, &rdfs, NULL, NULL, NULL);
         if (status > 0)
         {
-            bool forward = false;
-            if (FD_ISSET(fd, &rdfs))
+            for (int i = 0; i < ttys_count; i++)
             {
-                /* Input from tty device ready */
-                ssize_t bytes_read = read(fd, input_buffer, BUFSIZ);
-                if (bytes_read <= 0)
-                {
-                    /* Error reading - device is likely unplugged */
-                    error_printf_silent("Could not read from tty device");
-                    goto error_read;
-                }
+                struct tty_t *tty = &ttys[i];
 
-                /* Update receive statistics */
-                rx_total += bytes_read;
+                /* Flush output queued for slow socket clients */
+                socket_handle_output(tty->socket);
 
-                /* Process input byte by byte */
-                for (int i=0; i<bytes_read; i++)
+                if (tty->connected && event_ready(tty->reader ? reader_event_fd(tty->reader) : tty->fd))
                 {
-                    input_char = input_buffer[i];
-
-                    /* Print timestamp on new line if enabled */
-                    if (next_timestamp && input_char != '\n' && input_char != '\r')
-                    {
-                        now = current_time();
-                        if (now)
-                        {
-                            ansi_printf_raw("[%s] ", now);
-                            if (option.log)
-                            {
-                                log_printf("[%s] ", now);
-                            }
-                            next_timestamp = false;
-                        }
-                    }
-
-                    /* Map input character */
-                    if ((input_char == '\n') && (map_i_nl_crnl))
+                    if (tty_read(tty, input_buffer) != TIO_SUCCESS)
                     {
-                        print('\r');
-                        print('\n');
-                        if (option.timestamp)
+                        tty_disconnect(tty);
+                        connected_count--;
+                        if (ttys_count == 1)
                         {
-                            next_timestamp = true;
+                            return TIO_ERROR;
                         }
                     }
-                    else
-                    {
-                        /* Print received tty character to stdout */
-                        print(input_char);
-                    }
-
-                    /* Write to log */
-                    if (option.log)
+                    else if (monitor_due(tty->monitor))
                     {
-                        log_putc(input_char);
+                        tty_monitor_check(tty);
                     }
+                }
 
-                    socket_write(input_char);
-
-                    print_tainted = true;
-
-                    if (input_char == '\n' && option.timestamp)
-                    {
-                        next_timestamp = true;
-                    }
+                /* Modem line change */
+                if (tty->connected && (tty->monitor != NULL) && event_ready(monitor_event_fd(tty->monitor)))
+                {
+                    monitor_acknowledge(tty->monitor);
+                    tty_monitor_check(tty);
                 }
             }
-            else if (FD_ISSET(STDIN_FILENO, &rdfs))
+
+            if (event_ready(STDIN_FILENO))
             {
                 /* Input from stdin ready */
                 ssize_t bytes_read = read(STDIN_FILENO, input_buffer, BUFSIZ);
                 if (bytes_read <= 0)
                 {
                     error_printf_silent("Could not read from stdin");
-                    goto error_read;
-                }
-
-                /* Process input byte by byte */
-                for (int i=0; i<bytes_read; i++)
-                {
-                    input_char = input_buffer[i];
-
-                    /* Forward input to output */
-                    output_char = input_char;
-                    forward = true;
-
-                    if (interactive_mode)
-                    {
-                        /* Do not forward ctrl-t key */
-                        if (input_char == KEY_CTRL_T)
-                        {
-                            forward = false;
-                        }
-
-                        /* Handle commands */
-                        handle_command_sequence(input_char, previous_char, &output_char, &forward);
-
-                        /* Save previous key */
-                        previous_char = input_char;
-
-                        if (print_mode == HEX)
-                        {
-                            if (!is_valid_hex(input_char))
-                            {
-                                warning_printf("Invalid hex character: '%d' (0x%02x)", input_char, input_char);
-                                forward = false;
-                            }
-                        }
-                    }
-
-                    if (forward)
+                    for (int i = 0; i < ttys_count; i++)
                     {
-                        forward_to_tty(fd, output_char);
+                        tty_disconnect(&ttys[i]);
                     }
+                    return TIO_ERROR;
                 }
 
-                tty_flush(fd);
+                tty_handle_stdin(input_buffer, bytes_read);
+
+                if (tty_active->connected)
+                {
+                    tty_flush(tty_active);
+                }
             }
-            else
+
+            for (int i = 0; i < ttys_count; i++)
             {
-                forward = socket_handle_input(&rdfs, &output_char);
+                /* Input from socket client ready */
+                struct tty_t *tty = &ttys[i];
+                ssize_t bytes_read = socket_handle_input(tty->socket, input_buffer, BUFSIZ);
 
-                if (forward)
+                if (tty->connected && (bytes_read > 0))
                 {
-                    forward_to_tty(fd, output_char);
+                    forward_buffer_to_tty(tty, input_buffer, bytes_read);
+                    tty_flush(tty);
                 }
-
-                tty_flush(fd);
             }
         }
         else if (status == -1)
         {
-            error_printf("Error: select() failed (%s)", strerror(errno));
+            error_printf("Waiting for events failed (%s)", strerror(errno));
             exit(EXIT_FAILURE);
         }
-    }
 
-    return TIO_SUCCESS;
+        /* Resume script waiting for time to pass */
+        tty_script_run(tty_active);
 
-#if defined (HAVE_TERMIOS2) || defined (HAVE_IOSSIOSPEED)
-error_setspeed:
-#endif
-error_tcsetattr:
-error_tcgetattr:
-error_read:
-    tty_disconnect();
-error_open:
-    return TIO_ERROR;
-}
+        /* Continue file transfers as device accepts output and receiver responds */
+        for (int i = 0; i < ttys_count; i++)
+        {
+            tty_transfer_run(&ttys[i]);
+        }
 
-void list_serial_devices(void)
-{
-    DIR *d = opendir(PATH_SERIAL_DEVICES);
-    if (d)
-    {
-        struct dirent *dir;
-        while ((dir = readdir(d)) != NULL)
+        /* Write out output of this iteration when due */
+        print_flush_check(status > 0);
+
+        if (option.bench && bench_done())
+        {
+            tty_disconnect(&ttys[0]);
+            return TIO_SUCCESS;
+        }
+
+        /* Retry lost tty devices when they show up or their retry is due */
+        if (reconnect && (connected_count < ttys_count))
         {
-            if ((strcmp(dir->d_name, ".")) && (strcmp(dir->d_name, "..")))
+            for (int i = 0; i < ttys_count; i++)
             {
-#ifdef __APPLE__
-#define TTY_DEVICES_PREFIX "tty."
-                if (!strncmp(dir->d_name, TTY_DEVICES_PREFIX, sizeof(TTY_DEVICES_PREFIX) - 1))
-#endif
-                printf("%s%s\n", PATH_SERIAL_DEVICES, dir->d_name);
+                if (!ttys[i].connected && tty_retry_due(&ttys[i]) &&
+                    (tty_open(&ttys[i]) == TIO_SUCCESS))
+                {
+                    connected_count++;
+                }
             }
         }
-        closedir(d);
     }
+
+    return TIO_ERROR;
+}
+
+/* Play back capture file to tty device */
+int tty_replay(void)
+{
+    struct tty_t *tty = &ttys[0];
+    int status;
+
+    if (tty_open(tty) != TIO_SUCCESS)
+    {
+        return TIO_ERROR;
+    }
+
+    status = capture_replay(option.replay_filename, tty->fd);
+
+    tcdrain(tty->fd);
+    tty_disconnect(tty);
+
+    return status;
 }
@@ -27,8 +27,11 @@
 #define KEY_B 0x62
 #define KEY_C 0x63
 #define KEY_E 0x65
+#define KEY_F 0x66
 #define KEY_H 0x68
 #define KEY_L 0x6C
+#define KEY_N 0x6E
+#define KEY_P 0x70
 #define KEY_Q 0x71
 #define KEY_S 0x73
 #define KEY_T 0x74
@@ -38,6 +41,9 @@
 #define KEY_D 0x64
 #define KEY_R 0x72
 #define KEY_SHIFT_L 0x4C
+#define KEY_X 0x78
+#define KEY_SHIFT_X 0x58
+#define KEY_SHIFT_Y 0x59
 
 #define NORMAL 0
 #define HEX 1
@@ -47,6 +53,9 @@ extern bool interactive_mode;
 void stdout_configure(void);
 void stdin_configure(void);
 void tty_configure(void);
+void tty_log_open(void);
+void tty_capture_open(void);
+void tty_socket_configure(void);
 int tty_connect(void);
+int tty_replay(void);
 void tty_wait_for_device(void);
-void list_serial_devices(void);